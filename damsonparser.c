@@ -11,51 +11,718 @@ sent to a log that can be reviewed.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+// For pixel buffer objects
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #include <time.h>
 #include <pthread.h>
 // For POSIX piping
 #include <unistd.h>
+// For memory mapped files
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 // For PNG files
 #include <png.h>
+// For compressed input
+#include <zlib.h>
+#include <lzma.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+// For producers connecting over sockets and FIFOs
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+// For input file patterns
+#include <glob.h>
+// For following logs as they're written
+#include <sys/inotify.h>
+#include <poll.h>
 
 // Program defines
 #include "damsonparser.h"
 
 // Defines:
-#define MAX_CHARS       65536
+#define READ_BUFFER_SIZE    1048576
+// Size of the tiles the scene is stored and tracked in
+#define TILE_SIZE           64
+#define TILE_BYTES          (TILE_SIZE * TILE_SIZE * sizeof(unsigned int))
+// Largest scene side accepted, and the zoom range of the visualiser (as powers of two)
+#define MAX_SCENE_SIZE      32768
+#define MIN_ZOOM            -8
+#define MAX_ZOOM            5
+// How four pixels become one in the level above them in a store's pyramid
+#define MIP_AVERAGE         0
+#define MIP_LATEST          1
+// Draw events sent from the parser to the compositor
+#define DRAW_EVENT_PIXEL    0
+#define DRAW_EVENT_SCENE    1
+#define DRAW_EVENT_FRAME    2
+#define DRAW_EVENT_SPAN     3
+#define DRAW_QUEUE_SIZE     65536
+#define COMPOSITOR_BATCH    16384
+// Binary draw-event traces
+#define TRACE_MAGIC         "DAMSONTR"
+#define TRACE_VERSION       1
+#define CACHE_MAGIC         "DAMSONPC"
+#define CACHE_VERSION       1
+#define CACHE_FINGERPRINT   65536
+#define CACHE_FNV_BASIS     0xCBF29CE484222325ULL
+// Results of LoadParseCache
+#define CACHE_MISSING       0
+#define CACHE_RESUME        1
+#define CACHE_CURRENT       2
+// Marks a newly published slot of the information panel text
+#define INFO_FRESH          4
+// Compressed input formats, recognised by their first bytes
+#define COMPRESSION_NONE    0
+#define COMPRESSION_GZIP    1
+#define COMPRESSION_XZ      2
+#define COMPRESSION_ZSTD    3
+// How -compare shows the two scenes
+#define COMPARE_SPLIT       0
+#define COMPARE_DIFFERENCE  1
+// Units for the time-lapse frame stride
+#define FRAME_UNIT_DRAWS    0
+#define FRAME_UNIT_LINES    1
+#define FRAME_UNIT_TIMEOUTS 2
+// Handlers a line recognition rule can send a line to
+#define RULE_DRAW           0
+#define RULE_SCENE          1
+#define RULE_SUMMARY        2
+#define RULE_ERROR          3
+#define RULE_NOFILE         4
+#define RULE_IGNORE         5
+#define RULE_SPAN           6
+#define RULE_RECT           7
+#define RULE_RLE            8
+#define RULE_HANDLERS       9
+// Handlers of the bulk draw commands
+#define RULE_BULK           ((1 << RULE_SPAN) | (1 << RULE_RECT) | (1 << RULE_RLE))
+// Where in a line a rule's pattern must be found
+#define RULE_ANYWHERE       0
+#define RULE_PREFIX         1
+#define RULE_LINE           2
+#define MAX_RULES           32
+#define MAX_RULE_LENGTH     63
+// Producers read by the listener, and the lines parsed from one before moving on to the next
+#define MAX_PRODUCERS       64
+#define MAX_FIFOS           16
+#define PRODUCER_BATCH      65536
+// Log files merged onto one scene
+#define MAX_INPUT_FILES     256
+#define STAMP_KEY_BITS      40
+// Followed logs are checked at least this often, and end once idle this long after their summary
+#define FOLLOW_POLL_MS      200
+#define FOLLOW_END_IDLE_MS  2000
 // Use the Error function for warnings
 #define Warning         Error
+// Parser counters have a single writer at a time, so a relaxed store is all they need
+#define CountStat(field, n) __atomic_store_n(&Parser->stats.field, Parser->stats.field + (n), __ATOMIC_RELAXED)
+// Parallel workers add their counts to the shared counters every so many lines
+#define STATS_FLUSH_LINES   65536
+
+// A pattern that identifies a kind of line, and the handler those lines are sent to
+typedef struct
+{
+    int handler;                // One of the RULE_ handlers
+    int position;               // RULE_ANYWHERE, RULE_PREFIX or RULE_LINE (the whole line)
+    int matchCase;              // Non-zero if the pattern is case sensitive
+    int length;
+    char pattern[MAX_RULE_LENGTH + 1];
+} LineRule;
+
+// The rules compiled into a single automaton. Characters are folded to lower case on the
+// way in, so case sensitive rules are confirmed when they match.
+typedef struct
+{
+    int ruleCount, stateCount;
+    LineRule rules[MAX_RULES];
+    uint16_t (*next)[256];      // Transitions, indexed by state and character
+    uint32_t *accept;           // Rules whose patterns end in each state
+    uint32_t handlerRules[RULE_HANDLERS];
+} LineRecognizer;
+
+// Structure describing a line of DAMSON output after a single pass
+typedef struct
+{
+    int length;                 // Length of the line without the new line character
+    int handlers;               // Handlers whose rules the line satisfies (bits of RULE_)
+    int drawEnd;                // Location after the first draw keyword
+    int bulkEnd, bulkHandler;   // Location after the first bulk draw keyword, and its handler
+    int lastNonNumeric;         // Last character that is not a digit or white space
+    int lBrack, rBrack;         // Draw call parentheses
+    int eqsign, comsign;        // Draw call equals and comma
+    int drawFault;              // Return code for a disfigured draw call (0 if none)
+    int eqWarnings;             // Number of equals encountered before closing parentheses
+} LineScan;
+
+// A bulk draw command, checked against the scene and ready to be applied
+typedef struct
+{
+    int handler;                // RULE_SPAN, RULE_RECT or RULE_RLE
+    int x, y, width, height;    // Region filled. The runs of an rle command fill its width.
+    unsigned int colour;        // Colour of a span or rectangle
+    const char *runs;           // Run lengths and colours of an rle command
+} BulkDraw;
+
+// Counters describing the progress of the parser. They are only ever written by the thread
+// parsing the input, or by the parallel workers while it waits, and may be read at any time.
+typedef struct
+{
+    uint64_t lines;             // Lines read
+    uint64_t bytes;             // Bytes read
+    uint64_t draws;             // Draws applied
+    uint64_t debug;             // Lines taken to be debug information
+    uint64_t timeouts;          // Timeout lines
+    uint64_t warnings[11];      // Disfigured lines by ParseLine return code (4 to 10)
+} ParserStats;
+
+// A line that a parallel worker could not resolve on its own
+typedef struct
+{
+    size_t offset;              // Byte offset of the line within the file
+    long lineNo;                // Line number relative to the start of its chunk
+    int instruction;            // The line is stored as the last instruction
+    ParserStats counts;         // Counts of the chunk up to and including this line
+} DeferredLine;
+
+// A scene split into tiles of TILE_SIZE square. Tiles are allocated when they're first written,
+// so memory follows the area drawn on rather than the size of the scene. Unwritten pixels are 0.
+// A store may have a pyramid of levels above it, each half the size of the one below. The
+// levels are only brought up to date from the tiles that have changed when they're needed.
+typedef struct TileStore
+{
+    int width, height;
+    int tilesX, tilesY;
+    unsigned int **tiles;       // Row by row from the bottom of the scene. NULL until written.
+    long tileCount;             // Tiles allocated
+    unsigned char *changed;     // Tiles written since the level above was updated (NULL without one)
+    struct TileStore *above;    // The next level of the pyramid, if any
+    int combine;                // MIP_AVERAGE or MIP_LATEST
+} TileStore;
+
+// The state of the parser for one input. The pixel store belongs to the thread parsing into
+// it; the visualiser is sent its changes as draw events.
+typedef struct
+{
+    TileStore pixelStore;       // Has no tiles array until a scene is described
+    int sceneWidth, sceneHeight;
+    int theEnd;                 // The end summary has been reached
+    int graphicsFlag;           // 1 once the scene is known, -1 if parsing failed
+    int queue;                  // Draw queue feeding the compositor
+    char *filename;             // Input being parsed (empty for the standard input)
+    char *headerLine1, *headerLine2, *headerLine3;
+    char lastInstruction[256];  // Last read instruction
+    char errorLine1[256], errorLine2[256];
+    char errorRot;
+    char workspaceMessage[256]; // The end information
+    char executionMessage[256];
+    char computingMessage[256];
+    char standbyTkMessage[256];
+    char avgSearchMessage[256];
+    int currentLine;            // Line being parsed
+    uint64_t currentOffset;     // Offset of the line being parsed
+    int shared;                 // A producer drawing into the scene shared by all producers
+    uint64_t stampBase;         // Key of the first line when merging files
+    ParserStats stats;
+} ParseContext;
+
+// A reading of the parser counters, with the rates since the previous reading
+typedef struct
+{
+    ParserStats counts;
+    struct timespec time;
+    double linesPerSecond, bytesPerSecond;
+} StatsSample;
+
+// A newline aligned section of a memory mapped file
+typedef struct
+{
+    size_t start, end;          // Byte range of the chunk
+    long lines;                 // Number of lines within the chunk
+    long draws;                 // Number of draws applied by the worker
+    size_t lastDraw;            // Offset (plus one) of the last draw applied by the worker
+    size_t lastInstruction;     // Offset (plus one) of the last line stored as the last instruction
+    int sceneChange;            // A scene description was found
+    ParserStats counts;         // Counts added to the parser counters by the worker
+    DeferredLine *deferred;     // Lines that must be parsed in order
+    long deferredCount, deferredSize;
+} ParseChunk;
+
+// The chunks of a memory mapped file shared between worker threads
+typedef struct
+{
+    char *map;                  // Contents of the file
+    ParseChunk *chunks;
+    int chunkCount;
+    int nextChunk;              // Next chunk to be taken by a worker
+    int nextWorker;             // Draw queue of the next worker to start
+    size_t limit;               // Offset at which workers stop
+    int silent;                 // Drop deferred lines and apply their draws
+    void *context;              // Parser context the workers parse into
+} ParallelJob;
+
+// Reads lines from a file descriptor in large blocks
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t size;                // Capacity of the buffer
+    size_t start;               // Start of the next line
+    size_t end;                 // End of the data read so far
+    size_t scanned;             // Data before this has no line ending
+    int eof;                    // The input has ended
+    int nonblocking;            // Return rather than wait when no data is ready
+    int follow;                 // The end of the file is waited on, not taken as the end of input
+} LineReader;
+
+// A simulator instance sending its output over a socket or FIFO. Each is parsed in a context of
+// its own, so headers, line numbers and the end summary are kept apart, but its draws go into
+// the scene shared by all producers.
+typedef struct
+{
+    ParseContext context;
+    LineReader reader;
+    char name[64];
+    int lineNo;
+    int fifo;                   // Index of the FIFO read, or -1 for a socket connection
+    int ready;                  // Stopped with lines still waiting in the reader's buffer
+    uint64_t buffered;          // Bytes read but not yet parsed
+    StatsSample sample;         // Rates shown in the information panel
+} Producer;
+
+// A compressed file being decompressed into a pipe for the parser
+typedef struct
+{
+    char *filename;
+    int format;                 // One of the COMPRESSION_ formats
+    int in;                     // The compressed file
+    int out;                    // Write end of the pipe
+} Decompressor;
+
+// A PNG file waiting to be written by the encoder thread
+typedef struct
+{
+    char filename[512];
+    TileStore *store;           // Copy of the pixels. Freed once written.
+    int width, height;
+    int snapshot;               // Requested from the visualiser
+} PNGJob;
+
+// A change to the scene sent from the parser to the compositor
+typedef struct
+{
+    unsigned int type;          // DRAW_EVENT_PIXEL, DRAW_EVENT_SCENE, DRAW_EVENT_FRAME or DRAW_EVENT_SPAN
+    unsigned int x, y;          // Pixel location (the first of a span), or the scene width and height
+    unsigned int colour;        // Pixel colour
+    union
+    {
+        TileStore *frame;       // Copy of the pixel store for DRAW_EVENT_FRAME. Freed by the compositor.
+        unsigned int length;    // Number of pixels in a DRAW_EVENT_SPAN
+    };
+} DrawEvent;
+
+// Lock-free ring of draw events with a single producer and a single consumer
+typedef struct
+{
+    DrawEvent *events;
+    unsigned int head;          // Next event to be written. Only changed by the producer.
+    unsigned int tail;          // Next event to be read. Only changed by the compositor.
+} DrawQueue;
+
+// A copy of the scene kept by the compositor for the renderer
+typedef struct
+{
+    int width, height;
+    TileStore pixels;           // Colours in the pixel store format
+    TileStore times;            // Time each pixel was last drawn (see activityMillis)
+} FrameBuffer;
+
+// Text shown in the information panel, copied from the parser
+typedef struct
+{
+    char header[3][256];
+    char instruction[256];
+    char error[2][256];
+    int theEnd;
+    char summary[5][256];
+} InfoText;
+
+// Start of a binary trace file. The draw events follow, then the text shown in the summary as
+// null terminated strings: the three header lines, the last instruction, the last error (two
+// lines) and the five end messages.
+typedef struct
+{
+    char magic[8];              // TRACE_MAGIC
+    uint32_t version;           // TRACE_VERSION
+    uint32_t width, height;     // Scene dimensions (0 if no scene was described)
+    int32_t status;             // Graphics flag once parsing ended (1 if successful)
+    uint32_t theEnd;            // The end summary was reached
+    uint32_t headerLines;       // Bit n is set if header line n + 1 was read
+    uint64_t eventCount;
+    uint64_t eventOffset;       // Offset of the draw events
+    uint64_t textOffset;        // Offset of the text
+    uint64_t textLength;
+} TraceHeader;
+
+// Start of a parse cache, kept beside a log with the extension .dpcache. The log is known by its
+// full path, by fingerprints of its first bytes and of the bytes before the offset reached, and
+// while unchanged by its size and modification time. The parser's state at that offset follows:
+// each drawn tile as its index and pixels, then the summary text as in a trace, then the path.
+typedef struct
+{
+    char magic[8];              // CACHE_MAGIC
+    uint32_t version;           // CACHE_VERSION
+    uint32_t width, height;     // Scene dimensions (0 if no scene was described)
+    int32_t status;             // Graphics flag once parsing ended
+    uint32_t theEnd;            // The end summary was reached
+    uint32_t headerLines;       // Bit n is set if header line n + 1 was read
+    uint32_t resumable;         // Parsing ended at the end of a line, so it can carry on from there
+    uint64_t settings;          // Fingerprint of the rules and options used
+    uint64_t offset;            // Bytes of the log parsed
+    int64_t logModified;        // Modification time of the log in nanoseconds
+    uint64_t prefixLength, prefix;
+    uint64_t tailLength, tail;  // The bytes ending at the offset
+    uint64_t tileCount;
+    uint64_t tileOffset;        // Offset of the drawn tiles
+    uint64_t textOffset;        // Offset of the text
+    uint64_t textLength;
+    uint64_t pathOffset;        // Offset of the log's full path
+    ParserStats stats;          // Counters once parsing ended
+} CacheHeader;
+
+// A draw applied to the pixel store
+typedef struct
+{
+    uint32_t x, y;
+    uint32_t colour;            // Pixel store format
+    uint32_t line;              // Line of the log the draw came from
+} TraceEvent;
+
+// A copy of the pixel store taken while parsing, used to seek within a replay. It holds the
+// draws of every line before the one it was taken at.
+typedef struct
+{
+    uint64_t draws;             // Number of draws applied before the copy was taken
+    uint32_t line;              // Line the copy was taken before
+    uint32_t drawLine;          // Last line with a draw in the copy
+    uint64_t offset;            // Byte offset of the line in the log, or index of its first draw in a trace
+    TileStore *pixels;
+} Keyframe;
+
+// Number of pixels that differ between the compared scenes, and the box that holds them
+typedef struct
+{
+    uint64_t count;
+    int left, top, right, bottom;
+} CompareReport;
 
 // Prototypes
 void Error(const char* format, ...);
+void InitParseContext(ParseContext *context, int queue);
+void InitTileStore(TileStore *store, int width, int height);
+void ClearTileStore(TileStore *store);
+void FreeTileStore(TileStore *store);
+unsigned int *allocateTile(TileStore *store, int tile);
+unsigned int *storePixel(TileStore *store, int x, int y);
+void fillPixels(unsigned int *pixels, int count, unsigned int value);
+void fillStoreSpan(TileStore *store, int x, int y, int length, unsigned int value);
+unsigned int readPixel(TileStore *store, int x, int y);
+int tileDrawn(TileStore *store, int x, int y);
+void readStoreRow(TileStore *store, int y, unsigned int *row);
+void CopyTileStore(TileStore *to, TileStore *from);
+TileStore *DuplicateTileStore(TileStore *from);
+void DeleteTileStore(TileStore *store);
+void AddTileLevels(TileStore *store, int combine);
+void updateParentTexels(TileStore *level, int tile);
+TileStore *UpdateTileLevels(TileStore *store, int levels);
+int wrapPixel(int width, int height, int *x, int *y);
 void initialisePixelStore();
 void clearPixelStore();
+void markAllTilesDirty();
+void setGraphicsFlag(int flag);
 void reshapeFunc(int newWidth, int newHeight);
-void idleFunc(void);
-void fadeActivity(void);
+int sceneChanged(void);
+void requestRedraw(void);
+void timerFunc(int value);
+unsigned int activityMillis(void);
+void initialiseActivityFade(void);
+int fadeActivityTile(unsigned int *times, unsigned int *alpha);
+double viewScale(int zoom);
+int viewLevel(int zoom);
+int levelTilesAcross(int tiles, int level);
+long visibleTileCount(int zoom);
+void visibleTiles(int level, int *x0, int *y0, int *x1, int *y1);
+void clampView(void);
+void fitView(void);
+void panView(double dx, double dy);
+void zoomView(int steps, int x, int y);
+void initialiseTextures(void);
+FrameBuffer *acquireFrontFrame(void);
+void releaseFrontFrame(void);
+int fetchInfoText(void);
+int tileSlot(int tile, int *fresh);
+void resetAtlasSlots(void);
+int takeTileFlags(unsigned char *flags, int level, int tile, int clear);
+void setTileFlags(unsigned char *flags, int level, int tile, unsigned char value);
+int fillUploadTile(TileStore *store, int tile, unsigned int *out, int activity);
+unsigned long uploadTiles(GLuint texture, TileStore *store, int count, int activity);
+void drawAtlasTiles(GLuint texture, TileStore *store, int count);
+unsigned long drawVisibleTiles(FrameBuffer *frame);
+void pngRowWritten(png_structp png_ptr, png_uint_32 row, int pass);
+int writePNGStore(char *filename, TileStore *store);
+TileStore *outputLevel(TileStore *store);
 void writePNGFile(char *filename);
+void *EncoderThreadFunc(void *arg);
+int EncoderHasRoom(void);
+int QueuePNGJob(char *filename, TileStore *store, int snapshot);
+void WaitForEncoder(void);
+void setSnapshotStatus(const char *format, ...);
+int getSnapshotStatus(char *text, size_t size);
+void CaptureSnapshot(void);
+void ServiceSnapshotRequest(void);
+void FinishParsing(void);
+void CaptureTimelapseFrame(void);
+void TimelapseTick(char *line, int dcheck);
+void FinishTimelapse(void);
+void writeSummaryFile(char *filename);
+void writeContextSummary(FILE *fp, ParseContext *context);
+void adoptContextSummary(ParseContext *to, ParseContext *from);
+int SaveHeadlessOutput(void);
 void keyboardFunc(unsigned char key, int xmouse, int ymouse);
 void specialFunc(int key, int x, int y);
+void mouseFunc(int button, int state, int x, int y);
+void motionFunc(int x, int y);
 static void printToScreen(int inset, const char *format, ...);
 void displayFunc(void);
 void initialiseGLUT(int argc, char *argv[]);
+void postDrawEvent(int queue, unsigned int type, unsigned int x, unsigned int y, unsigned int colour, TileStore *frame);
+void postDrawSpan(int queue, unsigned int x, unsigned int y, unsigned int length, unsigned int colour);
+void publishPixelStore(void);
+void waitForCompositor(void);
+void wakeCompositor(void);
+void waitForDrawQueue(DrawQueue *q, unsigned int limit);
+int drawEventsWaiting(unsigned int *tails);
+void leaveFrame(int frame);
+void applyDrawEvents(FrameBuffer *frame, DrawEvent *events, int count, unsigned int now, int markTiles);
+int takeDrawEvents(DrawQueue *queue, unsigned int head, unsigned int *tail, DrawEvent *batch, int count, int *resize);
+void *CompositorThreadFunc(void *arg);
+void StartCompositor(void);
+void PublishInfoText(void);
+unsigned int packColour(float RVal, float GVal, float BVal);
+void stampPixel(int x, int y, uint64_t key, unsigned int colour);
+void stampSpan(int x, int y, int length, uint64_t key, unsigned int colour);
+void clearStamps(void);
+void applyStamps(void);
 void setPixel(int x, int y, float RVal, float GVal, float BVal);
+void fillSpan(int x, int y, int length, unsigned int colour, uint64_t key, int queue);
 int DAMSONHeaderCheck(char *line, int idx);
+int CompileRules(const LineRule *rules, int count);
+int LoadRules(char *filename);
+void ScanLine(char *line, LineScan *scan);
+void ScanLineKeywords(char *line, LineScan *scan);
+void StoreLastInstruction(char *line, int len);
+int ParseIntFast(const char **text, int *value);
+int ParseFloatFast(const char **text, float *value);
+int ReadDrawValuesScanf(char *line, LineScan *scan, int *x, int *y, float *RVal, float *GVal, float *BVal);
+int ReadDrawValues(char *line, LineScan *scan, int *x, int *y, float *RVal, float *GVal, float *BVal);
+int readBulkInt(const char **text, int *value);
+int readBulkFloat(const char **text, float *value);
+int readBulkRun(const char **text, int *length, unsigned int *colour);
+int ReadBulkDraw(char *line, LineScan *scan, BulkDraw *bulk);
+void ApplyBulkDraw(BulkDraw *bulk, uint64_t key, int queue);
+int ParseBulkDraw(char *line, LineScan *scan, int lineNo);
+void BenchmarkDrawParsing(long count);
+uint64_t nextRandom(void);
+int GenerateLog(char *filename);
+void ResetParser(void);
+void readStats(ParserStats *counts);
+void addStats(ParserStats *counts, ParserStats *add, int sign);
+void flushChunkStats(ParseChunk *chunk, ParserStats *pending);
+void sampleStats(StatsSample *sample);
+void updateSample(StatsSample *sample, ParserStats *counts);
+void readContextStats(ParseContext *context, ParserStats *counts);
+unsigned int drawQueueDepth(void);
+void writeStatsRow(FILE *fp, StatsSample *sample);
+void *StatsThreadFunc(void *arg);
+void StartStatsThread(void);
+void StopStatsThread(void);
+double elapsedSeconds(struct timespec *start);
+void reportBenchmark(FILE *csv, char *input, const char *stage, double items, double bytes, double seconds, double draws);
+int RunBenchmark(char *filename);
 int ParseLine(char *line, int lineNo);
+int ProcessLine(char *line, int lineNo);
+size_t CopyMappedLine(char *map, size_t pos, size_t end, char **buffer, size_t *bufferSize);
+int ParseMappedLines(char *map, size_t pos, size_t end, int *lineNo, char **buffer, size_t *bufferSize, int count);
+void DeferLine(ParseChunk *chunk, size_t offset, int instruction, ParserStats *pending);
+void ParseChunkLines(ParseChunk *chunk, char *map, size_t limit, int silent, int queue);
+void *ParseChunkThread(void *arg);
+void RunParallelJob(ParallelJob *job, size_t limit, int silent);
+int ProcessFileParallel(char *filename);
+int DetectCompression(char *filename);
+int writeAll(int fd, const unsigned char *data, size_t size);
+void DecompressGzip(Decompressor *job, unsigned char *in, unsigned char *out);
+void DecompressXz(Decompressor *job, unsigned char *in, unsigned char *out);
+void *DecompressThreadFunc(void *arg);
+void ProcessCompressedFile(char *filename, int format);
 void ProcessFile(char *filename);
 void *ProcessFileThread(void *arg);
-void *ProcessPipeThread(void);
+void StopFollowing(int signum);
+int WatchFollowedLog(int notify, char *filename, int previous);
+void RestartFollowedLog(void);
+void FollowFile(char *filename);
+void InitLineReader(LineReader *reader, int fd);
+void FreeLineReader(LineReader *reader);
+char *ReadLine(LineReader *reader, size_t *len);
+void ProcessPipe(int fd);
+void *ProcessPipeThread(void *arg);
+void StopListening(void);
+int StartListening(void);
+int OpenFifo(int index);
+Producer *AddProducer(int fd, int fifo, char *name);
+void AcceptProducers(void);
+void RemoveProducer(Producer *producer);
+int ReadProducer(Producer *producer);
+unsigned long producerBacklog(Producer *producer);
+void *ListenThread(void *arg);
+void wakeListener(void);
+int AddInputFiles(char *pattern);
+void PrepareMerge(void);
+int JoinMergedScene(int width, int height, int lineNo);
+void *MergeFilesWorker(void *arg);
+void *MergeFilesThread(void *arg);
+int OpenTraceOutput(char *filename);
+void RecordTraceEvent(int x, int y, unsigned int colour);
+void RestartTraceEvents(void);
+int FinishTraceOutput(void);
+uint64_t writeSummaryText(FILE *fp);
+uint32_t summaryHeaderLines(void);
+void readSummaryText(const char *text, const char *end, uint32_t headerLines);
+const char *ReadTraceString(const char **text, const char *end);
+int LoadTrace(char *filename);
+void *LoadTraceThread(void *arg);
+char *cachePath(char *filename);
+uint64_t fingerprintBytes(uint64_t hash, const void *data, size_t length);
+uint64_t fingerprintFile(int fd, uint64_t offset, uint64_t length);
+uint64_t parseSettings(void);
+int LoadParseCache(char *filename, uint64_t *offset, int *lineNo);
+void SaveParseCache(char *filename, int stopped);
+void RecordReplayDraws(uint64_t count);
+void AddKeyframe(uint64_t draws, uint32_t line, uint32_t drawLine, uint64_t offset, TileStore *pixels);
+void RestartReplay(uint32_t line, uint64_t offset);
+uint32_t replayNextLine(void);
+int ReplayLogLine(char *line, int post);
+int ReplayReadLine(int post);
+void ReplayForward(uint32_t line, int post);
+int SeekReplay(uint32_t line);
+void StepReplay(int direction);
+void AdvanceReplay(void);
+void StopReplay(void);
+int getReplayStatus(char *text, size_t size);
+unsigned int comparePixel(int side, int x, int y);
+unsigned int differenceColour(unsigned int a, unsigned int b);
+void compareViewSize(int view, int *width, int *height);
+TileStore *renderCompareView(int view, int width, int height);
+void resetDifferences(void);
+void publishDifferences(void);
+int composeCompareView(DrawEvent *batch, int count, int *resize);
+int compareDrawEvent(int side, DrawEvent *event, DrawEvent *batch, int count, int *resize);
+int takeCompareEvents(unsigned int *tails, DrawEvent *batch, int *resize);
+int getCompareStatus(char *text, size_t size);
+void *CompareThreadFunc(void *arg);
+int StartComparison(char *filename, int windowed);
+int SaveComparison(void);
 
 // Global Variables
-char *HeaderLine1, *HeaderLine2, *HeaderLine3, *TheEndText, *LastErrorMessage = "";
-int TheEnd = 0, SceneWidth = 0, SceneHeight = 0, graphicsFlag = -1, NoHeader = 0;
+char *TheEndText, *LastErrorMessage = "";
+int NoHeader = 0;
 pthread_t procThread;
 
-unsigned int *PixelStore;
-unsigned int *ActivityStore;
+// Each thread parses into its own context. Unless it's told otherwise, that's the main one.
+ParseContext MainParser;
+__thread ParseContext *Parser = &MainParser;
+
+// Startup is signalled to the main thread once the scene is known, or parsing has ended
+pthread_mutex_t GraphicsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t GraphicsReady = PTHREAD_COND_INITIALIZER;
+
+
+// Draw events flow from the parser (queue 0) and each parallel worker (queues 1 onwards) to the
+// compositor thread. It applies them to one frame buffer, swaps it to the front, waits for the
+// renderer to leave the other and applies them to that too. Resizes take FrameLock instead.
+DrawQueue *DrawQueues = NULL;
+int DrawQueueCount = 0;
+pthread_t CompositorThread;
+FrameBuffer Frames[2];
+int FrameWidth = 0, FrameHeight = 0;
+int FrontFrame = 0, ReadFrame = -1;
+int FrameReaders[2] = {0, 0};
+pthread_mutex_t FrameLock = PTHREAD_MUTEX_INITIALIZER;
+// The compositor sleeps on CompositorWake while every queue is empty. Threads waiting for room
+// in a queue sleep on QueueSpace, and the compositor waits on FrameReleased for the renderer.
+// Each flag says a thread may be asleep, so the others only take the lock when it's set.
+pthread_mutex_t CompositorLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t CompositorWake = PTHREAD_COND_INITIALIZER, QueueSpace = PTHREAD_COND_INITIALIZER, FrameReleased = PTHREAD_COND_INITIALIZER;
+int CompositorSleeping = 0, QueueWaiters = 0, FrameWaiting = 0;
+
+// Information panel text, triple buffered. The parser fills a slot when the renderer asks.
+InfoText InfoSlots[3];
+int InfoWriteSlot = 0, InfoMiddleSlot = 1, InfoReadSlot = 2, InfoRequested = 0;
+
+// Activity is stored as the time each pixel was last drawn, in milliseconds from ActivityEpoch.
+// The fading overlay is rebuilt from these times for the tiles in view.
+unsigned int ActivityClock = 1;
+struct timespec ActivityEpoch;
+double ActivityHalfLife = 0.5;
+unsigned char *ActivityFade = NULL;
+unsigned int ActivityFadeLength = 0;
+
+// Parallel parsing. The stamp store holds the colour and source offset of the latest draw to
+// each pixel. It's tiled like the pixel store, and a tile is allocated by the first worker to draw on it.
+int ParseThreads = 1;
+uint64_t **StampTiles = NULL;
+__thread uint64_t StampKey = 0;
+
+// Tiles that have changed since they were last uploaded. Activity tiles are live while any pixel
+// is fading, and dirty when their overlay must be rebuilt.
+int TilesX = 0, TilesY = 0;
+unsigned char *DirtyTiles = NULL;
+unsigned char *ActivityDirtyTiles = NULL;
+unsigned char *ActivityLiveTiles = NULL;
+
+// Textures holding the scene and activity, and the pixel buffer object used to fill them. Each
+// texture is an atlas of tile sized slots. Tiles are given a slot when they come into view, taking
+// the least recently drawn slot, and are only uploaded when they're new to it or have changed.
+// The atlas holds tiles of one level of the frame's pyramid at a time.
+GLuint SceneTexture = 0, ActivityTexture = 0, UploadBuffer = 0;
+int TextureWidth = 0, TextureHeight = 0, UsePBO = 0;
+int AtlasSize = 0, AtlasColumns = 0, AtlasSlots = 0, NextSlot = 0, AtlasLevel = 0;
+int *TileSlots = NULL, *SlotTiles = NULL, *VisibleList = NULL, *UploadList = NULL;
+unsigned int *SlotFrames = NULL, AtlasFrame = 0, *UploadTile = NULL;
+unsigned char *SlotActivity = NULL;
+long FrameTiles = 0;
+unsigned long LastUploadBytes = 0, TotalUploadBytes = 0, UploadFrames = 0;
+
+// The part of the scene shown in the window. The scene is scaled by two to the power of ViewZoom,
+// with the point ViewX, ViewY at the bottom left corner of the window.
+double ViewX = 0.0, ViewY = 0.0;
+int ViewZoom = 0, WindowWidth = 0, WindowHeight = 0, DragX = -1, DragY = -1;
+
+// Frame pacing. The window is only redrawn when something on it has changed, at most MaxFPS
+// times a second. The timer stops once parsing is complete and the scene is still.
+int MaxFPS = 30, TimerRunning = 0, RedrawRequested = 1;
+char DrawnSnapshotStatus[600], DrawnReplayStatus[600];
+double FrameTime = 0.0, AchievedFPS = 0.0;
+unsigned int FPSWindowStart = 0, FPSWindowFrames = 0;
 
 // Information flags
 int DisplayInfo;
@@ -67,915 +734,6506 @@ int PrintLoc;
 // Text buffer:
 char ScreenText[256];
 
-// Last read instruction:
-char LastReadInstruction[256];
-char LastReadErrorLine1[256];
-char LastReadErrorLine2[256];
-char LastReadErrorRot = 0;
-
-// The end information:
-char WorkspaceMessage[256];
-char ExecutionMessage[256];
-char ComputingMessage[256];
-char StandbyTkMessage[256];
-char AvgSearchMessage[256];
-
 // Thread for reading
 pthread_t input_thread;
 
+// Headless mode and the files it produces
+int Headless = 0;
+char *OutputFilename = "output.png";
+char *SummaryFilename = "summary.txt";
+
+// Background PNG encoder. Files are written in the order they're queued.
+PNGJob *EncoderQueue = NULL;
+int EncoderHead = 0, EncoderCount = 0, EncoderBusy = 0, MaxFramesInFlight = 8;
+pthread_t EncoderThread;
+pthread_mutex_t EncoderLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t EncoderWake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t EncoderIdle = PTHREAD_COND_INITIALIZER;
+PNGJob EncoderCurrent;
+int EncoderRowsWritten = 0;
+
+// PNG compression settings (-1 uses the libpng defaults), and the pyramid level PNG files are
+// written from (each level halves the size)
+int PNGCompressionLevel = -1, PNGFilter = -1, PNGMipLevel = 0;
+
+// Snapshots requested from the visualiser
+int SnapshotRequested = 0, ParsingComplete = 0, SnapshotSequence = 0;
+char SnapshotStatus[512];
+time_t SnapshotStatusTime = 0;
+
+// Binary traces. Draws are recorded while converting a log, and a trace can be loaded in place of one.
+char *TraceOutputFilename = NULL, *TraceFilename = NULL;
+FILE *TraceOutput = NULL;
+uint64_t TraceEventCount = 0;
+
+// Parse caches. A log's state is saved beside it once parsed, so it can be restored when the log
+// is reopened, and parsed on from there if lines have been added.
+int CacheEnabled = 0;
+
+// Replay. A keyframe is taken every KeyframeSpacing draws, tied to the line and byte offset it
+// was taken at. A log is replayed by reading it again from the nearest keyframe, so only the
+// keyframes are kept in memory. A trace is replayed from its mapped draws. When MaxKeyframes
+// is reached, every other keyframe is dropped and the spacing doubles.
+int ReplayEnabled = 0, ReplayActive = 0, ReplayPlaying = 0, KeyframeCount = 0, MaxKeyframes = 64;
+char *ReplayLogName = NULL, *ReplayBuffer = NULL;
+FILE *ReplayLog = NULL;
+size_t ReplayBufferSize = 0;
+TraceEvent *ReplayEvents = NULL;
+uint64_t ReplayEventCount = 0, ReplayDraws = 0, KeyframeSpacing = 100000, NextKeyframe = 100000;
+uint64_t ReplayOffset = 0, ReplayStartOffset = 0;
+Keyframe *Keyframes = NULL;
+TileStore ReplayStore;
+uint32_t ReplayLine = 0, ReplayLastLine = 0, ReplayLineRate = 1000, SeekLine = 0;
+uint32_t ReplayNextLine = 0, ReplayDrawLine = 0, ReplayStartLine = 0;
+double ReplaySpeed = 1.0, ReplayCarry = 0.0;
+unsigned int ReplayTickTime = 0;
+int SeekDigits = 0;
+
+// Comparison of two runs. The second is parsed into its own context on another thread, and the
+// compositor keeps a copy of each scene to count the differing pixels as draws arrive.
+char *CompareFilename = NULL;
+ParseContext CompareParser;
+pthread_t CompareThreads[2];
+int Comparing = 0, CompareRunning = 0, CompareView = COMPARE_SPLIT, CompareShown = -1;
+TileStore CompareScenes[2];
+int *DiffRows = NULL, *DiffColumns = NULL;
+int DiffWidth = 0, DiffHeight = 0;
+uint64_t DiffCount = 0;
+CompareReport DiffReport;
+pthread_mutex_t CompareLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Synthetic log generation. The mix gives the relative numbers of draw, debug and malformed lines.
+uint64_t GenSeed = 1;
+long GenLines = 1000000;
+int GenWidth = 640, GenHeight = 480, GenLineLength = 60, GenFatal = 0;
+int GenDraw = 60, GenDebug = 35, GenBad = 5;
+
+// Line recognition. The default rules match the keywords DAMSON has always been read by.
+char *RulesFilename = NULL;
+LineRecognizer Recognizer;
+const LineRule DefaultRules[] = {
+    {RULE_NOFILE,  RULE_LINE,     1, 8, "No file?"},
+    {RULE_IGNORE,  RULE_PREFIX,   1, 7, "Timeout"},
+    {RULE_SUMMARY, RULE_PREFIX,   1, 10, "Workspace:"},
+    {RULE_DRAW,    RULE_ANYWHERE, 1, 4, "draw"},
+    {RULE_ERROR,   RULE_ANYWHERE, 0, 5, "error"},
+    {RULE_SCENE,   RULE_ANYWHERE, 0, 9, "dimension"},
+    {RULE_SCENE,   RULE_ANYWHERE, 0, 5, "scene"},
+    {RULE_SPAN,    RULE_ANYWHERE, 1, 5, "span("},
+    {RULE_RECT,    RULE_ANYWHERE, 1, 5, "rect("},
+    {RULE_RLE,     RULE_ANYWHERE, 1, 4, "rle("}
+};
+// Names of the handlers in rule files, and the number of characters that must follow a
+// match anywhere in a line (as the parser has always required)
+const char *RuleHandlerNames[RULE_HANDLERS] = {"draw", "scene", "summary", "error", "nofile", "ignore", "span", "rect", "rle"};
+const int RuleTrailing[RULE_HANDLERS] = {1, 2, 1, 2, 0, 0, 1, 1, 1};
+
+// Output of the generator, input and results of the benchmark
+char *GenerateFilename = NULL;
+char *BenchmarkInput = NULL;
+char *BenchmarkFilename = "benchmark.csv";
+
+// Parser counters are kept in each context. They're shown in the information panel and written
+// to the statistics file.
+uint64_t InputBuffered = 0;
+StatsSample OverlaySample;
+char *StatsFilename = NULL;
+double StatsInterval = 1.0;
+int StatsRunning = 0;
+pthread_t StatsThread;
+pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t StatsWake = PTHREAD_COND_INITIALIZER;
+
+// Producers sending output over a Unix domain socket and named FIFOs. One thread reads them all.
+char *ListenPath = NULL, *FifoPaths[MAX_FIFOS];
+int FifoCount = 0, ListenFd = -1, EpollFd = -1, ListenWakeFd = -1, ProducersSeen = 0, ProducerSequence = 0;
+Producer *Producers[MAX_PRODUCERS];
+int ProducerCount = 0;
+pthread_mutex_t ProducerLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Several log files parsed at once onto one scene. Where they draw on the same pixel, the file
+// given last wins, then the line latest in that file, as if the files had been joined in order.
+char *InputFiles[MAX_INPUT_FILES];
+int InputFileCount = 0, Merging = 0, NextMergeFile = 0, MergeLineBits = STAMP_KEY_BITS;
+ParseContext *MergeContexts = NULL;
+pthread_mutex_t MergeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// A log still being written is followed rather than read to its current end
+int FollowInput = 0;
+volatile sig_atomic_t FollowStopped = 0;
+
+// Time-lapse frames are captured every FrameStride units
+char *TimelapseDir = NULL;
+int FrameUnit = FRAME_UNIT_DRAWS, FrameStride = 1000;
+long FrameCounter = 0, FrameNumber = 0, FramesDropped = 0;
+
 // Function for printing errors
 void Error(const char* format, ...)
 {
+    // Errors can be raised on several threads at once, so each has its own buffer
+    char text[256];
     va_list argpointer;
     va_start(argpointer, format);
-    vsnprintf(ScreenText, 255, format, argpointer);
-    printf("%s", ScreenText);
-    if (LastReadErrorRot == 0)
+    vsnprintf(text, 255, format, argpointer);
+    printf("%s", text);
+    if (Parser->errorRot == 0)
     {
         
-        memset(LastReadErrorLine1, 0, sizeof(char) * 256);
-        memcpy(&LastReadErrorLine1[0], &ScreenText[0], 255);
-        LastReadErrorRot = 1;
+        memset(Parser->errorLine1, 0, sizeof(char) * 256);
+        memcpy(&Parser->errorLine1[0], &text[0], 255);
+        Parser->errorRot = 1;
     }
     else
     {
-        memset(LastReadErrorLine2, 0, sizeof(char) * 256);
-        memcpy(&LastReadErrorLine2[0], &ScreenText[0], 255);
-        LastReadErrorRot = 0;
+        memset(Parser->errorLine2, 0, sizeof(char) * 256);
+        memcpy(&Parser->errorLine2[0], &text[0], 255);
+        Parser->errorRot = 0;
     }
     va_end(argpointer);
 }
 
-void initialisePixelStore()
+// Prepares a parser context for a new input. Its draws are sent to the given queue.
+void InitParseContext(ParseContext *context, int queue)
 {
-    // Ensure we have enough memory to store pixel information
-    PixelStore = (unsigned int *) malloc(sizeof(unsigned int) * SceneWidth * SceneHeight);
-    ActivityStore = (unsigned int *) malloc(sizeof(unsigned int) * SceneWidth * SceneHeight);
-    
-    // Finally, set the space to null:
-    memset(PixelStore, 0, sizeof(unsigned int) * SceneWidth * SceneHeight);
-    memset(ActivityStore, 0, sizeof(unsigned int) * SceneWidth * SceneHeight);
+    memset(context, 0, sizeof(ParseContext));
+    context->graphicsFlag = -1;
+    context->queue = queue;
 }
 
-// Quick function to wipe the pixel store
-void clearPixelStore()
+// Sets up an empty store for a scene of the given size
+void InitTileStore(TileStore *store, int width, int height)
 {
-    // A simple wipe of the memory location:
-    memset(PixelStore, 0, sizeof(unsigned int) * SceneWidth * SceneHeight);
+    store->width = width;
+    store->height = height;
+    store->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    store->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    store->tiles = calloc((size_t) store->tilesX * store->tilesY + 1, sizeof(unsigned int *));
+    store->tileCount = 0;
+    store->changed = NULL;
+    store->above = NULL;
+    store->combine = MIP_AVERAGE;
 }
 
-// Function to define window resizing
-void reshapeFunc(int newWidth, int newHeight)
+// Frees every tile, leaving the store blank
+void ClearTileStore(TileStore *store)
 {
-    // We don't allow this to be resized so change it back:
-    glutReshapeWindow(SceneWidth, SceneHeight);
+    long i;
+    
+    for (i = 0; i < (long) store->tilesX * store->tilesY && store->tileCount > 0; i++)
+        if (store->tiles[i] != NULL)
+        {
+            free(store->tiles[i]);
+            store->tiles[i] = NULL;
+            store->tileCount--;
+        }
+    
+    // A blank store has a blank pyramid
+    if (store->above != NULL)
+    {
+        memset(store->changed, 0, (size_t) store->tilesX * store->tilesY);
+        ClearTileStore(store->above);
+    }
 }
 
-// Function to define what happens in idle time
-void idleFunc(void)
+// Frees a store and everything in it
+void FreeTileStore(TileStore *store)
 {
-    glutPostRedisplay();
+    if (store->above != NULL)
+    {
+        FreeTileStore(store->above);
+        free(store->above);
+    }
+    free(store->changed);
+    store->above = NULL;
+    if (store->tiles != NULL)
+        ClearTileStore(store);
+    free(store->tiles);
+    memset(store, 0, sizeof(TileStore));
 }
 
-// Function to fade activity pixels
-void fadeActivity(void)
+// Returns a tile to be written, allocating it if it hasn't been written before
+unsigned int *allocateTile(TileStore *store, int tile)
 {
-    int i, a;
-    for (i = 0; i < SceneWidth * SceneHeight; i++)
+    if (store->tiles[tile] == NULL)
     {
-        a = ActivityStore[i] >> 24;
-        a--;
-        // Ensure that a is within the bounds
-        a = (a < 0) ? 0 : a;
-        ActivityStore[i] = 0 | (255 << 8) | (0 << 16) | (a << 24);
+        store->tiles[tile] = calloc(TILE_SIZE * TILE_SIZE, sizeof(unsigned int));
+        store->tileCount++;
     }
+    if (store->changed != NULL)
+        store->changed[tile] = 1;
+    
+    return store->tiles[tile];
 }
 
-// Function to write PNG files
-void writePNGFile(char *filename)
+// Returns where a pixel within the scene is kept so it can be written, allocating its tile if needed
+unsigned int *storePixel(TileStore *store, int x, int y)
 {
-    int x, y, pixel_size = 3, depth = 8;
-    FILE *fp;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    png_byte **row_pointers;
+    int tile = (y / TILE_SIZE) * store->tilesX + x / TILE_SIZE;
+    unsigned int *pixels = (store->tiles[tile] != NULL) ? store->tiles[tile] : allocateTile(store, tile);
     
-    // Now write the PNG file
-    fp = fopen(filename, "wb");
-    if (!fp)
-    {
-        Error("Error opening file for PNG creation.\n\n");
-        return;
-    }
+    if (store->changed != NULL)
+        store->changed[tile] = 1;
+    return &pixels[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+}
+
+// Sets a run of pixels to one value. Kept to a plain loop over a row of a tile so the compiler
+// can vectorise it.
+void fillPixels(unsigned int *pixels, int count, unsigned int value)
+{
+    int i;
     
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png_ptr == NULL)
-    {
-        Error("Error writing PNG structure\n\n");
-        goto png_create_write_struct_fail;
-    }
+    for (i = 0; i < count; i++)
+        pixels[i] = value;
+}
+
+// Sets a run of pixels along a row of the scene to one value, a tile at a time
+void fillStoreSpan(TileStore *store, int x, int y, int length, unsigned int value)
+{
+    int run;
     
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL)
+    for (; length > 0; x += run, length -= run)
     {
-        Error("Error creating PNG information structure.\n\n");
-        goto png_create_info_struct_fail;
+        run = TILE_SIZE - x % TILE_SIZE;
+        run = (run > length) ? length : run;
+        fillPixels(storePixel(store, x, y), run, value);
     }
+}
+
+// Returns the colour of a pixel within the scene
+unsigned int readPixel(TileStore *store, int x, int y)
+{
+    unsigned int *pixels = store->tiles[(y / TILE_SIZE) * store->tilesX + x / TILE_SIZE];
     
-    // Set up error handling
-    if (setjmp(png_jmpbuf(png_ptr)))
+    return (pixels == NULL) ? 0 : pixels[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+}
+
+// Returns 1 if the pixel is within the scene and its tile has been drawn on
+int tileDrawn(TileStore *store, int x, int y)
+{
+    return (x < store->width && y < store->height && store->tiles[(y / TILE_SIZE) * store->tilesX + x / TILE_SIZE] != NULL);
+}
+
+// Copies a row of the scene into a buffer of its width
+void readStoreRow(TileStore *store, int y, unsigned int *row)
+{
+    unsigned int *pixels;
+    int tx, n;
+    
+    for (tx = 0; tx < store->tilesX; tx++)
     {
-        Error("Error encountered when writing PNG file.\n\n");
-        goto png_fail;
+        n = (store->width - tx * TILE_SIZE < TILE_SIZE) ? store->width - tx * TILE_SIZE : TILE_SIZE;
+        pixels = store->tiles[(y / TILE_SIZE) * store->tilesX + tx];
+        if (pixels == NULL)
+            memset(&row[tx * TILE_SIZE], 0, sizeof(unsigned int) * n);
+        else
+            memcpy(&row[tx * TILE_SIZE], &pixels[(y % TILE_SIZE) * TILE_SIZE], sizeof(unsigned int) * n);
     }
+}
+
+// Makes one store a copy of another. Only the tiles that have been drawn on are copied. If the
+// store had a pyramid it's rebuilt for the new scene when next needed.
+void CopyTileStore(TileStore *to, TileStore *from)
+{
+    int levels = (to->above != NULL), combine = to->combine;
+    long i;
     
-    // Set the image attributes
-    png_set_IHDR(png_ptr, info_ptr, SceneWidth, SceneHeight, depth, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    
-    // Initialise rows of PNG file:
-    row_pointers = png_malloc(png_ptr, SceneHeight * sizeof(png_byte *));
+    FreeTileStore(to);
+    InitTileStore(to, from->width, from->height);
+    for (i = 0; i < (long) from->tilesX * from->tilesY; i++)
+        if (from->tiles[i] != NULL)
+            memcpy(allocateTile(to, i), from->tiles[i], TILE_BYTES);
+    if (levels)
+        AddTileLevels(to, combine);
+}
+
+// Gives a store a pyramid of levels, halving in size until a single tile covers the scene. Every
+// tile drawn on so far is marked as changed, so the levels are filled in when first needed.
+void AddTileLevels(TileStore *store, int combine)
+{
+    TileStore *level;
+    long i;
     
-    for (y = 0; y < SceneHeight; ++y)
+    for (level = store; level->above == NULL && (level->tilesX > 1 || level->tilesY > 1); level = level->above)
     {
-        png_byte *row = png_malloc(png_ptr, sizeof(uint8_t) * SceneWidth * pixel_size);
-        row_pointers[y] = row;
-        for (x = 0; x < SceneWidth; ++x)
-        {
-            *row++ = (uint8_t) (PixelStore[(SceneHeight - y) * SceneWidth + x] & 0xFF); // R
-            *row++ = (uint8_t) ((PixelStore[(SceneHeight - y) * SceneWidth + x] >> 8) & 0xFF); // G
-            *row++ = (uint8_t) ((PixelStore[(SceneHeight - y) * SceneWidth + x] >> 16) & 0xFF); // B
-        }
+        level->changed = calloc((size_t) level->tilesX * level->tilesY + 1, sizeof(unsigned char));
+        for (i = 0; i < (long) level->tilesX * level->tilesY; i++)
+            level->changed[i] = (level->tiles[i] != NULL);
+        level->combine = combine;
+        level->above = calloc(1, sizeof(TileStore));
+        InitTileStore(level->above, (level->width + 1) / 2, (level->height + 1) / 2);
     }
+}
+
+// Recomputes the quarter of a tile in the level above that a changed tile covers. Each pixel
+// combines the two by two pixels below it that lie within the scene.
+void updateParentTexels(TileStore *level, int tile)
+{
+    TileStore *above = level->above;
+    unsigned int *child = level->tiles[tile], *parent, colour, sum[3], n;
+    int tx = tile % level->tilesX, ty = tile / level->tilesX, x, y, cx, cy, dx, dy, c;
+    int parentTile = (ty / 2) * above->tilesX + tx / 2, offsetX = (tx % 2) * TILE_SIZE / 2, offsetY = (ty % 2) * TILE_SIZE / 2;
     
-    // Write the image data to the file pointer:
-    png_init_io(png_ptr, fp);
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    // A tile that has never been drawn on only blanks what's above it if there's anything there
+    if (child == NULL && above->tiles[parentTile] == NULL)
+        return;
+    parent = allocateTile(above, parentTile);
+    for (y = 0; y < TILE_SIZE / 2; y++)
+        for (x = 0; x < TILE_SIZE / 2; x++)
+        {
+            colour = n = 0;
+            sum[0] = sum[1] = sum[2] = 0;
+            for (dy = 0; dy < 2 && child != NULL; dy++)
+                for (dx = 0; dx < 2; dx++)
+                {
+                    cx = x * 2 + dx;
+                    cy = y * 2 + dy;
+                    if (tx * TILE_SIZE + cx >= level->width || ty * TILE_SIZE + cy >= level->height)
+                        continue;
+                    if (level->combine == MIP_LATEST)
+                        colour = (child[cy * TILE_SIZE + cx] > colour) ? child[cy * TILE_SIZE + cx] : colour;
+                    else
+                        for (c = 0; c < 3; c++)
+                            sum[c] += (child[cy * TILE_SIZE + cx] >> (c * 8)) & 0xFF;
+                    n++;
+                }
+            if (level->combine == MIP_AVERAGE && n > 0)
+                colour = (sum[0] / n) | ((sum[1] / n) << 8) | ((sum[2] / n) << 16);
+            parent[(offsetY + y) * TILE_SIZE + offsetX + x] = colour;
+        }
+}
+
+// Brings the pyramid of a store up to date as far as the given level, recomputing only what lies
+// above the tiles that have changed. Returns that level, or the top of the pyramid if it has
+// fewer levels.
+TileStore *UpdateTileLevels(TileStore *store, int levels)
+{
+    TileStore *level;
+    long i;
     
-    // File has been written to by this point. Tidy up.
-    printf("PNG file created.\n\n");
+    for (level = store; levels > 0 && level->above != NULL; level = level->above, levels--)
+        for (i = 0; i < (long) level->tilesX * level->tilesY; i++)
+            if (level->changed[i])
+            {
+                level->changed[i] = 0;
+                updateParentTexels(level, i);
+            }
     
-    // Now free memory:
-    for (y = 0; y < SceneHeight; y++)
-    {
-        png_free(png_ptr, row_pointers[y]);
-    }
-    png_free(png_ptr, row_pointers);
+    return level;
+}
+
+// Returns a new copy of a store, to be freed with DeleteTileStore
+TileStore *DuplicateTileStore(TileStore *from)
+{
+    TileStore *copy = calloc(1, sizeof(TileStore));
     
-png_fail:
-png_create_info_struct_fail:
-    // Finally destroy the structure in memory:
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-png_create_write_struct_fail:
-    // Close file pointer
-    fclose(fp);
+    CopyTileStore(copy, from);
+    return copy;
 }
 
-// Function to take control of user input elements
-void keyboardFunc(unsigned char key, int xmouse, int ymouse)
+// Frees a store made by DuplicateTileStore
+void DeleteTileStore(TileStore *store)
 {
-    switch (key)
+    FreeTileStore(store);
+    free(store);
+}
+
+// Draws on the far edge of the scene are accepted by the parser. As when the store was a single
+// array, they carry on to the start of the next row. Returns 0 if the pixel is outside the scene.
+int wrapPixel(int width, int height, int *x, int *y)
+{
+    if (*x == width)
     {
-        case 'a':
-        case 'A':
-            // Activity
-            DisplayActivity = !DisplayActivity;
-            break;
-        case 'i':
-        case 'I':
-            // Display information
-            DisplayInfo = !DisplayInfo;
-            break;
-        case 's':
-        case 'S':
-            // Save image as PNG
-            writePNGFile("output.png");
-            break;
-        case 'q':
-        case 'Q':
-            exit(0);
+        *x = 0;
+        (*y)++;
     }
     
+    return (*x >= 0 && *x < width && *y >= 0 && *y < height);
 }
 
-// Function to handle special keys
-void specialFunc(int key, int x, int y)
+void initialisePixelStore()
 {
+    // Tiles are only allocated once they're drawn on
+    FreeTileStore(&Parser->pixelStore);
+    InitTileStore(&Parser->pixelStore, Parser->sceneWidth, Parser->sceneHeight);
     
-    
+    // The visualiser resizes its copies once it reaches this point
+    if (DrawQueues != NULL)
+        postDrawEvent(Parser->queue, DRAW_EVENT_SCENE, Parser->sceneWidth, Parser->sceneHeight, 0, NULL);
+    // Draws made before a scene is redefined no longer show
+    if (TraceOutput != NULL)
+        RestartTraceEvents();
+    if (ReplayEnabled)
+        RestartReplay(Parser->currentLine, Parser->currentOffset);
 }
 
-// Function to print text to the screen
-static void printToScreen(int inset, const char *format, ...)
+// Quick function to wipe the pixel store
+void clearPixelStore()
+{
+    ClearTileStore(&Parser->pixelStore);
+    publishPixelStore();
+}
+
+// Marks the whole scene as needing to be uploaded
+void markAllTilesDirty()
 {
-    va_list args;
-    va_start(args, format);
-    vsprintf(ScreenText, format, args);
-    va_end(args);
-    
-    glRasterPos2i(inset, PrintLoc);
     int i;
-    for (i = 0; i < strlen(ScreenText); i++)
-        glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, ScreenText[i]);
     
-    PrintLoc -= 20;
+    for (i = 0; i < TilesX * TilesY; i++)
+    {
+        __atomic_store_n(&DirtyTiles[i], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ActivityDirtyTiles[i], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ActivityLiveTiles[i], 1, __ATOMIC_RELAXED);
+    }
 }
 
-// Function to handle what's displayed within the window
-void displayFunc(void)
+// Sets the graphics flag and wakes the main thread waiting to start the visualiser
+void setGraphicsFlag(int flag)
 {
-    glClear(GL_COLOR_BUFFER_BIT);
-    glRasterPos2i(0, 0);
+    pthread_mutex_lock(&GraphicsLock);
+    Parser->graphicsFlag = flag;
+    pthread_cond_broadcast(&GraphicsReady);
+    pthread_mutex_unlock(&GraphicsLock);
+}
+
+// Function to define window resizing
+void reshapeFunc(int newWidth, int newHeight)
+{
+    // The view keeps its position and zoom, showing more or less of the scene
+    pthread_mutex_lock(&FrameLock);
+    WindowWidth = newWidth;
+    WindowHeight = newHeight;
+    glViewport(0, 0, newWidth, newHeight);
+    if (AtlasSlots > 0)
+        clampView();
+    pthread_mutex_unlock(&FrameLock);
+    requestRedraw();
+}
+
+// Returns 1 if the window no longer shows the current state of the scene
+int sceneChanged(void)
+{
+    char statusText[600];
+    int x0, y0, x1, y1, tx, ty, tile, show, changed = 0;
     
-    // Display the contents of the pixel store to the screen
-    glDrawPixels(SceneWidth, SceneHeight, GL_RGBA, GL_UNSIGNED_BYTE, &PixelStore[0]);
+    if (RedrawRequested || (__atomic_load_n(&InfoMiddleSlot, __ATOMIC_ACQUIRE) & INFO_FRESH))
+        return 1;
     
-    // Display activity if desired
-    if (DisplayActivity)
+    // Keep the parser rates current even while the input has stalled
+    if (DisplayInfo && !__atomic_load_n(&ParsingComplete, __ATOMIC_ACQUIRE) && elapsedSeconds(&OverlaySample.time) >= 1.0)
+        return 1;
+    // Only the tiles in view matter
+    pthread_mutex_lock(&FrameLock);
+    visibleTiles(0, &x0, &y0, &x1, &y1);
+    for (ty = y0; ty < y1 && !changed; ty++)
+        for (tx = x0; tx < x1 && !changed; tx++)
+        {
+            tile = ty * TilesX + tx;
+            changed = __atomic_load_n(&DirtyTiles[tile], __ATOMIC_RELAXED) || (DisplayActivity && __atomic_load_n(&ActivityLiveTiles[tile], __ATOMIC_RELAXED));
+        }
+    pthread_mutex_unlock(&FrameLock);
+    if (changed)
+        return 1;
+    
+    // The snapshot message changes as the file is written and is removed after a while
+    show = getSnapshotStatus(statusText, sizeof(statusText));
+    if (strcmp(show ? statusText : "", DrawnSnapshotStatus))
+        return 1;
+    show = getReplayStatus(statusText, sizeof(statusText)) || getCompareStatus(statusText, sizeof(statusText));
+    if (strcmp(show ? statusText : "", DrawnReplayStatus))
+        return 1;
+    
+    return 0;
+}
+
+// Asks for the window to be redrawn, restarting the frame timer if it had stopped
+void requestRedraw(void)
+{
+    RedrawRequested = 1;
+    glutPostRedisplay();
+    if (!TimerRunning)
     {
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glDrawPixels(SceneWidth, SceneHeight, GL_RGBA, GL_UNSIGNED_BYTE, &ActivityStore[0]);
-        glDisable(GL_BLEND);
-        fadeActivity();
+        TimerRunning = 1;
+        glutTimerFunc(1000 / MaxFPS, timerFunc, 0);
     }
+}
+
+// Function to pace the redrawing of the window
+void timerFunc(int value)
+{
+    char statusText[600];
     
-    // Check to see if information should be displayed
-    if (DisplayInfo)
+    // Checked first so no change made before the end of parsing can be missed
+    int complete = __atomic_load_n(&ParsingComplete, __ATOMIC_ACQUIRE);
+    
+    // Ask the parser for the latest information panel text
+    if (DisplayInfo && !complete)
+        __atomic_store_n(&InfoRequested, 1, __ATOMIC_RELEASE);
+    
+    // The compositor may still be working through the last draws, or a change of comparison view
+    if (complete && (drawQueueDepth() != 0 || (Comparing && __atomic_load_n(&CompareShown, __ATOMIC_RELAXED) != CompareView)))
+        complete = 0;
+    
+    AdvanceReplay();
+    if (sceneChanged())
+        glutPostRedisplay();
+    else if (complete && !ReplayPlaying && !getSnapshotStatus(statusText, sizeof(statusText)))
     {
-        glPushMatrix();
-        glLoadIdentity();
-        glOrtho(0, SceneWidth, 0, SceneHeight, -1.0, 1.0);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glColor4f(0.0, 0.0, 0.0, 0.7);
-        glRecti(5, PrintLoc, 480, SceneHeight - 5);
-        glColor3f(1.0, 1.0, 1.0);
-        PrintLoc = SceneHeight - 30;
-        
-        printToScreen(10, "DAMSON parser version %i.%i.%i (%s)", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
-        printToScreen(10, " ");
-        printToScreen(10, "DAMSON information:");
-        printToScreen(10, "     %s", HeaderLine1);
-        printToScreen(10, "     %s", HeaderLine2);
-        printToScreen(10, "     %s", HeaderLine3);
-        printToScreen(10, " ");
-        printToScreen(10, "Last instruction:");
-        printToScreen(10, "     %s", LastReadInstruction);
-        printToScreen(10, " ");
-        if (LastReadErrorLine1[0] > 0)
-        {
-            printToScreen(10, "Last error or warning:");
-            printToScreen(10, "     %s", LastReadErrorLine1);
-            printToScreen(10, "     %s", LastReadErrorLine2);
-            printToScreen(10, " ");
-        }
-        if (TheEnd)
-        {
-            printToScreen(10, "Runtime Summary: ");
-            if (WorkspaceMessage[0] > 0)
-                printToScreen(10, "     %s", WorkspaceMessage);
-            if (ExecutionMessage[0] > 0)
-                printToScreen(10, "     %s", ExecutionMessage);
-            if (ComputingMessage[0] > 0)
-                printToScreen(10, "     %s", ComputingMessage);
-            if (StandbyTkMessage[0] > 0)
-                printToScreen(10, "     %s", StandbyTkMessage);
-            if (AvgSearchMessage[0] > 0)
-                printToScreen(10, "     %s", AvgSearchMessage);
-            printToScreen(10, " ");
-        }
-        glDisable(GL_BLEND);
-        glPopMatrix();
+        // Nothing more will change until a key is pressed
+        TimerRunning = 0;
+        return;
     }
+    glutTimerFunc(1000 / MaxFPS, timerFunc, 0);
+}
+
+// Milliseconds since the visualiser started. Never returns 0, which marks an untouched pixel.
+unsigned int activityMillis(void)
+{
+    struct timespec now;
     
-    glutSwapBuffers();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned int) ((now.tv_sec - ActivityEpoch.tv_sec) * 1000 + (now.tv_nsec - ActivityEpoch.tv_nsec) / 1000000) + 1;
 }
 
-// function to initialise GLUT window and output
-void initialiseGLUT(int argc, char *argv[])
+// Builds the table of activity alpha against age in milliseconds for the current half-life
+void initialiseActivityFade(void)
 {
-    DisplayInfo = 0;
-    DisplayActivity = 0;
-    glutInitWindowSize(SceneWidth, SceneHeight);
+    unsigned int age;
+    double halfLife = ActivityHalfLife * 1000.0;
     
-    // Set up the window position:
-    glutInitWindowPosition(0, 0);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_ALPHA | GLUT_DOUBLE);
+    // The alpha falls below one after eight half-lives
+    free(ActivityFade);
+    ActivityFadeLength = (unsigned int) (halfLife * 8.0) + 1;
+    ActivityFade = malloc(ActivityFadeLength);
+    for (age = 0; age < ActivityFadeLength; age++)
+        ActivityFade[age] = (unsigned char) (255.0 * pow(0.5, age / halfLife));
+}
+
+// Function to fade the activity of one tile. The alpha of each pixel depends only on the time
+// since it was drawn, so the fade runs at the same speed whatever the frame rate. Returns 0 once
+// nothing in the tile is fading.
+int fadeActivityTile(unsigned int *times, unsigned int *alpha)
+{
+    unsigned int now = ActivityClock, age, a;
+    int i, live = 0;
     
-    printf("Initialising GLUT... ");
-    glutInit(&argc, argv);
-    printf("Done\n");
+    if (ActivityFade == NULL)
+        initialiseActivityFade();
+    if (times == NULL)
+    {
+        memset(alpha, 0, TILE_BYTES);
+        return 0;
+    }
+    for (i = 0; i < TILE_SIZE * TILE_SIZE; i++)
+    {
+        age = now - times[i];
+        a = (times[i] != 0 && age < ActivityFadeLength) ? ActivityFade[age] : 0;
+        live |= a;
+        alpha[i] = 0 | (255 << 8) | (0 << 16) | (a << 24);
+    }
     
-    glutCreateWindow("DAMSON parser visualiser");
+    return live;
+}
+
+// Scale of the scene in the window at a zoom level
+double viewScale(int zoom)
+{
+    return ldexp(1.0, zoom);
+}
+
+// Level of the frame's pyramid drawn at a zoom level. Zoomed out, each pixel of the window
+// shows one pixel of a level, up to the level where a single tile covers the scene.
+int viewLevel(int zoom)
+{
+    int level = 0;
     
-    glutDisplayFunc(displayFunc);
-    glutIdleFunc(idleFunc);
-    glutKeyboardFunc(keyboardFunc);
-    glutSpecialFunc(specialFunc);
-    glutReshapeFunc(reshapeFunc);
+    while (level < -zoom && (levelTilesAcross(TilesX, level) > 1 || levelTilesAcross(TilesY, level) > 1))
+        level++;
     
-    glViewport(0, 0, SceneWidth, SceneHeight);
-    glLoadIdentity();
-    glOrtho(0.0, SceneWidth - 1.0, 0.0, SceneHeight - 1.0, -1.0,  1.0);
-    // printf("Creating visualiser thread...\n");
-    // pthread_create(&input_thread, NULL, OpenVisualiser, 0);
-    // printf("Visualiser thread created.\n");
+    return level;
 }
 
-// Shortcut method for populating the pixelstore and activitystore variables
-void setPixel(int x, int y, float RVal, float GVal, float BVal)
+// Number of tiles across a level of the pyramid, given the number across the full scene
+int levelTilesAcross(int tiles, int level)
+{
+    return (tiles + (1 << level) - 1) >> level;
+}
+
+// The most tiles that could be in view at a zoom level, whatever the position
+long visibleTileCount(int zoom)
+{
+    int level = viewLevel(zoom), tilesX = levelTilesAcross(TilesX, level), tilesY = levelTilesAcross(TilesY, level);
+    double size = (TILE_SIZE << level) * viewScale(zoom);
+    long across = (long) ceil(WindowWidth / size) + 1, down = (long) ceil(WindowHeight / size) + 1;
+    
+    return ((across < tilesX) ? across : tilesX) * ((down < tilesY) ? down : tilesY);
+}
+
+// Finds the range of tiles of a level in view, from x0, y0 up to but not including x1, y1
+void visibleTiles(int level, int *x0, int *y0, int *x1, int *y1)
+{
+    double scale = viewScale(ViewZoom), size = TILE_SIZE << level;
+    int tilesX = levelTilesAcross(TilesX, level), tilesY = levelTilesAcross(TilesY, level);
+    
+    *x0 = (ViewX < 0) ? 0 : (int) (ViewX / size);
+    *y0 = (ViewY < 0) ? 0 : (int) (ViewY / size);
+    *x1 = (int) ceil((ViewX + WindowWidth / scale) / size);
+    *y1 = (int) ceil((ViewY + WindowHeight / scale) / size);
+    *x1 = (*x1 > tilesX) ? tilesX : ((*x1 < *x0) ? *x0 : *x1);
+    *y1 = (*y1 > tilesY) ? tilesY : ((*y1 < *y0) ? *y0 : *y1);
+}
+
+// Keeps the view within reach of the scene, and zoomed in far enough for the tiles in view to
+// fit in the atlas
+void clampView(void)
 {
-    int idx = y * SceneWidth + x, iR = (int) ((RVal > 1.0 ? 1.0 : (RVal < 0 ? 0 : RVal)) * 255), iG = (int) ((GVal > 1.0 ? 1.0 : (GVal < 0 ? 0 : GVal)) * 255), iB = (int) ((BVal > 1.0 ? 1.0 : (BVal < 0 ? 0 : BVal)) * 255);
+    double width = WindowWidth / viewScale(ViewZoom), height = WindowHeight / viewScale(ViewZoom);
+    double centreX = ViewX + width / 2, centreY = ViewY + height / 2;
     
-    // printf("At <%i, %i>, RGB %f, %f, %f is %i, %i, %i\n", x, y, RVal, GVal, BVal, iR, iG, iB);
+    // Zooming in keeps the middle of the window where it was
+    while (AtlasSlots > 0 && ViewZoom < MAX_ZOOM && visibleTileCount(ViewZoom) > AtlasSlots)
+        ViewZoom++;
     
-    PixelStore[idx] = iR | (iG << 8) | (iB << 16);
-    ActivityStore[idx] = 0 | (255 << 8) | (0 << 16) | (255 << 24);
+    // At least half of the window stays over the scene
+    width = WindowWidth / viewScale(ViewZoom);
+    height = WindowHeight / viewScale(ViewZoom);
+    ViewX = centreX - width / 2;
+    ViewY = centreY - height / 2;
+    ViewX = (ViewX > FrameWidth - width / 2) ? FrameWidth - width / 2 : ViewX;
+    ViewY = (ViewY > FrameHeight - height / 2) ? FrameHeight - height / 2 : ViewY;
+    ViewX = (ViewX < -width / 2) ? -width / 2 : ViewX;
+    ViewY = (ViewY < -height / 2) ? -height / 2 : ViewY;
 }
 
-// This version checks the header of the DAMSON compiler output
-// The index is used to inform the function of the current line number
-int DAMSONHeaderCheck(char *line, int idx)
+// Shows the whole scene at the largest zoom that fits the window, up to one pixel per pixel
+void fitView(void)
 {
-    char csymb[5], cnotice[10], dname[3], aname[10], progname[12], versionstr[10], version[10];
-    struct tm timer;
-    int scanout, n;
-    unsigned int *year;
+    ViewZoom = 0;
+    while (ViewZoom > MIN_ZOOM && (FrameWidth * viewScale(ViewZoom) > WindowWidth || FrameHeight * viewScale(ViewZoom) > WindowHeight))
+        ViewZoom--;
+    ViewX = floor((FrameWidth - WindowWidth / viewScale(ViewZoom)) / 2);
+    ViewY = floor((FrameHeight - WindowHeight / viewScale(ViewZoom)) / 2);
+    clampView();
+}
+
+// Moves the view by a distance in window pixels
+void panView(double dx, double dy)
+{
+    ViewX += dx / viewScale(ViewZoom);
+    ViewY += dy / viewScale(ViewZoom);
+    clampView();
+    requestRedraw();
+}
+
+// Zooms in or out by a number of steps, keeping the scene under a point of the window still.
+// Zooming out stops if the tiles in view would no longer fit in the atlas.
+void zoomView(int steps, int x, int y)
+{
+    double sceneX = ViewX + x / viewScale(ViewZoom), sceneY = ViewY + y / viewScale(ViewZoom);
+    int zoom = ViewZoom + steps;
     
-    switch (idx)
+    zoom = (zoom < MIN_ZOOM) ? MIN_ZOOM : ((zoom > MAX_ZOOM) ? MAX_ZOOM : zoom);
+    while (zoom < ViewZoom && visibleTileCount(zoom) > AtlasSlots)
+        zoom++;
+    ViewZoom = zoom;
+    ViewX = sceneX - x / viewScale(ViewZoom);
+    ViewY = sceneY - y / viewScale(ViewZoom);
+    clampView();
+    requestRedraw();
+}
+
+// Creates the atlases that hold the scene and the activity overlay, with enough slots for every
+// tile of the scene if the largest texture allows. Called when the scene changes size.
+void initialiseTextures(void)
+{
+    GLuint textures[2] = {SceneTexture, ActivityTexture};
+    GLint maxSize;
+    int i;
+    
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    maxSize = (maxSize > 4096) ? 4096 : maxSize;
+    for (AtlasSize = TILE_SIZE; AtlasSize * 2 <= maxSize && (long) (AtlasSize / TILE_SIZE) * (AtlasSize / TILE_SIZE) < (long) TilesX * TilesY; AtlasSize *= 2);
+    AtlasColumns = AtlasSize / TILE_SIZE;
+    AtlasSlots = AtlasColumns * AtlasColumns;
+    
+    if (SceneTexture != 0)
+        glDeleteTextures(2, textures);
+    glGenTextures(2, textures);
+    SceneTexture = textures[0];
+    ActivityTexture = textures[1];
+    
+    for (i = 0; i < 2; i++)
     {
-        case 0:
-            // This line is the DAMSON verion number
-            scanout = sscanf(line, "%s %s %s", progname, versionstr, version);
-            // Check to see if this failed or the number parsed was incorrect
-            
-            if (scanout == EOF || scanout < 3)
-                return 0;
-            // Check to see if the header is as anticipated
-            if (!strcmp(progname, "DAMSON"))
-                if (!strcmp(versionstr, "Version"))
-                    printf("Recognised %s Compiler %s %s\n\n", progname, versionstr, version);
-                else
-                    return 0;
-            else
-                return 0;
-            // Store this header line into a global variable. It may be useful
-            HeaderLine1 = malloc(sizeof(char) * (14 + strlen(version)));
-            // In this instance, it's easier to just add the version to the end.
-            sprintf(HeaderLine1, "DAMSON Version %s", version);
-            break;
-        case 1:
-            // This line is the copyright notice
-            scanout = sscanf(line, "%s %s %s %s %u", csymb, cnotice, dname, aname, &year);
-            if (scanout == EOF || scanout < 5)
-                return -1;
-            // Store this header line into a global variable. As before, this may be useful.
-            // First allocate memory then set all entries to null.
-            HeaderLine2 = malloc(sizeof(char) * strlen(line));
-            memset(HeaderLine2, 0, strlen(line));
-            // Next determine if the incoming line has a new line character (hint: it does normally)
-            for (n = strlen(line); n > 0; n--)
-                if (line[n - 1] == '\n')
-                    break;
-            // In the (rare) instance this may not have a new line character, say that we want the entire string.
-            if (n == 0)
-                n = strlen(line);
-            // Copy the contents of the line to the header variable.
-            memcpy(&HeaderLine2[0], &line[0], n);
-            break;
-        case 2:
-            // This line is the time stamp that DAMSON was run
-            
-            // Check for the new line character.
-            for (n = strlen(line); n > 0; n--)
-            {
-                if (line[n - 1] == '\n')
-                    break;
-            }
-            // Remove the new line by replacing it with null if one was found
-            if (n > 0)
-                line[n - 1] = '\0';
-            
-            // Next, attempt to store the elements within the string into a timer object.
-            if (strptime(line, "%a %b %d %H:%M:%S %Y", &timer) == NULL)
-                return -2;
-            
-            // Reserve some memory and move the contents of the line to the header variable.
-            HeaderLine3 = malloc(sizeof(char) * strlen(line));
-            memcpy(&HeaderLine3[0], &line[0], n);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, AtlasSize, AtlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    
+    // Stream uploads through a pixel buffer object where possible
+    UsePBO = glutExtensionSupported("GL_ARB_pixel_buffer_object");
+    if (UsePBO && UploadBuffer == 0)
+        glGenBuffers(1, &UploadBuffer);
+    
+    // Slots for the largest number of tiles in any level
+    free(TileSlots);
+    free(SlotTiles);
+    free(SlotFrames);
+    free(SlotActivity);
+    free(VisibleList);
+    free(UploadList);
+    TileSlots = malloc(sizeof(int) * (TilesX * TilesY + 1));
+    SlotTiles = malloc(sizeof(int) * AtlasSlots);
+    SlotFrames = malloc(sizeof(unsigned int) * AtlasSlots);
+    SlotActivity = malloc(sizeof(unsigned char) * AtlasSlots);
+    VisibleList = malloc(sizeof(int) * AtlasSlots);
+    UploadList = malloc(sizeof(int) * AtlasSlots);
+    if (UploadTile == NULL)
+        UploadTile = malloc(TILE_BYTES);
+    resetAtlasSlots();
+    
+    TextureWidth = FrameWidth;
+    TextureHeight = FrameHeight;
+    fitView();
+    markAllTilesDirty();
+}
+
+// Returns the frame buffer the renderer should draw from. The compositor leaves it alone
+// until releaseFrontFrame is called.
+FrameBuffer *acquireFrontFrame(void)
+{
+    int front;
+    
+    while (1)
+    {
+        front = __atomic_load_n(&FrontFrame, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&FrameReaders[front], 1, __ATOMIC_SEQ_CST);
+        // The buffers may have been swapped before the compositor could see us
+        if (__atomic_load_n(&FrontFrame, __ATOMIC_SEQ_CST) == front)
             break;
-        default:
-            return -3;
+        leaveFrame(front);
     }
-    // If here, everything was okay.
+    ReadFrame = front;
+    
+    return &Frames[front];
+}
+
+// Lets the compositor update the frame buffer taken by acquireFrontFrame
+void releaseFrontFrame(void)
+{
+    leaveFrame(ReadFrame);
+    ReadFrame = -1;
+}
+
+// Marks a frame buffer as no longer read, and wakes the compositor if it's waiting for it
+void leaveFrame(int frame)
+{
+    __atomic_store_n(&FrameReaders[frame], 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&FrameWaiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&CompositorLock);
+        pthread_cond_signal(&FrameReleased);
+        pthread_mutex_unlock(&CompositorLock);
+    }
+}
+
+// Takes the latest information panel text published by the parser. Returns 1 if it was new.
+int fetchInfoText(void)
+{
+    if (!(__atomic_load_n(&InfoMiddleSlot, __ATOMIC_ACQUIRE) & INFO_FRESH))
+        return 0;
+    InfoReadSlot = __atomic_exchange_n(&InfoMiddleSlot, InfoReadSlot, __ATOMIC_ACQ_REL) & 3;
+    
     return 1;
 }
 
-// This function parses a line of text
-int ParseLine(char *line, int lineNo)
+// Empties the atlas, as when the level being drawn changes
+void resetAtlasSlots(void)
 {
-    char *tempString;
-    int n, m = -1, drawLoc, lBrack = -1, rBrack = -1, eqsign = -1, comsign = -1, x, y, scanout;
-    float RVal, GVal, BVal;
+    int i;
     
-    // First, remove the new line character
-    for (n = strlen(line); n > 0; n--)
-        if (line[n - 1] == '\n')
-            break;
-    // In the event no new line was found:
-    if (n > 0)
-        line[n - 1] = '\0';
+    for (i = 0; i < TilesX * TilesY; i++)
+        TileSlots[i] = -1;
+    for (i = 0; i < AtlasSlots; i++)
+        SlotTiles[i] = -1;
+    memset(SlotFrames, 0, sizeof(unsigned int) * AtlasSlots);
+    memset(SlotActivity, 0, sizeof(unsigned char) * AtlasSlots);
+    NextSlot = 0;
+    AtlasFrame = 0;
+}
+
+// Returns 1 if any of the full size tiles under a tile of a level are flagged. If clear is set,
+// their flags are cleared as they're read.
+int takeTileFlags(unsigned char *flags, int level, int tile, int clear)
+{
+    int tilesX = levelTilesAcross(TilesX, level), x0 = (tile % tilesX) << level, y0 = (tile / tilesX) << level, x, y, set = 0;
     
-    // Now determine if there's something to look at:
-    if (strcmp(line, ""))
+    for (y = y0; y < y0 + (1 << level) && y < TilesY; y++)
+        for (x = x0; x < x0 + (1 << level) && x < TilesX; x++)
+            set |= clear ? __atomic_exchange_n(&flags[y * TilesX + x], 0, __ATOMIC_ACQ_REL) : __atomic_load_n(&flags[y * TilesX + x], __ATOMIC_ACQUIRE);
+    
+    return set;
+}
+
+// Sets the flags of the full size tiles under a tile of a level
+void setTileFlags(unsigned char *flags, int level, int tile, unsigned char value)
+{
+    int tilesX = levelTilesAcross(TilesX, level), x0 = (tile % tilesX) << level, y0 = (tile / tilesX) << level, x, y;
+    
+    for (y = y0; y < y0 + (1 << level) && y < TilesY; y++)
+        for (x = x0; x < x0 + (1 << level) && x < TilesX; x++)
+            __atomic_store_n(&flags[y * TilesX + x], value, __ATOMIC_SEQ_CST);
+}
+
+// Finds the atlas slot holding a tile, giving it one if it has none. Slots are reused in clock
+// order, skipping any already drawn from this frame. Sets fresh if the slot's contents are stale.
+int tileSlot(int tile, int *fresh)
+{
+    int slot = TileSlots[tile], tries;
+    
+    *fresh = 0;
+    if (slot < 0)
+    {
+        for (tries = 0; tries < AtlasSlots && SlotTiles[NextSlot] >= 0 && SlotFrames[NextSlot] == AtlasFrame; tries++)
+            NextSlot = (NextSlot + 1) % AtlasSlots;
+        if (tries == AtlasSlots)
+            return -1;
+        slot = NextSlot;
+        NextSlot = (NextSlot + 1) % AtlasSlots;
+        if (SlotTiles[slot] >= 0)
+            TileSlots[SlotTiles[slot]] = -1;
+        SlotTiles[slot] = tile;
+        TileSlots[tile] = slot;
+        SlotActivity[slot] = 0;
+        *fresh = 1;
+    }
+    SlotFrames[slot] = AtlasFrame;
+    
+    return slot;
+}
+
+// Fills a tile sized buffer with the pixels of a tile of a level, or with its faded activity.
+// Returns 1 if the activity is still fading.
+int fillUploadTile(TileStore *store, int tile, unsigned int *out, int activity)
+{
+    int live;
+    
+    if (!activity)
+    {
+        if (store->tiles[tile] != NULL)
+            memcpy(out, store->tiles[tile], TILE_BYTES);
+        else
+            memset(out, 0, TILE_BYTES);
+        return 0;
+    }
+    
+    // Cleared first so a draw made during the fade keeps the tile live
+    setTileFlags(ActivityLiveTiles, AtlasLevel, tile, 0);
+    live = fadeActivityTile(store->tiles[tile], out);
+    if (live)
+        setTileFlags(ActivityLiveTiles, AtlasLevel, tile, 1);
+    
+    return live;
+}
+
+// Uploads the tiles of a level in UploadList to their atlas slots. Returns the number of bytes uploaded.
+unsigned long uploadTiles(GLuint texture, TileStore *store, int count, int activity)
+{
+    int i, slot;
+    unsigned long bytes = (unsigned long) count * TILE_BYTES;
+    unsigned char *mapped = NULL;
+    
+    if (count == 0)
+        return 0;
+    
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if (UsePBO)
     {
-        if (!TheEnd)
+        // Pack the tiles into a fresh buffer and let the driver transfer them
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, UploadBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+        mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (mapped != NULL)
         {
-            // Check for no file errors
-            if (!strcmp(line, "No file?"))
-            {
-                // No file provided. Bad.
-                Error("Error: No file was passed to the DAMSON compiler.\n");
-                return 0;
-            }
-            tempString = malloc(sizeof(char) * 8);
-            memset(tempString, 0, 8);
-            memcpy(&tempString[0], &line[0], 7);
-            
-            // Lookout for the timeout command.
-            if (!strcmp(tempString, "Timeout"))
+            for (i = 0; i < count; i++)
+                fillUploadTile(store, UploadList[i], (unsigned int *) &mapped[(unsigned long) i * TILE_BYTES], activity);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            for (i = 0; i < count; i++)
             {
-                // Free memory and ignore.
-                free(tempString);
-                return 3;
+                slot = TileSlots[UploadList[i]];
+                glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % AtlasColumns) * TILE_SIZE, (slot / AtlasColumns) * TILE_SIZE, TILE_SIZE, TILE_SIZE,
+                    GL_RGBA, GL_UNSIGNED_BYTE, (void *) (uintptr_t) ((unsigned long) i * TILE_BYTES));
             }
-            free(tempString);
-            // Are we at the end?
-            if (strlen(line) > 10)
-            {
-                tempString = malloc(sizeof(char) * 11);
-                memset(tempString, 0, 11);
-                memcpy(&tempString[0], &line[0], 10);
-                if (!strcmp(tempString, "Workspace:"))
-                {
-                    // Recognised keyword. It's highly probable we're at the end.
-                    // Raise the end flag.
-                    TheEnd = 1;
-                    free(tempString);
-                    // Copy line to workspace variable
-                    memcpy(&WorkspaceMessage[0], &line[0], strlen(line));
-                    // And return to the calling function
-                    return 2;
-                }
-                free(tempString);
-            } else if (strlen(line) < 6)
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    if (mapped == NULL)
+    {
+        // Upload a tile at a time from a staging tile
+        for (i = 0; i < count; i++)
+        {
+            slot = TileSlots[UploadList[i]];
+            fillUploadTile(store, UploadList[i], UploadTile, activity);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % AtlasColumns) * TILE_SIZE, (slot / AtlasColumns) * TILE_SIZE, TILE_SIZE, TILE_SIZE,
+                GL_RGBA, GL_UNSIGNED_BYTE, UploadTile);
+        }
+    }
+    
+    return bytes;
+}
+
+// Draws the tiles of a level in VisibleList from their atlas slots. Each covers two to the power
+// of the level times as much of the scene as a full size tile.
+void drawAtlasTiles(GLuint texture, TileStore *store, int count)
+{
+    int i, tile, slot, size = TILE_SIZE << AtlasLevel, x, y;
+    float u, v, extent = (float) TILE_SIZE / AtlasSize;
+    
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glColor4f(1.0, 1.0, 1.0, 1.0);
+    glBegin(GL_QUADS);
+    for (i = 0; i < count; i++)
+    {
+        tile = VisibleList[i];
+        slot = TileSlots[tile];
+        u = (slot % AtlasColumns) * extent;
+        v = (slot / AtlasColumns) * extent;
+        x = (tile % store->tilesX) * size;
+        y = (tile / store->tilesX) * size;
+        glTexCoord2f(u, v);
+        glVertex2i(x, y);
+        glTexCoord2f(u + extent, v);
+        glVertex2i(x + size, y);
+        glTexCoord2f(u + extent, v + extent);
+        glVertex2i(x + size, y + size);
+        glTexCoord2f(u, v + extent);
+        glVertex2i(x, y + size);
+    }
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+}
+
+// Draws the part of the scene in view from the level of the frame's pyramid that suits the zoom,
+// uploading the tiles that have changed or have just been given a slot in the atlas. Only the
+// parts of the pyramid over changed tiles are recomputed. Tiles never drawn to are left as
+// background. Returns the number of bytes uploaded.
+unsigned long drawVisibleTiles(FrameBuffer *frame)
+{
+    int x0, y0, x1, y1, tx, ty, tile, slot, fresh, visible = 0, uploads = 0, i, level = viewLevel(ViewZoom);
+    unsigned long bytes;
+    double scale = viewScale(ViewZoom);
+    TileStore *pixels, *times = NULL;
+    
+    // The atlas is refilled when the level changes
+    if (level != AtlasLevel)
+    {
+        resetAtlasSlots();
+        AtlasLevel = level;
+    }
+    AtlasFrame++;
+    pixels = UpdateTileLevels(&frame->pixels, level);
+    if (DisplayActivity)
+        times = UpdateTileLevels(&frame->times, level);
+    
+    visibleTiles(level, &x0, &y0, &x1, &y1);
+    for (ty = y0; ty < y1; ty++)
+        for (tx = x0; tx < x1; tx++)
+        {
+            tile = ty * pixels->tilesX + tx;
+            if (pixels->tiles[tile] == NULL && (times == NULL || times->tiles[tile] == NULL))
             {
-                // Line is too short to be anything useful
-                return 3;
+                takeTileFlags(DirtyTiles, level, tile, 1);
+                continue;
             }
-            
-            // Store the read line for printing in the visualiser
-            memset(LastReadInstruction, 0, 256);
-            memcpy(&LastReadInstruction[0], &line[0], (strlen(line) > 255) ? 255 : strlen(line));
-            
-            // If here, we're not at the end. Look for recognisable input
-            for (n = 0; n < (strlen(line) - 4); n++)
+            slot = tileSlot(tile, &fresh);
+            if (slot < 0)
+                continue;
+            VisibleList[visible++] = tile;
+            // The flags are cleared before the pixels are read, so anything drawn during the
+            // upload is sent again next frame
+            if (takeTileFlags(DirtyTiles, level, tile, 1) | fresh)
+                UploadList[uploads++] = tile;
+        }
+    FrameTiles = visible;
+    
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(ViewX, ViewX + WindowWidth / scale, ViewY, ViewY + WindowHeight / scale, -1.0, 1.0);
+    bytes = uploadTiles(SceneTexture, pixels, uploads, 0);
+    drawAtlasTiles(SceneTexture, pixels, visible);
+    
+    // Display activity if desired
+    if (DisplayActivity)
+    {
+        uploads = 0;
+        for (i = 0; i < visible; i++)
+        {
+            tile = VisibleList[i];
+            slot = TileSlots[tile];
+            if (takeTileFlags(ActivityDirtyTiles, level, tile, 1) | takeTileFlags(ActivityLiveTiles, level, tile, 0) | !SlotActivity[slot])
             {
-                tempString = malloc(sizeof(char) * 5);
-                memset(tempString, 0, 5);
-                memcpy(&tempString[0], &line[n], 4);
-                if (!strcmp(tempString, "draw"))
-                {
-                    // Found the word draw. We can try parsing this information
-                    m = n;
-                    free(tempString);
-                    break;
-                }
-                free(tempString);
+                UploadList[uploads++] = tile;
+                SlotActivity[slot] = 1;
             }
-            // Check to see if these are equal. If so, then draw was found
-            if (m == n)
-            {
-                drawLoc = m;
-                for (n = drawLoc + 4; n < strlen(line); n++)
+        }
+        bytes += uploadTiles(ActivityTexture, times, uploads, 1);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        drawAtlasTiles(ActivityTexture, times, visible);
+        glDisable(GL_BLEND);
+    }
+    glPopMatrix();
+    
+    return bytes;
+}
+
+// Records the progress of the PNG file being written
+void pngRowWritten(png_structp png_ptr, png_uint_32 row, int pass)
+{
+    __atomic_store_n(&EncoderRowsWritten, (int) row, __ATOMIC_RELAXED);
+}
+
+// Function to write a tile store to a PNG file. Rows are gathered from the tiles one at a time,
+// so no copy of the whole image is made. Returns 1 on success.
+int writePNGStore(char *filename, TileStore *store)
+{
+    int x, y, pixel_size = 3, depth = 8, status = 0, width = store->width, height = store->height;
+    FILE *fp;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned int *pixels;
+    png_byte *row;
+    
+    // Now write the PNG file
+    fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        Error("Error opening file for PNG creation.\n\n");
+        return 0;
+    }
+    
+    // Buffers for one row, allocated here so nothing leaks if libpng gives up part way
+    pixels = malloc(sizeof(unsigned int) * width + 1);
+    row = malloc(sizeof(png_byte) * width * pixel_size + 1);
+    
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL)
+    {
+        Error("Error writing PNG structure\n\n");
+        goto png_create_write_struct_fail;
+    }
+    
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL)
+    {
+        Error("Error creating PNG information structure.\n\n");
+        goto png_create_info_struct_fail;
+    }
+    
+    // Set up error handling
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        Error("Error encountered when writing PNG file.\n\n");
+        goto png_fail;
+    }
+    
+    // Set the image attributes
+    png_set_IHDR(png_ptr, info_ptr, width, height, depth, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    
+    // Apply the requested compression settings and keep track of progress
+    if (PNGCompressionLevel >= 0)
+        png_set_compression_level(png_ptr, PNGCompressionLevel);
+    if (PNGFilter >= 0)
+        png_set_filter(png_ptr, 0, PNGFilter);
+    png_set_write_status_fn(png_ptr, pngRowWritten);
+    
+    // Write the image data to the file pointer a row at a time. The first row of the file is
+    // the top of the scene.
+    png_init_io(png_ptr, fp);
+    png_write_info(png_ptr, info_ptr);
+    for (y = 0; y < height; y++)
+    {
+        readStoreRow(store, height - 1 - y, pixels);
+        for (x = 0; x < width; x++)
+        {
+            row[x * 3] = (png_byte) (pixels[x] & 0xFF); // R
+            row[x * 3 + 1] = (png_byte) ((pixels[x] >> 8) & 0xFF); // G
+            row[x * 3 + 2] = (png_byte) ((pixels[x] >> 16) & 0xFF); // B
+        }
+        png_write_row(png_ptr, row);
+    }
+    png_write_end(png_ptr, info_ptr);
+    
+    // File has been written to by this point. Tidy up.
+    status = 1;
+    
+png_fail:
+png_create_info_struct_fail:
+    // Finally destroy the structure in memory:
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+png_create_write_struct_fail:
+    // Close file pointer
+    free(pixels);
+    free(row);
+    fclose(fp);
+    
+    return status;
+}
+
+// Returns the level of a store that PNG files are written from. The store is given a pyramid the
+// first time a reduced level is wanted, and it's kept up to date from then on.
+TileStore *outputLevel(TileStore *store)
+{
+    if (PNGMipLevel == 0)
+        return store;
+    AddTileLevels(store, MIP_AVERAGE);
+    
+    return UpdateTileLevels(store, PNGMipLevel);
+}
+
+// Function to write the pixel store to a PNG file
+void writePNGFile(char *filename)
+{
+    if (writePNGStore(filename, outputLevel(&Parser->pixelStore)))
+        printf("PNG file created.\n\n");
+}
+
+// Thread that writes queued PNG files so that parsing never waits on compression
+void *EncoderThreadFunc(void *arg)
+{
+    PNGJob job;
+    int status;
+    
+    pthread_mutex_lock(&EncoderLock);
+    while (1)
+    {
+        while (EncoderCount == 0)
+            pthread_cond_wait(&EncoderWake, &EncoderLock);
+        
+        job = EncoderQueue[EncoderHead];
+        EncoderHead = (EncoderHead + 1) % MaxFramesInFlight;
+        EncoderCount--;
+        EncoderBusy = 1;
+        EncoderCurrent = job;
+        EncoderRowsWritten = 0;
+        pthread_mutex_unlock(&EncoderLock);
+        
+        status = writePNGStore(job.filename, job.store);
+        DeleteTileStore(job.store);
+        if (job.snapshot)
+            setSnapshotStatus(status ? "Saved %s" : "Unable to save %s", job.filename);
+        
+        pthread_mutex_lock(&EncoderLock);
+        EncoderBusy = 0;
+        pthread_cond_broadcast(&EncoderIdle);
+    }
+    
+    return NULL;
+}
+
+// Returns 1 if another PNG file can be queued without exceeding the in flight limit
+int EncoderHasRoom(void)
+{
+    int room;
+    
+    pthread_mutex_lock(&EncoderLock);
+    room = (EncoderCount + EncoderBusy < MaxFramesInFlight);
+    pthread_mutex_unlock(&EncoderLock);
+    
+    return room;
+}
+
+// Passes a copy of a store to the encoder thread, which deletes it once written. This never waits;
+// if too many files are already in flight, 0 is returned and the copy is left alone.
+int QueuePNGJob(char *filename, TileStore *store, int snapshot)
+{
+    PNGJob *job;
+    
+    pthread_mutex_lock(&EncoderLock);
+    if (EncoderCount + EncoderBusy >= MaxFramesInFlight)
+    {
+        pthread_mutex_unlock(&EncoderLock);
+        return 0;
+    }
+    
+    // Start the encoder when it's first needed
+    if (EncoderQueue == NULL)
+    {
+        EncoderQueue = malloc(sizeof(PNGJob) * MaxFramesInFlight);
+        pthread_create(&EncoderThread, NULL, EncoderThreadFunc, NULL);
+    }
+    
+    job = &EncoderQueue[(EncoderHead + EncoderCount) % MaxFramesInFlight];
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->store = store;
+    job->width = store->width;
+    job->height = store->height;
+    job->snapshot = snapshot;
+    EncoderCount++;
+    pthread_cond_signal(&EncoderWake);
+    pthread_mutex_unlock(&EncoderLock);
+    
+    return 1;
+}
+
+// Waits until every queued PNG file has been written
+void WaitForEncoder(void)
+{
+    pthread_mutex_lock(&EncoderLock);
+    if (EncoderCount + EncoderBusy > 0)
+        printf("Waiting for %i PNG file(s) to be written...\n", EncoderCount + EncoderBusy);
+    while (EncoderCount + EncoderBusy > 0)
+        pthread_cond_wait(&EncoderIdle, &EncoderLock);
+    pthread_mutex_unlock(&EncoderLock);
+}
+
+// Copies the pixel store and queues it as the next time-lapse frame. Frames are
+// dropped, rather than waited for, when the encoder falls behind.
+void CaptureTimelapseFrame(void)
+{
+    char filename[512];
+    TileStore *frame;
+    
+    FrameNumber++;
+    if (!EncoderHasRoom())
+    {
+        FramesDropped++;
+        return;
+    }
+    
+    frame = DuplicateTileStore(outputLevel(&Parser->pixelStore));
+    snprintf(filename, sizeof(filename), "%s/frame_%06li.png", TimelapseDir, FrameNumber);
+    if (!QueuePNGJob(filename, frame, 0))
+    {
+        DeleteTileStore(frame);
+        FramesDropped++;
+    }
+}
+
+// Updates the snapshot message shown in the visualiser
+void setSnapshotStatus(const char *format, ...)
+{
+    va_list args;
+    
+    pthread_mutex_lock(&EncoderLock);
+    va_start(args, format);
+    vsnprintf(SnapshotStatus, sizeof(SnapshotStatus), format, args);
+    va_end(args);
+    SnapshotStatusTime = time(NULL);
+    pthread_mutex_unlock(&EncoderLock);
+}
+
+// Fetches the snapshot message to show in the visualiser. Returns 0 if there is nothing to show.
+int getSnapshotStatus(char *text, size_t size)
+{
+    int show = 1;
+    
+    pthread_mutex_lock(&EncoderLock);
+    if (EncoderBusy && EncoderCurrent.snapshot)
+        snprintf(text, size, "Saving %s (%i%%)", EncoderCurrent.filename, EncoderCurrent.height ? 100 * __atomic_load_n(&EncoderRowsWritten, __ATOMIC_RELAXED) / EncoderCurrent.height : 0);
+    else if (SnapshotStatus[0] != '\0' && time(NULL) - SnapshotStatusTime < 5)
+        snprintf(text, size, "%s", SnapshotStatus);
+    else
+        show = 0;
+    pthread_mutex_unlock(&EncoderLock);
+    
+    return show;
+}
+
+// Copies the pixel store and queues it to be saved under a unique, timestamped name
+void CaptureSnapshot(void)
+{
+    char filename[512], stamp[32];
+    TileStore *copy;
+    time_t now = time(NULL);
+    struct tm local;
+    
+    if (Parser->pixelStore.tiles == NULL)
+        return;
+    
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &local);
+    do
+        snprintf(filename, sizeof(filename), "snapshot_%s_%03i.png", stamp, ++SnapshotSequence);
+    while (access(filename, F_OK) == 0);
+    
+    // A replay is saved as it's shown
+    copy = DuplicateTileStore(outputLevel(ReplayActive ? &ReplayStore : &Parser->pixelStore));
+    if (QueuePNGJob(filename, copy, 1))
+        setSnapshotStatus("Queued %s", filename);
+    else
+    {
+        DeleteTileStore(copy);
+        setSnapshotStatus("Snapshot not saved. %i PNG file(s) are already being written.", MaxFramesInFlight);
+    }
+}
+
+// Takes a snapshot if one has been requested. While the parser is running this is called
+// between lines on the parser thread, so the pixel store is never copied part way through a draw.
+void ServiceSnapshotRequest(void)
+{
+    if (__atomic_exchange_n(&SnapshotRequested, 0, __ATOMIC_ACQ_REL))
+        CaptureSnapshot();
+}
+
+// Marks the end of parsing. Any remaining snapshot request is taken from the final scene.
+void FinishParsing(void)
+{
+    StopStatsThread();
+    PublishInfoText();
+    pthread_mutex_lock(&GraphicsLock);
+    __atomic_store_n(&ParsingComplete, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&GraphicsReady);
+    pthread_mutex_unlock(&GraphicsLock);
+    ServiceSnapshotRequest();
+}
+
+// Counts the units between time-lapse frames. This is called for every parsed line.
+void TimelapseTick(char *line, int dcheck)
+{
+    if (Parser->pixelStore.tiles == NULL)
+        return;
+    
+    switch (FrameUnit)
+    {
+        case FRAME_UNIT_DRAWS:
+            if (dcheck == 100)
+                FrameCounter++;
+            break;
+        case FRAME_UNIT_LINES:
+            FrameCounter++;
+            break;
+        case FRAME_UNIT_TIMEOUTS:
+            if (dcheck == 3 && !strncmp(line, "Timeout", 7))
+                FrameCounter++;
+            break;
+    }
+    
+    if (FrameCounter >= FrameStride)
+    {
+        FrameCounter = 0;
+        CaptureTimelapseFrame();
+    }
+}
+
+// Captures the final state of the scene once the input has ended
+void FinishTimelapse(void)
+{
+    if (TimelapseDir == NULL || Parser->pixelStore.tiles == NULL)
+        return;
+    
+    if (FrameCounter > 0)
+        CaptureTimelapseFrame();
+    printf("Time-lapse: %li frame(s) captured, %li dropped.\n\n", FrameNumber - FramesDropped, FramesDropped);
+}
+
+
+
+// Function to write the information shown by the visualiser to a text file
+void writeSummaryFile(char *filename)
+{
+    FILE *fp;
+    int i;
+    
+    fp = fopen(filename, "w");
+    if (!fp)
+    {
+        Error("Error opening file for summary creation.\n\n");
+        return;
+    }
+    
+    fprintf(fp, "DAMSON parser version %i.%i.%i (%s)\n\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
+    if (Merging)
+    {
+        // Each merged file has its own header and end summary
+        for (i = 0; i < InputFileCount; i++)
+        {
+            fprintf(fp, "Input file \"%s\":\n\n", InputFiles[i]);
+            writeContextSummary(fp, &MergeContexts[i]);
+        }
+    }
+    else
+        writeContextSummary(fp, Parser);
+    
+    fclose(fp);
+    printf("Summary file created.\n\n");
+}
+
+// Writes the header, last instruction, last error and end summary of one parser
+void writeContextSummary(FILE *fp, ParseContext *context)
+{
+    if (context->headerLine1 != NULL)
+    {
+        fprintf(fp, "DAMSON information:\n");
+        fprintf(fp, "     %s\n", context->headerLine1);
+        // The copyright notice keeps its new line character
+        if (context->headerLine2 != NULL)
+            fprintf(fp, "     %.*s\n", (int) strcspn(context->headerLine2, "\n"), context->headerLine2);
+        fprintf(fp, "     %s\n\n", (context->headerLine3 != NULL) ? context->headerLine3 : "");
+    }
+    if (context->sceneWidth > 0 && context->sceneHeight > 0)
+        fprintf(fp, "Scene dimensions: %i x %i\n\n", context->sceneWidth, context->sceneHeight);
+    fprintf(fp, "Last instruction:\n");
+    fprintf(fp, "     %s\n\n", context->lastInstruction);
+    if (context->errorLine1[0] > 0)
+    {
+        fprintf(fp, "Last error or warning:\n");
+        fprintf(fp, "     %s", context->errorLine1);
+        if (context->errorLine2[0] > 0)
+            fprintf(fp, "     %s", context->errorLine2);
+        fprintf(fp, "\n");
+    }
+    if (context->theEnd)
+    {
+        fprintf(fp, "Runtime Summary:\n");
+        if (context->workspaceMessage[0] > 0)
+            fprintf(fp, "     %s\n", context->workspaceMessage);
+        if (context->executionMessage[0] > 0)
+            fprintf(fp, "     %s\n", context->executionMessage);
+        if (context->computingMessage[0] > 0)
+            fprintf(fp, "     %s\n", context->computingMessage);
+        if (context->standbyTkMessage[0] > 0)
+            fprintf(fp, "     %s\n", context->standbyTkMessage);
+        if (context->avgSearchMessage[0] > 0)
+            fprintf(fp, "     %s\n", context->avgSearchMessage);
+    }
+}
+
+// Writes the final scene and runtime summary once the input has been parsed.
+// Returns the exit status for headless runs.
+int SaveHeadlessOutput(void)
+{
+    int status = (Parser->graphicsFlag == 1) ? 0 : 1;
+    
+    if (Parser->pixelStore.tiles != NULL)
+        writePNGFile(OutputFilename);
+    else
+        Error("No scene was defined. No image was written.\n\n");
+    writeSummaryFile(SummaryFilename);
+    WaitForEncoder();
+    
+    return status;
+}
+
+// Function to take control of user input elements
+void keyboardFunc(unsigned char key, int xmouse, int ymouse)
+{
+    switch (key)
+    {
+        case 'a':
+        case 'A':
+            // Activity
+            DisplayActivity = !DisplayActivity;
+            break;
+        case 'i':
+        case 'I':
+            // Display information
+            DisplayInfo = !DisplayInfo;
+            break;
+        case 's':
+        case 'S':
+            // Save image as PNG. The parser takes the copy between lines, or
+            // it's taken here once the scene can no longer change.
+            __atomic_store_n(&SnapshotRequested, 1, __ATOMIC_RELEASE);
+            if (__atomic_load_n(&ParsingComplete, __ATOMIC_ACQUIRE))
+                ServiceSnapshotRequest();
+            else
+                wakeListener();
+            break;
+        case '+':
+        case '=':
+            // Zoom in or out about the middle of the window
+            pthread_mutex_lock(&FrameLock);
+            zoomView(1, WindowWidth / 2, WindowHeight / 2);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case '-':
+            pthread_mutex_lock(&FrameLock);
+            zoomView(-1, WindowWidth / 2, WindowHeight / 2);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case 'f':
+        case 'F':
+            // Fit the whole scene in the window
+            pthread_mutex_lock(&FrameLock);
+            fitView();
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case 'd':
+        case 'D':
+            // Switch between the compared runs side by side and their difference
+            if (Comparing)
+            {
+                __atomic_store_n(&CompareView, !CompareView, __ATOMIC_SEQ_CST);
+                wakeCompositor();
+            }
+            break;
+        case 'q':
+        case 'Q':
+            WaitForEncoder();
+            exit(0);
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            // Line number to seek to
+            if (SeekDigits < 9)
+            {
+                SeekLine = SeekLine * 10 + (key - '0');
+                SeekDigits++;
+            }
+            break;
+        case '\r':
+        case '\n':
+            if (SeekDigits > 0)
+            {
+                ReplayPlaying = 0;
+                SeekReplay(SeekLine);
+            }
+            SeekLine = SeekDigits = 0;
+            break;
+        case 27:
+            // Escape abandons a line number
+            SeekLine = SeekDigits = 0;
+            break;
+    }
+    
+    // Show the result of the key press, even if parsing has finished
+    requestRedraw();
+}
+
+// Function to handle special keys. These control the replay once parsing is complete,
+// and the arrow keys move the view.
+void specialFunc(int key, int x, int y)
+{
+    uint32_t line;
+    
+    switch (key)
+    {
+        case GLUT_KEY_LEFT:
+            pthread_mutex_lock(&FrameLock);
+            panView(-WindowWidth / 4.0, 0.0);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case GLUT_KEY_RIGHT:
+            pthread_mutex_lock(&FrameLock);
+            panView(WindowWidth / 4.0, 0.0);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case GLUT_KEY_UP:
+            pthread_mutex_lock(&FrameLock);
+            panView(0.0, WindowHeight / 4.0);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case GLUT_KEY_DOWN:
+            pthread_mutex_lock(&FrameLock);
+            panView(0.0, -WindowHeight / 4.0);
+            pthread_mutex_unlock(&FrameLock);
+            break;
+        case GLUT_KEY_HOME:
+            // Back to the start
+            SeekReplay(0);
+            break;
+        case GLUT_KEY_END:
+            // Show the final scene
+            StopReplay();
+            break;
+        case GLUT_KEY_PAGE_UP:
+            // Back a tenth of the run, starting from the end if not yet replaying
+            line = ReplayActive ? ReplayLine : ReplayLastLine;
+            SeekReplay((line > ReplayLastLine / 10 + 1) ? line - ReplayLastLine / 10 - 1 : 0);
+            break;
+        case GLUT_KEY_PAGE_DOWN:
+            // Forward a tenth of the run
+            if (ReplayActive)
+                SeekReplay(ReplayLine + ReplayLastLine / 10 + 1);
+            break;
+        case GLUT_KEY_F5:
+            // Play or pause
+            if (!ReplayActive && !SeekReplay(0))
+                break;
+            ReplayPlaying = !ReplayPlaying;
+            if (ReplayPlaying && ReplayLine >= ReplayLastLine)
+                SeekReplay(0);
+            ReplayTickTime = activityMillis();
+            ReplayCarry = 0.0;
+            break;
+        case GLUT_KEY_F6:
+            // Slower
+            ReplaySpeed = (ReplaySpeed > 1.0 / 64.0) ? ReplaySpeed / 2.0 : ReplaySpeed;
+            break;
+        case GLUT_KEY_F7:
+            // Faster
+            ReplaySpeed = (ReplaySpeed < 65536.0) ? ReplaySpeed * 2.0 : ReplaySpeed;
+            break;
+        case GLUT_KEY_F8:
+            StepReplay(-1);
+            break;
+        case GLUT_KEY_F9:
+            StepReplay(1);
+            break;
+    }
+    
+    requestRedraw();
+}
+
+// Function to handle the mouse buttons. Dragging with the left button moves the view and the
+// wheel zooms about the pointer.
+void mouseFunc(int button, int state, int x, int y)
+{
+    if (button == GLUT_LEFT_BUTTON)
+    {
+        DragX = (state == GLUT_DOWN) ? x : -1;
+        DragY = (state == GLUT_DOWN) ? y : -1;
+    }
+    else if ((button == 3 || button == 4) && state == GLUT_DOWN)
+    {
+        // GLUT measures the pointer from the top of the window
+        pthread_mutex_lock(&FrameLock);
+        zoomView((button == 3) ? 1 : -1, x, WindowHeight - y);
+        pthread_mutex_unlock(&FrameLock);
+    }
+}
+
+// Function to follow the mouse while a button is held
+void motionFunc(int x, int y)
+{
+    if (DragX < 0)
+        return;
+    pthread_mutex_lock(&FrameLock);
+    panView(DragX - x, y - DragY);
+    pthread_mutex_unlock(&FrameLock);
+    DragX = x;
+    DragY = y;
+}
+
+// Function to print text to the screen
+static void printToScreen(int inset, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsprintf(ScreenText, format, args);
+    va_end(args);
+    
+    glRasterPos2i(inset, PrintLoc);
+    int i;
+    for (i = 0; i < strlen(ScreenText); i++)
+        glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, ScreenText[i]);
+    
+    PrintLoc -= 20;
+}
+
+// Function to handle what's displayed within the window
+void displayFunc(void)
+{
+    char statusText[600];
+    unsigned int frameStart;
+    FrameBuffer *frame;
+    InfoText *info;
+    ParserStats *counts, producerCounts;
+    double fps;
+    int i;
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    
+    // Activity is faded against this frame's time
+    ActivityClock = frameStart = activityMillis();
+    RedrawRequested = 0;
+    fetchInfoText();
+    info = &InfoSlots[InfoReadSlot];
+    
+    // The compositor can't resize the frame buffers while they're being drawn
+    pthread_mutex_lock(&FrameLock);
+    if (FrameWidth == 0)
+    {
+        // The compositor hasn't reached the scene description yet
+        pthread_mutex_unlock(&FrameLock);
+        RedrawRequested = 1;
+        glutSwapBuffers();
+        return;
+    }
+    
+    // (Re)create the atlases if the scene has changed size. A comparison changes size with its view.
+    if (TextureWidth != FrameWidth || TextureHeight != FrameHeight)
+        initialiseTextures();
+    
+    // Display the part of the latest frame in view. Only changed tiles are uploaded.
+    frame = acquireFrontFrame();
+    LastUploadBytes = drawVisibleTiles(frame);
+    releaseFrontFrame();
+    TotalUploadBytes += LastUploadBytes;
+    UploadFrames++;
+    
+    // Check to see if information should be displayed
+    if (DisplayInfo)
+    {
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0, WindowWidth, 0, WindowHeight, -1.0, 1.0);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glColor4f(0.0, 0.0, 0.0, 0.7);
+        glRecti(5, PrintLoc, 480, WindowHeight - 5);
+        glColor3f(1.0, 1.0, 1.0);
+        PrintLoc = WindowHeight - 30;
+        
+        printToScreen(10, "DAMSON parser version %i.%i.%i (%s)", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
+        printToScreen(10, " ");
+        printToScreen(10, "DAMSON information:");
+        printToScreen(10, "     %s", info->header[0]);
+        printToScreen(10, "     %s", info->header[1]);
+        printToScreen(10, "     %s", info->header[2]);
+        printToScreen(10, " ");
+        printToScreen(10, "Frame rate: %.1f fps (limit %i), frame time %.1f ms", AchievedFPS, MaxFPS, FrameTime);
+        printToScreen(10, "Texture upload: %lu bytes this frame (%lu average, %s)", LastUploadBytes, TotalUploadBytes / UploadFrames, UsePBO ? "PBO" : "direct");
+        printToScreen(10, "View: %ix%i scene at %g%% from level %i, %ld of %ld tiles drawn, atlas of %i", FrameWidth, FrameHeight, viewScale(ViewZoom) * 100.0,
+            AtlasLevel, FrameTiles, (long) levelTilesAcross(TilesX, AtlasLevel) * levelTilesAcross(TilesY, AtlasLevel), AtlasSlots);
+        printToScreen(10, " ");
+        if (elapsedSeconds(&OverlaySample.time) >= 0.5)
+            sampleStats(&OverlaySample);
+        counts = &OverlaySample.counts;
+        printToScreen(10, "Parser: %llu lines (%.0f lines/s), %.1f MB (%.1f MB/s)", (unsigned long long) counts->lines, OverlaySample.linesPerSecond,
+            counts->bytes / 1e6, OverlaySample.bytesPerSecond / 1e6);
+        printToScreen(10, "     %llu draws, %llu debug, %llu timeouts", (unsigned long long) counts->draws, (unsigned long long) counts->debug, (unsigned long long) counts->timeouts);
+        printToScreen(10, "     Warnings (by code 4-10): %llu %llu %llu %llu %llu %llu %llu", (unsigned long long) counts->warnings[4], (unsigned long long) counts->warnings[5],
+            (unsigned long long) counts->warnings[6], (unsigned long long) counts->warnings[7], (unsigned long long) counts->warnings[8],
+            (unsigned long long) counts->warnings[9], (unsigned long long) counts->warnings[10]);
+        printToScreen(10, "     Queued: %u draw events, %llu bytes of input", drawQueueDepth(), (unsigned long long) __atomic_load_n(&InputBuffered, __ATOMIC_RELAXED));
+        if (ListenPath != NULL || FifoCount > 0)
+        {
+            // Each producer's throughput, and how far behind it the parser is
+            pthread_mutex_lock(&ProducerLock);
+            printToScreen(10, "Producers: %i connected", ProducerCount);
+            for (i = 0; i < ProducerCount && i < 8; i++)
+            {
+                if (elapsedSeconds(&Producers[i]->sample.time) >= 0.5)
+                {
+                    readContextStats(&Producers[i]->context, &producerCounts);
+                    updateSample(&Producers[i]->sample, &producerCounts);
+                }
+                printToScreen(10, "     %s: %llu lines (%.0f lines/s), %llu draws, %lu bytes behind", Producers[i]->name,
+                    (unsigned long long) Producers[i]->sample.counts.lines, Producers[i]->sample.linesPerSecond,
+                    (unsigned long long) Producers[i]->sample.counts.draws, producerBacklog(Producers[i]));
+            }
+            if (ProducerCount > 8)
+                printToScreen(10, "     and %i more", ProducerCount - 8);
+            pthread_mutex_unlock(&ProducerLock);
+        }
+        printToScreen(10, " ");
+        printToScreen(10, "Last instruction:");
+        printToScreen(10, "     %s", info->instruction);
+        printToScreen(10, " ");
+        if (info->error[0][0] > 0)
+        {
+            printToScreen(10, "Last error or warning:");
+            printToScreen(10, "     %s", info->error[0]);
+            printToScreen(10, "     %s", info->error[1]);
+            printToScreen(10, " ");
+        }
+        if (info->theEnd)
+        {
+            printToScreen(10, "Runtime Summary: ");
+            for (i = 0; i < 5; i++)
+                if (info->summary[i][0] > 0)
+                    printToScreen(10, "     %s", info->summary[i]);
+            printToScreen(10, " ");
+        }
+        glDisable(GL_BLEND);
+        glPopMatrix();
+    }
+    
+    // Show the progress of any snapshot being saved
+    DrawnSnapshotStatus[0] = '\0';
+    if (getSnapshotStatus(statusText, sizeof(statusText)))
+    {
+        strcpy(DrawnSnapshotStatus, statusText);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0, WindowWidth, 0, WindowHeight, -1.0, 1.0);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glColor4f(0.0, 0.0, 0.0, 0.7);
+        glRecti(5, 5, 480, 27);
+        glColor3f(1.0, 1.0, 1.0);
+        PrintLoc = 12;
+        printToScreen(10, "%s", statusText);
+        glDisable(GL_BLEND);
+        glPopMatrix();
+    }
+    
+    // Show the position of the replay, or the difference between the runs being compared
+    DrawnReplayStatus[0] = '\0';
+    if (getReplayStatus(statusText, sizeof(statusText)) || getCompareStatus(statusText, sizeof(statusText)))
+    {
+        strcpy(DrawnReplayStatus, statusText);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0, WindowWidth, 0, WindowHeight, -1.0, 1.0);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glColor4f(0.0, 0.0, 0.0, 0.7);
+        glRecti(5, 32, 480, 54);
+        glColor3f(1.0, 1.0, 1.0);
+        PrintLoc = 39;
+        printToScreen(10, "%s", statusText);
+        glDisable(GL_BLEND);
+        glPopMatrix();
+    }
+    
+    pthread_mutex_unlock(&FrameLock);
+    glutSwapBuffers();
+    
+    // Measure the time spent drawing, and the frame rate over the last second
+    FrameTime = activityMillis() - frameStart;
+    FPSWindowFrames++;
+    if (frameStart - FPSWindowStart >= 1000)
+    {
+        fps = FPSWindowFrames * 1000.0 / (frameStart - FPSWindowStart);
+        __atomic_store(&AchievedFPS, &fps, __ATOMIC_RELAXED);
+        FPSWindowStart = frameStart;
+        FPSWindowFrames = 0;
+    }
+}
+
+// function to initialise GLUT window and output
+void initialiseGLUT(int argc, char *argv[])
+{
+    int width = Parser->sceneWidth, height = Parser->sceneHeight;
+    
+    // The runs being compared start side by side
+    if (Comparing)
+    {
+        width = MainParser.sceneWidth + CompareParser.sceneWidth;
+        height = (MainParser.sceneHeight > CompareParser.sceneHeight) ? MainParser.sceneHeight : CompareParser.sceneHeight;
+    }
+    DisplayInfo = 0;
+    DisplayActivity = 0;
+    
+    printf("Initialising GLUT... ");
+    glutInit(&argc, argv);
+    printf("Done\n");
+    
+    // Large scenes start in a window that fits on the screen, and can be panned and zoomed
+    if (glutGet(GLUT_SCREEN_WIDTH) > 0 && width > glutGet(GLUT_SCREEN_WIDTH) * 9 / 10)
+        width = glutGet(GLUT_SCREEN_WIDTH) * 9 / 10;
+    if (glutGet(GLUT_SCREEN_HEIGHT) > 0 && height > glutGet(GLUT_SCREEN_HEIGHT) * 9 / 10)
+        height = glutGet(GLUT_SCREEN_HEIGHT) * 9 / 10;
+    WindowWidth = width;
+    WindowHeight = height;
+    glutInitWindowSize(width, height);
+    
+    // Set up the window position:
+    glutInitWindowPosition(0, 0);
+    glutInitDisplayMode(GLUT_RGBA | GLUT_ALPHA | GLUT_DOUBLE);
+    
+    glutCreateWindow("DAMSON parser visualiser");
+    
+    glutDisplayFunc(displayFunc);
+    TimerRunning = 1;
+    glutTimerFunc(1000 / MaxFPS, timerFunc, 0);
+    glutKeyboardFunc(keyboardFunc);
+    glutSpecialFunc(specialFunc);
+    glutReshapeFunc(reshapeFunc);
+    glutMouseFunc(mouseFunc);
+    glutMotionFunc(motionFunc);
+    
+    glViewport(0, 0, width, height);
+    glLoadIdentity();
+    glOrtho(0.0, width - 1.0, 0.0, height - 1.0, -1.0,  1.0);
+    // printf("Creating visualiser thread...\n");
+    // pthread_create(&input_thread, NULL, OpenVisualiser, 0);
+    // printf("Visualiser thread created.\n");
+}
+
+// Sends a change to the compositor. Waits while the queue is full.
+void postDrawEvent(int queue, unsigned int type, unsigned int x, unsigned int y, unsigned int colour, TileStore *frame)
+{
+    DrawQueue *q = &DrawQueues[queue];
+    DrawEvent *event;
+    
+    waitForDrawQueue(q, DRAW_QUEUE_SIZE - 1);
+    event = &q->events[q->head & (DRAW_QUEUE_SIZE - 1)];
+    event->type = type;
+    event->x = x;
+    event->y = y;
+    event->colour = colour;
+    event->frame = frame;
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+    wakeCompositor();
+}
+
+// Sends a run of pixels along a row to the compositor. Waits while the queue is full.
+void postDrawSpan(int queue, unsigned int x, unsigned int y, unsigned int length, unsigned int colour)
+{
+    DrawQueue *q = &DrawQueues[queue];
+    DrawEvent *event;
+    
+    waitForDrawQueue(q, DRAW_QUEUE_SIZE - 1);
+    event = &q->events[q->head & (DRAW_QUEUE_SIZE - 1)];
+    event->type = DRAW_EVENT_SPAN;
+    event->x = x;
+    event->y = y;
+    event->colour = colour;
+    event->length = length;
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+    wakeCompositor();
+}
+
+// Sends a copy of the whole pixel store to the compositor, after it has been changed in bulk
+void publishPixelStore(void)
+{
+    if (DrawQueues == NULL)
+        return;
+    postDrawEvent(Parser->queue, DRAW_EVENT_FRAME, Parser->sceneWidth, Parser->sceneHeight, 0, DuplicateTileStore(&Parser->pixelStore));
+}
+
+// Waits for the compositor to apply everything sent by the parser thread. Used before the
+// parallel workers start, so their draws can't overtake the scene description.
+void waitForCompositor(void)
+{
+    if (DrawQueues == NULL)
+        return;
+    waitForDrawQueue(&DrawQueues[Parser->queue], 0);
+}
+
+// Wakes the compositor if it's asleep. Called once an event has been published, so either the
+// compositor sees the event before it sleeps or it's seen to be asleep here.
+void wakeCompositor(void)
+{
+    if (!__atomic_load_n(&CompositorSleeping, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&CompositorLock);
+    pthread_cond_signal(&CompositorWake);
+    pthread_mutex_unlock(&CompositorLock);
+}
+
+// Waits until no more than limit events are waiting in a queue
+void waitForDrawQueue(DrawQueue *q, unsigned int limit)
+{
+    if (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) <= limit)
+        return;
+    pthread_mutex_lock(&CompositorLock);
+    __atomic_add_fetch(&QueueWaiters, 1, __ATOMIC_SEQ_CST);
+    while (q->head - __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) > limit)
+        pthread_cond_wait(&QueueSpace, &CompositorLock);
+    __atomic_sub_fetch(&QueueWaiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&CompositorLock);
+}
+
+// Returns 1 if the compositor has anything to do
+int drawEventsWaiting(unsigned int *tails)
+{
+    int i;
+    
+    if (Comparing && __atomic_load_n(&CompareView, __ATOMIC_SEQ_CST) != CompareShown)
+        return 1;
+    for (i = 0; i < DrawQueueCount; i++)
+        if (__atomic_load_n(&DrawQueues[i].head, __ATOMIC_SEQ_CST) != tails[i])
+            return 1;
+    return 0;
+}
+
+// Applies a batch of draw events to a frame buffer. Tiles are only marked once the frame
+// holding the changes has been swapped to the front.
+void applyDrawEvents(FrameBuffer *frame, DrawEvent *events, int count, unsigned int now, int markTiles)
+{
+    int i, tile, length;
+    
+    for (i = 0; i < count; i++)
+    {
+        if (events[i].type == DRAW_EVENT_PIXEL)
+        {
+            if (events[i].x >= frame->width || events[i].y >= frame->height)
+                continue;
+            *storePixel(&frame->pixels, events[i].x, events[i].y) = events[i].colour;
+            *storePixel(&frame->times, events[i].x, events[i].y) = now;
+            if (markTiles)
+            {
+                tile = (events[i].y / TILE_SIZE) * TilesX + events[i].x / TILE_SIZE;
+                __atomic_store_n(&DirtyTiles[tile], 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&ActivityLiveTiles[tile], 1, __ATOMIC_RELAXED);
+            }
+        }
+        else if (events[i].type == DRAW_EVENT_SPAN)
+        {
+            if (events[i].x >= frame->width || events[i].y >= frame->height)
+                continue;
+            length = (events[i].length > frame->width - events[i].x) ? frame->width - events[i].x : events[i].length;
+            fillStoreSpan(&frame->pixels, events[i].x, events[i].y, length, events[i].colour);
+            fillStoreSpan(&frame->times, events[i].x, events[i].y, length, now);
+            if (markTiles)
+                for (tile = (events[i].y / TILE_SIZE) * TilesX + events[i].x / TILE_SIZE; tile <= (events[i].y / TILE_SIZE) * TilesX + (events[i].x + length - 1) / TILE_SIZE; tile++)
                 {
-                    switch(line[n])
+                    __atomic_store_n(&DirtyTiles[tile], 1, __ATOMIC_RELAXED);
+                    __atomic_store_n(&ActivityLiveTiles[tile], 1, __ATOMIC_RELAXED);
+                }
+        }
+        else if (events[i].type == DRAW_EVENT_SCENE)
+        {
+            // Only sent in a batch applied under FrameLock
+            frame->width = events[i].x;
+            frame->height = events[i].y;
+            FreeTileStore(&frame->pixels);
+            FreeTileStore(&frame->times);
+            InitTileStore(&frame->pixels, frame->width, frame->height);
+            InitTileStore(&frame->times, frame->width, frame->height);
+            // Zoomed out views are drawn from the pyramids. Activity shows the latest draw.
+            AddTileLevels(&frame->pixels, MIP_AVERAGE);
+            AddTileLevels(&frame->times, MIP_LATEST);
+            if (markTiles)
+            {
+                free(DirtyTiles);
+                free(ActivityDirtyTiles);
+                free(ActivityLiveTiles);
+                TilesX = frame->pixels.tilesX;
+                TilesY = frame->pixels.tilesY;
+                DirtyTiles = calloc((long) TilesX * TilesY + 1, sizeof(unsigned char));
+                ActivityDirtyTiles = calloc((long) TilesX * TilesY + 1, sizeof(unsigned char));
+                ActivityLiveTiles = calloc((long) TilesX * TilesY + 1, sizeof(unsigned char));
+                FrameWidth = frame->width;
+                FrameHeight = frame->height;
+                markAllTilesDirty();
+            }
+        }
+        else if (events[i].type == DRAW_EVENT_FRAME)
+        {
+            if (events[i].x == frame->width && events[i].y == frame->height)
+                CopyTileStore(&frame->pixels, events[i].frame);
+            if (markTiles)
+            {
+                DeleteTileStore(events[i].frame);
+                markAllTilesDirty();
+            }
+        }
+    }
+}
+
+// Takes waiting events from a queue into the batch, up to the given head
+int takeDrawEvents(DrawQueue *queue, unsigned int head, unsigned int *tail, DrawEvent *batch, int count, int *resize)
+{
+    while (*tail != head && count < COMPOSITOR_BATCH)
+    {
+        batch[count] = queue->events[(*tail)++ & (DRAW_QUEUE_SIZE - 1)];
+        *resize |= (batch[count++].type == DRAW_EVENT_SCENE);
+    }
+    
+    return count;
+}
+
+// Compositor thread. Draw events are applied to the back frame buffer, which is then swapped
+// to the front. Once the renderer has left the old front buffer, it's brought up to date too.
+void *CompositorThreadFunc(void *arg)
+{
+    DrawEvent *batch = malloc(sizeof(DrawEvent) * COMPOSITOR_BATCH);
+    unsigned int *tails = calloc(DrawQueueCount, sizeof(unsigned int));
+    unsigned int head0, head, now;
+    int count, i, back, resize, drained;
+    
+    while (1)
+    {
+        // Draws from the workers are all sent before anything the parser thread sends after
+        // them, so queue 0 is only read once the workers' queues are empty.
+        count = resize = 0;
+        if (Comparing)
+            count = takeCompareEvents(tails, batch, &resize);
+        else
+        {
+            drained = 1;
+            head0 = __atomic_load_n(&DrawQueues[0].head, __ATOMIC_ACQUIRE);
+            for (i = 1; i < DrawQueueCount; i++)
+            {
+                head = __atomic_load_n(&DrawQueues[i].head, __ATOMIC_ACQUIRE);
+                count = takeDrawEvents(&DrawQueues[i], head, &tails[i], batch, count, &resize);
+                drained &= (tails[i] == head);
+            }
+            if (drained)
+                count = takeDrawEvents(&DrawQueues[0], head0, &tails[0], batch, count, &resize);
+        }
+        if (count == 0)
+        {
+            // Sleep until something is posted
+            pthread_mutex_lock(&CompositorLock);
+            __atomic_store_n(&CompositorSleeping, 1, __ATOMIC_SEQ_CST);
+            while (!drawEventsWaiting(tails))
+                pthread_cond_wait(&CompositorWake, &CompositorLock);
+            __atomic_store_n(&CompositorSleeping, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&CompositorLock);
+            continue;
+        }
+        
+        now = activityMillis();
+        if (resize)
+        {
+            // The renderer is kept out while both frame buffers change size
+            pthread_mutex_lock(&FrameLock);
+            applyDrawEvents(&Frames[FrontFrame ^ 1], batch, count, now, 0);
+            applyDrawEvents(&Frames[FrontFrame], batch, count, now, 1);
+            pthread_mutex_unlock(&FrameLock);
+        }
+        else
+        {
+            back = __atomic_load_n(&FrontFrame, __ATOMIC_RELAXED) ^ 1;
+            applyDrawEvents(&Frames[back], batch, count, now, 0);
+            __atomic_store_n(&FrontFrame, back, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&FrameReaders[back ^ 1], __ATOMIC_SEQ_CST))
+            {
+                pthread_mutex_lock(&CompositorLock);
+                __atomic_store_n(&FrameWaiting, 1, __ATOMIC_SEQ_CST);
+                while (__atomic_load_n(&FrameReaders[back ^ 1], __ATOMIC_SEQ_CST))
+                    pthread_cond_wait(&FrameReleased, &CompositorLock);
+                __atomic_store_n(&FrameWaiting, 0, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&CompositorLock);
+            }
+            applyDrawEvents(&Frames[back ^ 1], batch, count, now, 1);
+        }
+        
+        // The events have been applied, so their slots can be reused
+        for (i = 0; i < DrawQueueCount; i++)
+            __atomic_store_n(&DrawQueues[i].tail, tails[i], __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&QueueWaiters, __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_lock(&CompositorLock);
+            pthread_cond_broadcast(&QueueSpace);
+            pthread_mutex_unlock(&CompositorLock);
+        }
+    }
+    
+    return NULL;
+}
+
+// Starts the compositor, with a queue for the parser thread and one for each parallel worker
+void StartCompositor(void)
+{
+    int i;
+    
+    DrawQueueCount = ParseThreads + 1;
+    DrawQueues = calloc(DrawQueueCount, sizeof(DrawQueue));
+    for (i = 0; i < DrawQueueCount; i++)
+        DrawQueues[i].events = malloc(sizeof(DrawEvent) * DRAW_QUEUE_SIZE);
+    memset(Frames, 0, sizeof(Frames));
+    pthread_create(&CompositorThread, NULL, CompositorThreadFunc, NULL);
+}
+
+// Copies the text shown in the information panel into a free slot and hands it to the renderer
+void PublishInfoText(void)
+{
+    InfoText *info = &InfoSlots[InfoWriteSlot];
+    
+    snprintf(info->header[0], 256, "%s", (Parser->headerLine1 != NULL) ? Parser->headerLine1 : "");
+    snprintf(info->header[1], 256, "%s", (Parser->headerLine2 != NULL) ? Parser->headerLine2 : "");
+    snprintf(info->header[2], 256, "%s", (Parser->headerLine3 != NULL) ? Parser->headerLine3 : "");
+    memcpy(info->instruction, Parser->lastInstruction, 256);
+    memcpy(info->error[0], Parser->errorLine1, 256);
+    memcpy(info->error[1], Parser->errorLine2, 256);
+    info->theEnd = Parser->theEnd;
+    memcpy(info->summary[0], Parser->workspaceMessage, 256);
+    memcpy(info->summary[1], Parser->executionMessage, 256);
+    memcpy(info->summary[2], Parser->computingMessage, 256);
+    memcpy(info->summary[3], Parser->standbyTkMessage, 256);
+    memcpy(info->summary[4], Parser->avgSearchMessage, 256);
+    
+    InfoWriteSlot = __atomic_exchange_n(&InfoMiddleSlot, InfoWriteSlot | INFO_FRESH, __ATOMIC_ACQ_REL) & 3;
+}
+
+// Converts RGB values between 0 and 1 into the format held by the pixel store
+unsigned int packColour(float RVal, float GVal, float BVal)
+{
+    int iR = (int) ((RVal > 1.0 ? 1.0 : (RVal < 0 ? 0 : RVal)) * 255), iG = (int) ((GVal > 1.0 ? 1.0 : (GVal < 0 ? 0 : GVal)) * 255), iB = (int) ((BVal > 1.0 ? 1.0 : (BVal < 0 ? 0 : BVal)) * 255);
+    
+    return iR | (iG << 8) | (iB << 16);
+}
+
+// Records a pixel in the stamp store if it is newer than what is already there.
+// Keys are the byte offset of the source line so the latest line always wins.
+void stampPixel(int x, int y, uint64_t key, unsigned int colour)
+{
+    int tile = (y / TILE_SIZE) * Parser->pixelStore.tilesX + x / TILE_SIZE;
+    uint64_t stamp = (key << 24) | (colour & 0xFFFFFF), current, *stamps = __atomic_load_n(&StampTiles[tile], __ATOMIC_ACQUIRE), *fresh;
+    
+    // Another worker may be allocating the same tile. Only one allocation is kept.
+    if (stamps == NULL)
+    {
+        fresh = calloc(TILE_SIZE * TILE_SIZE, sizeof(uint64_t));
+        if (__atomic_compare_exchange_n(&StampTiles[tile], &stamps, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            stamps = fresh;
+        else
+            free(fresh);
+    }
+    stamps = &stamps[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+    current = __atomic_load_n(stamps, __ATOMIC_RELAXED);
+    while (current < stamp)
+        if (__atomic_compare_exchange_n(stamps, &current, stamp, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+}
+
+// Records a run of pixels along a row in the stamp store, as stampPixel does for one
+void stampSpan(int x, int y, int length, uint64_t key, unsigned int colour)
+{
+    int i;
+    
+    for (i = 0; i < length; i++)
+        stampPixel(x + i, y, key, colour);
+}
+
+// Frees every tile of the stamp store
+void clearStamps(void)
+{
+    long i;
+    
+    for (i = 0; i < (long) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY; i++)
+    {
+        free(StampTiles[i]);
+        StampTiles[i] = NULL;
+    }
+}
+
+// Replaces the pixel store with the stamp store, which is then freed. Pixels never stamped stay blank.
+void applyStamps(void)
+{
+    long d;
+    int idx;
+    
+    ClearTileStore(&Parser->pixelStore);
+    for (d = 0; d < (long) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY; d++)
+        if (StampTiles[d] != NULL)
+            for (idx = 0; idx < TILE_SIZE * TILE_SIZE; idx++)
+                if (StampTiles[d][idx] != 0)
+                    allocateTile(&Parser->pixelStore, d)[idx] = (unsigned int) (StampTiles[d][idx] & 0xFFFFFF);
+    publishPixelStore();
+    clearStamps();
+    free(StampTiles);
+    StampTiles = NULL;
+}
+
+// Shortcut method for populating the pixelstore and activitystore variables
+void setPixel(int x, int y, float RVal, float GVal, float BVal)
+{
+    int px = x, py = y;
+    unsigned int colour = packColour(RVal, GVal, BVal);
+    
+    // printf("At <%i, %i>, RGB %f, %f, %f is %08x\n", x, y, RVal, GVal, BVal, colour);
+    
+    // Draws on the far edge of the scene are accepted by the parser but may fall outside the store
+    if (wrapPixel(Parser->sceneWidth, Parser->sceneHeight, &px, &py))
+    {
+        // During parallel parsing, draws must also be ordered by their position in the file.
+        // The stamp store becomes the pixel store once the workers are done.
+        if (StampTiles != NULL)
+            stampPixel(px, py, StampKey, colour);
+        else
+            *storePixel(&Parser->pixelStore, px, py) = colour;
+        if (DrawQueues != NULL)
+            postDrawEvent(Parser->queue, DRAW_EVENT_PIXEL, px, py, colour, NULL);
+    }
+    if (TraceOutput != NULL)
+        RecordTraceEvent(x, y, colour);
+    if (ReplayEnabled)
+        RecordReplayDraws(1);
+}
+
+// Fills a run of pixels along a row of the scene, as setPixel does for a single pixel. The run
+// must lie within the scene. During parallel parsing it's stamped with the given key, and it's
+// sent to the compositor on the given queue.
+void fillSpan(int x, int y, int length, unsigned int colour, uint64_t key, int queue)
+{
+    int i;
+    
+    if (StampTiles != NULL)
+        stampSpan(x, y, length, key, colour);
+    else
+        fillStoreSpan(&Parser->pixelStore, x, y, length, colour);
+    
+    // The difference counts of a comparison are kept a pixel at a time
+    if (DrawQueues != NULL && Comparing)
+        for (i = 0; i < length; i++)
+            postDrawEvent(queue, DRAW_EVENT_PIXEL, x + i, y, colour, NULL);
+    else if (DrawQueues != NULL)
+        postDrawSpan(queue, x, y, length, colour);
+    
+    // Traces hold single pixels
+    for (i = 0; i < length && TraceOutput != NULL; i++)
+        RecordTraceEvent(x + i, y, colour);
+    if (ReplayEnabled)
+        RecordReplayDraws(length);
+}
+
+// This version checks the header of the DAMSON compiler output
+// The index is used to inform the function of the current line number
+int DAMSONHeaderCheck(char *line, int idx)
+{
+    char csymb[5], cnotice[10], dname[3], aname[10], progname[12], versionstr[10], version[10];
+    struct tm timer;
+    int scanout, n;
+    unsigned int *year;
+    
+    switch (idx)
+    {
+        case 0:
+            // This line is the DAMSON verion number
+            scanout = sscanf(line, "%s %s %s", progname, versionstr, version);
+            // Check to see if this failed or the number parsed was incorrect
+            
+            if (scanout == EOF || scanout < 3)
+                return 0;
+            // Check to see if the header is as anticipated
+            if (!strcmp(progname, "DAMSON"))
+                if (!strcmp(versionstr, "Version"))
+                    printf("Recognised %s Compiler %s %s\n\n", progname, versionstr, version);
+                else
+                    return 0;
+            else
+                return 0;
+            // Store this header line into a global variable. It may be useful
+            Parser->headerLine1 = malloc(sizeof(char) * (16 + strlen(version)));
+            // In this instance, it's easier to just add the version to the end.
+            sprintf(Parser->headerLine1, "DAMSON Version %s", version);
+            break;
+        case 1:
+            // This line is the copyright notice
+            scanout = sscanf(line, "%s %s %s %s %u", csymb, cnotice, dname, aname, &year);
+            if (scanout == EOF || scanout < 5)
+                return -1;
+            // Store this header line into a global variable. As before, this may be useful.
+            // First allocate memory then set all entries to null.
+            Parser->headerLine2 = malloc(sizeof(char) * (strlen(line) + 1));
+            memset(Parser->headerLine2, 0, strlen(line) + 1);
+            // Next determine if the incoming line has a new line character (hint: it does normally)
+            for (n = strlen(line); n > 0; n--)
+                if (line[n - 1] == '\n')
+                    break;
+            // In the (rare) instance this may not have a new line character, say that we want the entire string.
+            if (n == 0)
+                n = strlen(line);
+            // Copy the contents of the line to the header variable.
+            memcpy(&Parser->headerLine2[0], &line[0], n);
+            break;
+        case 2:
+            // This line is the time stamp that DAMSON was run
+            
+            // Check for the new line character.
+            for (n = strlen(line); n > 0; n--)
+            {
+                if (line[n - 1] == '\n')
+                    break;
+            }
+            // Remove the new line by replacing it with null if one was found
+            if (n > 0)
+                line[n - 1] = '\0';
+            
+            // Next, attempt to store the elements within the string into a timer object.
+            if (strptime(line, "%a %b %d %H:%M:%S %Y", &timer) == NULL)
+                return -2;
+            
+            // Reserve some memory and move the contents of the line to the header variable.
+            Parser->headerLine3 = malloc(sizeof(char) * (strlen(line) + 1));
+            memcpy(&Parser->headerLine3[0], &line[0], strlen(line) + 1);
+            break;
+        default:
+            return -3;
+    }
+    // If here, everything was okay.
+    return 1;
+}
+
+// Compiles a table of rules into the recognizer. The patterns are built into a trie, folded to
+// lower case, and the failure links of the trie are followed in advance so that every state
+// has a transition for every character. A line is then classified by one table lookup per
+// character, however many rules there are. Returns 0 if the table can't be used.
+int CompileRules(const LineRule *rules, int count)
+{
+    LineRecognizer *rec = &Recognizer;
+    int *fail, *queue, head = 0, tail = 0, maxStates = 1, r, n, s, u, c;
+    
+    if (count < 1 || count > MAX_RULES)
+    {
+        Error("Between 1 and %i line recognition rules are needed.\n", MAX_RULES);
+        return 0;
+    }
+    for (r = 0; r < count; r++)
+        maxStates += rules[r].length;
+    
+    free(rec->next);
+    free(rec->accept);
+    memset(rec, 0, sizeof(LineRecognizer));
+    memcpy(rec->rules, rules, sizeof(LineRule) * count);
+    rec->ruleCount = count;
+    rec->next = calloc(maxStates, sizeof(*rec->next));
+    rec->accept = calloc(maxStates, sizeof(uint32_t));
+    fail = calloc(maxStates, sizeof(int));
+    queue = malloc(sizeof(int) * maxStates);
+    
+    // Build the trie. No edge of the trie leads back to the root, so 0 marks a missing edge.
+    rec->stateCount = 1;
+    for (r = 0; r < count; r++)
+    {
+        for (s = 0, n = 0; n < rules[r].length; n++)
+        {
+            c = (unsigned char) rules[r].pattern[n];
+            c = (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+            if (rec->next[s][c] == 0)
+                rec->next[s][c] = rec->stateCount++;
+            s = rec->next[s][c];
+        }
+        rec->accept[s] |= 1u << r;
+        rec->handlerRules[rules[r].handler] |= 1u << r;
+    }
+    
+    // Fill in the missing transitions in breadth first order, so that the state a failure
+    // leads to is always complete before it's needed
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        s = queue[head++];
+        for (c = 0; c < 256; c++)
+        {
+            u = rec->next[s][c];
+            if (u != 0)
+            {
+                fail[u] = (s == 0) ? 0 : rec->next[fail[s]][c];
+                rec->accept[u] |= rec->accept[fail[u]];
+                queue[tail++] = u;
+            }
+            else
+                rec->next[s][c] = (s == 0) ? 0 : rec->next[fail[s]][c];
+        }
+    }
+    
+    // Upper case characters follow their lower case transitions
+    for (s = 0; s < rec->stateCount; s++)
+        for (c = 'A'; c <= 'Z'; c++)
+            rec->next[s][c] = rec->next[s][c + 'a' - 'A'];
+    
+    free(fail);
+    free(queue);
+    
+    return 1;
+}
+
+// Reads a table of rules from a file and compiles it in place of the default rules. Each line
+// holds a handler (draw, scene, summary, error, nofile, ignore, span, rect or rle), where the
+// pattern is found (anywhere, prefix or line), whether case matters (case or nocase) and then
+// the pattern, which runs to the end of the line. Lines starting with # are comments. A line
+// is drawn, reported as an error and so on if it satisfies any of that handler's rules, except
+// for scenes: a scene description must satisfy all of the scene rules. Returns 0 on failure.
+int LoadRules(char *filename)
+{
+    LineRule rules[MAX_RULES];
+    FILE *fp;
+    char text[256], handler[16], position[16], matchCase[16], *pattern;
+    int count = 0, lineNo = 0, start, len, n;
+    
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        Error("Unable to open rule file \"%s\".\n\n", filename);
+        return 0;
+    }
+    
+    while (fgets(text, sizeof(text), fp) != NULL)
+    {
+        lineNo++;
+        len = strlen(text);
+        while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r' || text[len - 1] == ' ' || text[len - 1] == '\t'))
+            text[--len] = '\0';
+        for (n = 0; text[n] == ' ' || text[n] == '\t'; n++)
+            ;
+        if (text[n] == '\0' || text[n] == '#')
+            continue;
+        
+        if (sscanf(text, "%15s %15s %15s %n", handler, position, matchCase, &start) < 3 || text[start] == '\0')
+        {
+            Error("Rule on line %i of \"%s\" should give a handler, position, case and pattern.\n", lineNo, filename);
+            break;
+        }
+        if (count == MAX_RULES)
+        {
+            Error("Rule file \"%s\" has more than %i rules.\n", filename, MAX_RULES);
+            break;
+        }
+        
+        pattern = &text[start];
+        rules[count].length = strlen(pattern);
+        if (rules[count].length > MAX_RULE_LENGTH)
+        {
+            Error("Pattern on line %i of \"%s\" is longer than %i characters.\n", lineNo, filename, MAX_RULE_LENGTH);
+            break;
+        }
+        strcpy(rules[count].pattern, pattern);
+        
+        for (n = 0; n < RULE_HANDLERS && strcmp(handler, RuleHandlerNames[n]); n++)
+            ;
+        rules[count].handler = n;
+        rules[count].position = !strcmp(position, "anywhere") ? RULE_ANYWHERE : (!strcmp(position, "prefix") ? RULE_PREFIX : (!strcmp(position, "line") ? RULE_LINE : -1));
+        rules[count].matchCase = !strcmp(matchCase, "case") ? 1 : (!strcmp(matchCase, "nocase") ? 0 : -1);
+        if (n == RULE_HANDLERS || rules[count].position < 0 || rules[count].matchCase < 0)
+        {
+            Error("Unrecognised handler, position or case on line %i of \"%s\".\n", lineNo, filename);
+            break;
+        }
+        count++;
+    }
+    
+    // Stopped early by a bad rule
+    if (!feof(fp))
+    {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    
+    if (!CompileRules(rules, count))
+        return 0;
+    printf("Loaded %i line recognition rules from \"%s\"\n\n", count, filename);
+    
+    return 1;
+}
+
+// This function makes a single pass over a line of text. It removes the new line character,
+// runs the recognizer over the line and notes the location of every draw call delimiter so
+// that ParseLine does not need to revisit the line (or allocate memory) to classify it.
+void ScanLine(char *line, LineScan *scan)
+{
+    const LineRecognizer *rec = &Recognizer;
+    const LineRule *rule;
+    int n, r, state = 0, structure = 1, ruleEnd[MAX_RULES];
+    uint32_t seen = 0, matches, satisfied = 0;
+    char ch;
+    
+    scan->handlers = 0;
+    scan->drawEnd = scan->bulkEnd = scan->bulkHandler = -1;
+    scan->lBrack = scan->rBrack = scan->eqsign = scan->comsign = -1;
+    scan->lastNonNumeric = -1;
+    scan->drawFault = 0;
+    scan->eqWarnings = 0;
+    
+    for (n = 0; (ch = line[n]) != '\0'; n++)
+    {
+        if (ch == '\n')
+        {
+            // Remove the new line character. Nothing after this is of interest.
+            line[n] = '\0';
+            break;
+        }
+        
+        // Track the last character that couldn't be part of a scene description
+        if ((ch < '0' || ch > '9') && ch != ' ' && ch != '\t')
+            scan->lastNonNumeric = n;
+        
+        // Once the draw keyword has been found, track the structure of the call
+        if (scan->drawEnd >= 0 && structure)
+        {
+            switch (ch)
+            {
+                case '(':
+                    if (scan->lBrack < 0)
+                        scan->lBrack = n;
+                    else
+                    {
+                        // Too many brackets
+                        scan->drawFault = 4;
+                        structure = 0;
+                    }
+                    break;
+                case ')':
+                    if (scan->lBrack < 0 || scan->rBrack >= 0)
+                    {
+                        // Out of order or too many brackets
+                        scan->drawFault = 5;
+                        structure = 0;
+                    }
+                    else
+                        scan->rBrack = n;
+                    break;
+                case '=':
+                    if (scan->rBrack < 0)
+                        scan->eqWarnings++;
+                    if (scan->eqsign < 0)
+                        scan->eqsign = n;
+                    else
+                    {
+                        // Too many equals
+                        scan->drawFault = 6;
+                        structure = 0;
+                    }
+                    break;
+                case ',':
+                    if (scan->comsign >= 0)
+                    {
+                        scan->drawFault = 7;
+                        structure = 0;
+                    }
+                    else if (scan->lBrack >= 0 && scan->rBrack < 0)
+                        scan->comsign = n;
+                    break;
+            }
+        }
+        
+        // Note the first occurrence of each rule's pattern
+        state = rec->next[state][(unsigned char) ch];
+        for (matches = rec->accept[state] & ~seen; matches != 0; matches &= matches - 1)
+        {
+            r = __builtin_ctz(matches);
+            rule = &rec->rules[r];
+            if (rule->position != RULE_ANYWHERE && n + 1 != rule->length)
+                continue;
+            if (rule->matchCase && memcmp(&line[n + 1 - rule->length], rule->pattern, rule->length))
+                continue;
+            seen |= 1u << r;
+            ruleEnd[r] = n + 1;
+            if (rule->handler == RULE_DRAW && scan->drawEnd < 0)
+                scan->drawEnd = n + 1;
+            else if (((1 << rule->handler) & RULE_BULK) && scan->bulkEnd < 0)
+            {
+                scan->bulkEnd = n + 1;
+                scan->bulkHandler = rule->handler;
+            }
+        }
+    }
+    scan->length = n;
+    
+    // Check what follows each match now that the length is known
+    for (matches = seen; matches != 0; matches &= matches - 1)
+    {
+        r = __builtin_ctz(matches);
+        rule = &rec->rules[r];
+        if (rule->position == RULE_LINE ? (ruleEnd[r] == n) : (ruleEnd[r] <= n - RuleTrailing[rule->handler]))
+            satisfied |= 1u << r;
+    }
+    for (r = 0; r < RULE_HANDLERS; r++)
+        if (r == RULE_SCENE ? (rec->handlerRules[r] != 0 && (satisfied & rec->handlerRules[r]) == rec->handlerRules[r]) : (satisfied & rec->handlerRules[r]) != 0)
+            scan->handlers |= 1 << r;
+}
+
+// Classifies a line by searching for the default keywords directly, as the parser did before
+// the rules were compiled into a recognizer. Kept to measure the recognizer against.
+void ScanLineKeywords(char *line, LineScan *scan)
+{
+    int n, structure = 1, drawLoc = -1, errorLoc = -1, dimensionLoc = -1, sceneLoc = -1;
+    int spanLoc = -1, rectLoc = -1, rleLoc = -1;
+    char ch;
+    
+    scan->handlers = 0;
+    scan->lBrack = scan->rBrack = scan->eqsign = scan->comsign = -1;
+    scan->lastNonNumeric = -1;
+    scan->drawFault = 0;
+    scan->eqWarnings = 0;
+    
+    for (n = 0; (ch = line[n]) != '\0'; n++)
+    {
+        if (ch == '\n')
+        {
+            line[n] = '\0';
+            break;
+        }
+        if ((ch < '0' || ch > '9') && ch != ' ' && ch != '\t')
+            scan->lastNonNumeric = n;
+        
+        if (drawLoc >= 0 && n >= drawLoc + 4 && structure)
+        {
+            switch (ch)
+            {
+                case '(':
+                    if (scan->lBrack < 0)
+                        scan->lBrack = n;
+                    else
+                    {
+                        scan->drawFault = 4;
+                        structure = 0;
+                    }
+                    break;
+                case ')':
+                    if (scan->lBrack < 0 || scan->rBrack >= 0)
+                    {
+                        scan->drawFault = 5;
+                        structure = 0;
+                    }
+                    else
+                        scan->rBrack = n;
+                    break;
+                case '=':
+                    if (scan->rBrack < 0)
+                        scan->eqWarnings++;
+                    if (scan->eqsign < 0)
+                        scan->eqsign = n;
+                    else
                     {
-                        case '(':
-                            if (lBrack < 0)
-                                lBrack = n;
-                            else
-                            {
-                                // Too many brackets
-                                Warning("Warning: Disfigured draw call on line %i. Too many parentheses.\n", lineNo);
-                                return 4;
-                            }
-                            break;
-                        case ')':
-                            if (lBrack < 0)
-                            {
-                                Warning("Warning: Parentheses could be out of order on line %i\n", lineNo);
-                                return 5;
-                            }
-                            if (rBrack < 0)
-                                rBrack = n;
-                            else
-                            {
-                                // Too many brackets
-                                Warning("Warning: Disfigured draw call on line %i. Too many parentheses.\n", lineNo);
-                                return 5;
-                            }
-                            break;
-                        case '=':
-                            if (rBrack < 0)
-                            {
-                                Warning("Warning: Equals encountered before closing parentheses on line %i.\n", lineNo);
-                            }
-                            if (eqsign < 0)
-                                eqsign = n;
-                            else
-                            {
-                                // Too many brackets
-                                Warning("Warning: Disfigured draw call on line %i. Too many equals.\n", lineNo);
-                                return 6;
-                            }
-                            break;
-                        case ',':
-                            if (comsign >= 0)
-                            {
-                                Warning("Warning: Multiple commas encountered on line %i.\n", lineNo);
-                                return 7;
-                            }
-                            if (lBrack >= 0 && rBrack < 0)
-                            {
-                                comsign = n;
-                            }
-                        // default:
-                            // Do nothing.
+                        scan->drawFault = 6;
+                        structure = 0;
                     }
+                    break;
+                case ',':
+                    if (scan->comsign >= 0)
+                    {
+                        scan->drawFault = 7;
+                        structure = 0;
+                    }
+                    else if (scan->lBrack >= 0 && scan->rBrack < 0)
+                        scan->comsign = n;
+                    break;
+            }
+        }
+        
+        switch (ch)
+        {
+            case 'd':
+                if (drawLoc < 0 && !strncmp(&line[n], "draw", 4))
+                    drawLoc = n;
+                // Fall through to look for "dimension"
+            case 'D':
+                if (dimensionLoc < 0 && !strncasecmp(&line[n], "dimension", 9))
+                    dimensionLoc = n;
+                break;
+            case 'e':
+            case 'E':
+                if (errorLoc < 0 && !strncasecmp(&line[n], "error", 5))
+                    errorLoc = n;
+                break;
+            case 's':
+                if (spanLoc < 0 && !strncmp(&line[n], "span(", 5))
+                    spanLoc = n;
+                // Fall through to look for "scene"
+            case 'S':
+                if (sceneLoc < 0 && !strncasecmp(&line[n], "scene", 5))
+                    sceneLoc = n;
+                break;
+            case 'r':
+                if (rectLoc < 0 && !strncmp(&line[n], "rect(", 5))
+                    rectLoc = n;
+                if (rleLoc < 0 && !strncmp(&line[n], "rle(", 4))
+                    rleLoc = n;
+                break;
+        }
+    }
+    scan->length = n;
+    scan->drawEnd = (drawLoc < 0) ? -1 : drawLoc + 4;
+    
+    // The first bulk draw keyword decides the command
+    scan->bulkEnd = scan->bulkHandler = -1;
+    if (spanLoc >= 0)
+    {
+        scan->bulkEnd = spanLoc + 5;
+        scan->bulkHandler = RULE_SPAN;
+    }
+    if (rectLoc >= 0 && (scan->bulkEnd < 0 || rectLoc + 5 < scan->bulkEnd))
+    {
+        scan->bulkEnd = rectLoc + 5;
+        scan->bulkHandler = RULE_RECT;
+    }
+    if (rleLoc >= 0 && (scan->bulkEnd < 0 || rleLoc + 4 < scan->bulkEnd))
+    {
+        scan->bulkEnd = rleLoc + 4;
+        scan->bulkHandler = RULE_RLE;
+    }
+    
+    if (n == 8 && !strcmp(line, "No file?"))
+        scan->handlers |= 1 << RULE_NOFILE;
+    if (!strncmp(line, "Timeout", 7))
+        scan->handlers |= 1 << RULE_IGNORE;
+    if (n > 10 && !strncmp(line, "Workspace:", 10))
+        scan->handlers |= 1 << RULE_SUMMARY;
+    if (drawLoc >= 0 && drawLoc < n - 4)
+        scan->handlers |= 1 << RULE_DRAW;
+    if (errorLoc >= 0 && errorLoc < n - 6)
+        scan->handlers |= 1 << RULE_ERROR;
+    if (dimensionLoc >= 0 && dimensionLoc < n - 10 && sceneLoc >= 0 && sceneLoc < n - 6)
+        scan->handlers |= 1 << RULE_SCENE;
+    if (spanLoc >= 0 && spanLoc < n - 5)
+        scan->handlers |= 1 << RULE_SPAN;
+    if (rectLoc >= 0 && rectLoc < n - 5)
+        scan->handlers |= 1 << RULE_RECT;
+    if (rleLoc >= 0 && rleLoc < n - 4)
+        scan->handlers |= 1 << RULE_RLE;
+}
+
+// Stores a line for printing in the visualiser
+void StoreLastInstruction(char *line, int len)
+{
+    memset(Parser->lastInstruction, 0, 256);
+    memcpy(&Parser->lastInstruction[0], &line[0], (len > 255) ? 255 : len);
+}
+
+// Reads an integer the way "%i" would: decimal, hexadecimal with a 0x prefix or octal with a
+// leading 0. Returns 0 without reading anything if the text is unusual enough that sscanf
+// should decide, such as a missing number or more digits than a long can hold.
+int ParseIntFast(const char **text, int *value)
+{
+    const char *p = *text, *digits;
+    unsigned long long v = 0;
+    int negative = 0, base = 10, d;
+    
+    while (*p == ' ' || (*p >= '\t' && *p <= '\r'))
+        p++;
+    if (*p == '-' || *p == '+')
+        negative = (*p++ == '-');
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        base = 16;
+        p += 2;
+    }
+    else if (p[0] == '0')
+        base = 8;
+    
+    for (digits = p; ; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+            d = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            d = *p - 'A' + 10;
+        else
+            break;
+        if (d >= base)
+            break;
+        v = v * base + d;
+    }
+    if (p == digits || p - digits > 15)
+        return 0;
+    
+    // Stored through a long as sscanf does
+    *value = (int) (long) (negative ? -(long long) v : (long long) v);
+    *text = p;
+    
+    return 1;
+}
+
+// Reads a plain decimal number the way "%f" would. The result is rounded exactly as strtof
+// would round it. Returns 0 without reading anything for exponents, hexadecimal, infinities,
+// more than 15 significant digits or anything else best left to sscanf.
+int ParseFloatFast(const char **text, float *value)
+{
+    static const double powers[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *p = *text;
+    unsigned long long mantissa = 0;
+    int negative = 0, digits = 0, significant = 0, fraction = 0;
+    double d;
+    float f, next;
+    
+    while (*p == ' ' || (*p >= '\t' && *p <= '\r'))
+        p++;
+    if (*p == '-' || *p == '+')
+        negative = (*p++ == '-');
+    for (; *p >= '0' && *p <= '9'; p++, digits++)
+        if ((mantissa = mantissa * 10 + (*p - '0')) > 0)
+            significant++;
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++, fraction++)
+            if ((mantissa = mantissa * 10 + (*p - '0')) > 0)
+                significant++;
+    if (digits == 0 || significant > 15 || fraction > 22 || *p == 'e' || *p == 'E' || ((*p == 'x' || *p == 'X') && digits == 1))
+        return 0;
+    
+    // Both operands are exact, so the quotient is correctly rounded to a double
+    d = (double) mantissa / powers[fraction];
+    f = (float) d;
+    
+    // Rounding again to a float only differs from rounding once if d lies exactly halfway
+    // between two floats
+    if ((double) f != d)
+    {
+        next = nextafterf(f, (d > f) ? INFINITY : -INFINITY);
+        if (d - f == next - d)
+            return 0;
+    }
+    *value = negative ? -f : f;
+    *text = p;
+    
+    return 1;
+}
+
+// Reads the values of a draw call using sscanf. See ReadDrawValues.
+int ReadDrawValuesScanf(char *line, LineScan *scan, int *x, int *y, float *RVal, float *GVal, float *BVal)
+{
+    int scanout;
+    
+    // The closing parenthesis ends the coordinates so these can be read in place.
+    scanout = sscanf(&line[scan->lBrack + 1], "%i, %i", x, y);
+    if (scanout == EOF || scanout < 2)
+        return 1;
+    
+    scanout = sscanf(&line[scan->eqsign + 1], "%f %f %f", RVal, GVal, BVal);
+    if (scanout == EOF || scanout < 3)
+        return 2;
+    
+    return 0;
+}
+
+// Reads the coordinates and RGB values of a well formed draw call. Returns 0 on success,
+// 1 if the coordinates could not be read or 2 if the RGB values could not be read.
+// The usual "x, y" and "r g b" forms are read in place; anything else is left to sscanf.
+int ReadDrawValues(char *line, LineScan *scan, int *x, int *y, float *RVal, float *GVal, float *BVal)
+{
+    const char *p = &line[scan->lBrack + 1];
+    
+    if (!ParseIntFast(&p, x) || *p++ != ',' || !ParseIntFast(&p, y))
+        return ReadDrawValuesScanf(line, scan, x, y, RVal, GVal, BVal);
+    
+    p = &line[scan->eqsign + 1];
+    if (!ParseFloatFast(&p, RVal) || !ParseFloatFast(&p, GVal) || !ParseFloatFast(&p, BVal))
+        return ReadDrawValuesScanf(line, scan, x, y, RVal, GVal, BVal);
+    
+    return 0;
+}
+
+// Reads an integer of a bulk draw command, leaving unusual forms to strtol
+int readBulkInt(const char **text, int *value)
+{
+    char *end;
+    long v;
+    
+    if (ParseIntFast(text, value))
+        return 1;
+    v = strtol(*text, &end, 0);
+    if (end == *text || v < INT_MIN || v > INT_MAX)
+        return 0;
+    *value = (int) v;
+    *text = end;
+    
+    return 1;
+}
+
+// Reads a colour value of a bulk draw command, leaving unusual forms to strtof
+int readBulkFloat(const char **text, float *value)
+{
+    char *end;
+    
+    if (ParseFloatFast(text, value))
+        return 1;
+    *value = strtof(*text, &end);
+    if (end == *text)
+        return 0;
+    *text = end;
+    
+    return 1;
+}
+
+// Reads the next run of an rle command: a length followed by the RGB values of the run.
+// Returns 1 if a run was read, 0 at the end of the line or -1 if the run can't be read.
+int readBulkRun(const char **text, int *length, unsigned int *colour)
+{
+    float RVal, GVal, BVal;
+    
+    while (**text == ' ' || **text == '\t' || **text == '\r')
+        (*text)++;
+    if (**text == '\0')
+        return 0;
+    if (!readBulkInt(text, length) || !readBulkFloat(text, &RVal) || !readBulkFloat(text, &GVal) || !readBulkFloat(text, &BVal))
+        return -1;
+    *colour = packColour(RVal, GVal, BVal);
+    
+    return 1;
+}
+
+// Reads a bulk draw command and checks it against the scene. The forms are
+//     span(x, y, length) = r g b
+//     rect(x, y, width, height) = r g b
+//     rle(x, y) = length r g b [length r g b ...]
+// each filling from (x, y) along the row and, for rectangles, down the scene. Returns 0 if the
+// command can be applied, 8 if it's disfigured, 9 if its values can't be read or 10 if it
+// doesn't lie within the scene. Nothing is printed, so the workers can use it too.
+int ReadBulkDraw(char *line, LineScan *scan, BulkDraw *bulk)
+{
+    const char *p = &line[scan->bulkEnd];
+    int args[4], count = (scan->bulkHandler == RULE_RECT) ? 4 : ((scan->bulkHandler == RULE_SPAN) ? 3 : 2), i, run, read;
+    float RVal, GVal, BVal;
+    unsigned int colour;
+    
+    // The keyword's pattern may include the opening parenthesis
+    if (p[-1] != '(')
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p++ != '(')
+            return 8;
+    }
+    for (i = 0; i < count; i++)
+    {
+        while (i > 0 && (*p == ' ' || *p == '\t'))
+            p++;
+        if ((i > 0 && *p++ != ',') || !readBulkInt(&p, &args[i]))
+            return 8;
+    }
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p++ != ')')
+        return 8;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p++ != '=')
+        return 8;
+    
+    bulk->handler = scan->bulkHandler;
+    bulk->x = args[0];
+    bulk->y = args[1];
+    bulk->width = (count > 2) ? args[2] : 0;
+    bulk->height = (count > 3) ? args[3] : 1;
+    if (bulk->handler == RULE_RLE)
+    {
+        // The runs are read again as they're drawn
+        bulk->runs = p;
+        while ((read = readBulkRun(&p, &run, &colour)) > 0)
+        {
+            if (run < 1)
+                return 9;
+            if (run > MAX_SCENE_SIZE - bulk->width)
+                return 10;
+            bulk->width += run;
+        }
+        if (read < 0 || bulk->width == 0)
+            return 9;
+    }
+    else
+    {
+        if (!readBulkFloat(&p, &RVal) || !readBulkFloat(&p, &GVal) || !readBulkFloat(&p, &BVal))
+            return 9;
+        bulk->colour = packColour(RVal, GVal, BVal);
+    }
+    
+    if (bulk->x < 0 || bulk->y < 0 || bulk->width < 1 || bulk->height < 1 || bulk->width > Parser->sceneWidth - bulk->x || bulk->height > Parser->sceneHeight - bulk->y)
+        return 10;
+    
+    return 0;
+}
+
+// Fills the pixels of a bulk draw command read by ReadBulkDraw. Each row is a span.
+void ApplyBulkDraw(BulkDraw *bulk, uint64_t key, int queue)
+{
+    const char *p = bulk->runs;
+    unsigned int colour;
+    int x, y, run;
+    
+    if (bulk->handler == RULE_RLE)
+    {
+        for (x = bulk->x; readBulkRun(&p, &run, &colour) > 0; x += run)
+            fillSpan(x, bulk->y, run, colour, key, queue);
+    }
+    else
+        for (y = bulk->y; y < bulk->y + bulk->height; y++)
+            fillSpan(bulk->x, y, bulk->width, bulk->colour, key, queue);
+}
+
+// Parses and applies a bulk draw command. Returns as ParseLine would.
+int ParseBulkDraw(char *line, LineScan *scan, int lineNo)
+{
+    const char *name = RuleHandlerNames[scan->bulkHandler];
+    BulkDraw bulk;
+    
+    switch (ReadBulkDraw(line, scan, &bulk))
+    {
+        case 8:
+            Warning("Warning: Disfigured %s command on line %i.\n", name, lineNo);
+            return 8;
+        case 9:
+            Error("Could not parse values from %s command on line %i\n", name, lineNo);
+            return 9;
+        case 10:
+            Error("Pixels of %s command are outside scenery dimensions on line %i\n", name, lineNo);
+            return 10;
+    }
+    
+    ApplyBulkDraw(&bulk, StampKey, Parser->queue);
+    return 100;
+}
+
+// Measures the rate at which draw calls are read, with and without sscanf
+void BenchmarkDrawParsing(long count)
+{
+    char lines[64][128];
+    LineScan scans[64];
+    struct timespec start, end;
+    double fastTime, scanfTime;
+    float RVal, GVal, BVal;
+    double fastSum = 0.0, scanfSum = 0.0;
+    int i, x, y;
+    long n;
+    
+    // A mixture of the draw calls seen in DAMSON logs
+    srand(1);
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(lines[i], "node %i: draw(%i, %i) = %f %f %f", rand() % 1000, rand() % 1024, rand() % 768, rand() / (float) RAND_MAX, rand() / (float) RAND_MAX, rand() / (float) RAND_MAX);
+        ScanLine(lines[i], &scans[i]);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < count; n++)
+    {
+        ReadDrawValues(lines[n & 63], &scans[n & 63], &x, &y, &RVal, &GVal, &BVal);
+        fastSum += RVal + GVal + BVal + x + y;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fastTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < count; n++)
+    {
+        ReadDrawValuesScanf(lines[n & 63], &scans[n & 63], &x, &y, &RVal, &GVal, &BVal);
+        scanfSum += RVal + GVal + BVal + x + y;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    scanfTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    printf("Draw parsing benchmark (%li draws):\n", count);
+    printf("     In place: %.0f draws/s\n", count / fastTime);
+    printf("     sscanf:   %.0f draws/s\n", count / scanfTime);
+    printf("     Speed up: %.1fx\n", scanfTime / fastTime);
+    printf("     Results %s\n\n", (fastSum == scanfSum) ? "match" : "DIFFER");
+}
+
+// This function parses a line of text
+int ParseLine(char *line, int lineNo)
+{
+    LineScan scan;
+    int n, len, x, y, width, height, scanout;
+    float RVal, GVal, BVal;
+    
+    // First, classify the line. This also removes the new line character
+    ScanLine(line, &scan);
+    len = scan.length;
+    
+    // Now determine if there's something to look at:
+    if (len > 0)
+    {
+        if (!Parser->theEnd)
+        {
+            // Check for no file errors
+            if (scan.handlers & (1 << RULE_NOFILE))
+            {
+                // No file provided. Bad.
+                Error("Error: No file was passed to the DAMSON compiler.\n");
+                return 0;
+            }
+            
+            // Lookout for the timeout command and anything else that's ignored.
+            if (scan.handlers & (1 << RULE_IGNORE))
+                return 3;
+            
+            // Are we at the end?
+            if (scan.handlers & (1 << RULE_SUMMARY))
+            {
+                // Recognised keyword. It's highly probable we're at the end.
+                // Raise the end flag.
+                Parser->theEnd = 1;
+                // Copy line to workspace variable
+                memcpy(&Parser->workspaceMessage[0], &line[0], (len > 255) ? 255 : len);
+                // And return to the calling function
+                return 2;
+            }
+            if (len < 6)
+            {
+                // Line is too short to be anything useful
+                return 3;
+            }
+            
+            // Store the read line for printing in the visualiser
+            StoreLastInstruction(line, len);
+            
+            // If here, we're not at the end. Check to see if draw was found
+            if (scan.handlers & (1 << RULE_DRAW))
+            {
+                // Report any equals that preceded the closing parentheses
+                for (n = 0; n < scan.eqWarnings; n++)
+                    Warning("Warning: Equals encountered before closing parentheses on line %i.\n", lineNo);
+                
+                switch (scan.drawFault)
+                {
+                    case 4:
+                        Warning("Warning: Disfigured draw call on line %i. Too many parentheses.\n", lineNo);
+                        return 4;
+                    case 5:
+                        if (scan.lBrack < 0)
+                            Warning("Warning: Parentheses could be out of order on line %i\n", lineNo);
+                        else
+                            Warning("Warning: Disfigured draw call on line %i. Too many parentheses.\n", lineNo);
+                        return 5;
+                    case 6:
+                        Warning("Warning: Disfigured draw call on line %i. Too many equals.\n", lineNo);
+                        return 6;
+                    case 7:
+                        Warning("Warning: Multiple commas encountered on line %i.\n", lineNo);
+                        return 7;
                 }
                 
                 // By this point, we should know where we are:
-                if (lBrack < 0 || rBrack < 0 || eqsign < 0 || comsign < 0)
+                if (scan.lBrack < 0 || scan.rBrack < 0 || scan.eqsign < 0 || scan.comsign < 0)
                 {
                     // Invalid line.
                     return 8;
                 }
                 
                 // Check scene dimensions
-                if (SceneHeight == 0 || SceneWidth == 0)
+                if (Parser->sceneHeight == 0 || Parser->sceneWidth == 0)
+                {
+                    Error("Error: Found draw command before scene dimensions defined on line %i.\n", lineNo);
+                    return 0;
+                }
+                
+                // If here, we have everything we need. Let's try parsing some of this information
+                scanout = ReadDrawValues(line, &scan, &x, &y, &RVal, &GVal, &BVal);
+                
+                if (scanout == 1)
+                {
+                    Error("Could not parse coordinates from draw command on line %i\n", lineNo);
+                    return 9;
+                }
+                if (scanout == 2)
+                {
+                    Error("Could not parse RGB values from draw command on line %i\n", lineNo);
+                    
+                    return 9;
+                }
+                
+                // If here, we've successfully extracted RGB values and coordinate information.
+                // printf("X: %i Y: %i --> R: %f G: %f B: %f\n", x, y, RVal, GVal, BVal);
+                
+                // Just check that the pixel values do not exceed the scene dimensions
+                if (x > Parser->sceneWidth || x < 0)
+                {
+                    Error("Pixel draw x coordinate is outside scenery dimensions on line %i\n", lineNo);
+                    
+                    return 10;
+                }
+                if (y > Parser->sceneHeight || y < 0)
+                {
+                    Error("Pixel draw y coordinate is outside scenery dimensions on line %i\n", lineNo);
+                    
+                    return 10;
+                }
+                
+                setPixel(x, y, RVal, GVal, BVal);
+                return 100;
+            }
+            // Spans, rectangles and run-length encoded rows are filled in one go
+            if (scan.handlers & RULE_BULK)
+            {
+                if (Parser->sceneHeight == 0 || Parser->sceneWidth == 0)
                 {
                     Error("Error: Found draw command before scene dimensions defined on line %i.\n", lineNo);
                     return 0;
                 }
+                return ParseBulkDraw(line, &scan, lineNo);
+            }
+            // Let's check for the keyword "error".
+            if (scan.handlers & (1 << RULE_ERROR))
+            {
+                // Yes, it's an error message. Best way to handle this is to print this error
+                // and recommend further debugging outside the DAMSON parser. Finally, return
+                // with an error condition.
+                Error("An error was encountered in DAMSON:\n");
+                Error("     %s\n", line);
+                Error("Please debug outside the DAMSON parser environment.\n");
+                return -1;
+            }
+            
+            // No draw keyword was found. This could be a scene definition
+            if (len > 17)
+            {
+                // Look for the keywords dimension and scene.
+                if (!(scan.handlers & (1 << RULE_SCENE)))
+                {
+                    // Assume this is debug information.
+                    return 3;
+                }
                 
-                // If here, we have everything we need. Let's try parsing some of this information
-                
-                tempString = malloc(sizeof(char) * (rBrack - lBrack + 1));
-                memset(tempString, 0, (rBrack - lBrack + 1));
-                memcpy(&tempString[0], &line[lBrack + 1], rBrack - lBrack);
-                scanout = sscanf(tempString, "%i, %i", &x, &y);
-                free(tempString);
+                // If here, we have the keywords scene and dimensions. We can therefore parse this:
+                n = scan.lastNonNumeric;
+                if (n == 0)
+                {
+                    Error("Warning: Could not recognise scene description on line %i.\n", lineNo);
+                    return 3;
+                }
                 
+                scanout = sscanf(&line[n + 1], "%i %i", &width, &height);
                 if (scanout == EOF || scanout < 2)
                 {
-                    Error("Could not parse coordinates from draw command on line %i\n", lineNo);
-                    return 9;
+                    Error("Warning: Unable to understand scene description on line %i.\n", lineNo);
+                    return 3;
                 }
-                
-                tempString = malloc(sizeof(char) * (strlen(line) - eqsign));
-                memset(tempString, 0, strlen(line) - eqsign);
-                memcpy(&tempString[0], &line[eqsign + 1], strlen(line) - eqsign - 1);
-                scanout = sscanf(tempString, "%f %f %f", &RVal, &GVal, &BVal);
-                // printf("%i: \"%s\"\n", lineNo, tempString);
-                free(tempString);
-                
-                if (scanout == EOF || scanout < 3)
+                if (width < 0 || height < 0 || width > MAX_SCENE_SIZE || height > MAX_SCENE_SIZE)
                 {
-                    Error("Could not parse RGB values from draw command on line %i\n", lineNo);
-                    
-                    return 9;
+                    Error("Warning: Scene dimensions on line %i are outside 0 to %i.\n", lineNo, MAX_SCENE_SIZE);
+                    return 3;
                 }
-                
-                // If here, we've successfully extracted RGB values and coordinate information.
-                // printf("X: %i Y: %i --> R: %f G: %f B: %f\n", x, y, RVal, GVal, BVal);
-                
-                // Just check that the pixel values do not exceed the scene dimensions
-                if (x > SceneWidth || x < 0)
+                // Merged files share one scene, which can't be replaced while others draw on it
+                if (Merging)
+                    return JoinMergedScene(width, height, lineNo);
+                // Producers describing the scene already drawn into join it rather than clear it.
+                // One describing another size would clear the others' draws, so it's stopped.
+                if (Parser->shared && Parser->pixelStore.tiles != NULL)
                 {
-                    Error("Pixel draw x coordinate is outside scenery dimensions on line %i\n", lineNo);
-                    
-                    return 10;
+                    if (width != Parser->sceneWidth || height != Parser->sceneHeight)
+                    {
+                        Error("Scene dimensions on line %i of \"%s\" differ from the shared scene (%i x %i).\n", lineNo, Parser->filename,
+                            Parser->sceneWidth, Parser->sceneHeight);
+                        return 0;
+                    }
+                    printf("Scene dimensions recognised (%i x %i), joining the shared scene\n", width, height);
+                    setGraphicsFlag(1);
+                    return 3;
                 }
-                if (y > SceneHeight || y < 0)
+                Parser->sceneWidth = width;
+                Parser->sceneHeight = height;
+
+                printf("Scene dimensions recognised (%i x %i)\n", Parser->sceneWidth, Parser->sceneHeight);
+                initialisePixelStore();
+                setGraphicsFlag(1);
+            }
+            
+            // Assume this is debug information.
+            return 3;
+        }
+        else
+        {
+            // This is the end...
+            // There are only so many possibilities that can be displayed in "the end":
+            n = (len > 255) ? 255 : len;
+            switch (line[0])
+            {
+                case 'E':
+                    // Execution time
+                    memcpy(&Parser->executionMessage[0], &line[0], n);
+                    break;
+                case 'C':
+                    // Computing time
+                    memcpy(&Parser->computingMessage[0], &line[0], n);
+                    break;
+                case 'S':
+                    // Standby ticks
+                    memcpy(&Parser->standbyTkMessage[0], &line[0], n);
+                    break;
+                case 'A':
+                    // Average Search Length
+                    memcpy(&Parser->avgSearchMessage[0], &line[0], n);
+                    break;
+                default:
+                    Warning("Warning: Unrecognised line in DAMSON end summary.\n");
+            }
+            return 2;
+        }
+    }
+    else
+    {
+        // There's nothing on this line. Move on.
+        return 1;
+    }
+}
+
+// Passes a line to either the header check or the parser. Returns 0 if processing should stop.
+int ProcessLine(char *line, int lineNo)
+{
+    int dcheck;
+    
+    // Keyframes are taken between lines, so a replay can read on from the line that follows
+    if (ReplayEnabled && ReplayDraws >= NextKeyframe)
+        AddKeyframe(ReplayDraws, lineNo, ReplayLastLine, Parser->currentOffset, &Parser->pixelStore);
+    Parser->currentLine = lineNo;
+    // Draws from merged files are keyed by the file, then by their line in it
+    if (Merging)
+        StampKey = Parser->stampBase | (uint64_t) lineNo;
+    if (lineNo <= 3 && !NoHeader)
+    {
+        dcheck = DAMSONHeaderCheck(line, lineNo - 1);
+        if (dcheck < 1)
+        {
+            Error("Error processing header on line %i.\n\n", lineNo);
+            setGraphicsFlag(-1);
+            return 0;
+        }
+    }
+    else
+    {
+        dcheck = ParseLine(line, lineNo);
+        if (dcheck < 1)
+        {
+            Error("Error processing script on line %i.\n\n", lineNo);
+            setGraphicsFlag(-1);
+            return 0;
+        }
+        if (TimelapseDir != NULL)
+            TimelapseTick(line, dcheck);
+        
+        // Classify the line for the parser counters
+        if (dcheck == 100)
+            CountStat(draws, 1);
+        else if (dcheck == 3)
+        {
+            if (!strncmp(line, "Timeout", 7))
+                CountStat(timeouts, 1);
+            else
+                CountStat(debug, 1);
+        }
+        else if (dcheck >= 4 && dcheck <= 10)
+            CountStat(warnings[dcheck], 1);
+    }
+    
+    // Only the main parser answers the visualiser. When comparing runs, it shows the first. A
+    // producer answers while the shared scene is lent to it.
+    if (Parser != &MainParser && !Parser->shared)
+        return 1;
+    if (__atomic_load_n(&SnapshotRequested, __ATOMIC_RELAXED))
+        ServiceSnapshotRequest();
+    if (__atomic_load_n(&InfoRequested, __ATOMIC_RELAXED) && __atomic_exchange_n(&InfoRequested, 0, __ATOMIC_ACQ_REL))
+        PublishInfoText();
+    return 1;
+}
+
+// Copies the line starting at the given offset of a mapped file into a null terminated buffer.
+// Returns the offset of the following line.
+size_t CopyMappedLine(char *map, size_t pos, size_t end, char **buffer, size_t *bufferSize)
+{
+    char *eol = memchr(&map[pos], '\n', end - pos);
+    size_t next = (eol == NULL) ? end : (size_t) (eol - map) + 1;
+    
+    if (next - pos + 1 > *bufferSize)
+    {
+        *bufferSize = (next - pos + 1) * 2;
+        *buffer = realloc(*buffer, *bufferSize);
+    }
+    memcpy(*buffer, &map[pos], next - pos);
+    (*buffer)[next - pos] = '\0';
+    
+    return next;
+}
+
+// Parses the lines of a mapped file in order. Lines are added to the parser counters unless
+// count is 0. Returns 0 if processing should stop.
+int ParseMappedLines(char *map, size_t pos, size_t end, int *lineNo, char **buffer, size_t *bufferSize, int count)
+{
+    size_t next;
+    
+    for (; pos < end; pos = next)
+    {
+        next = CopyMappedLine(map, pos, end, buffer, bufferSize);
+        if (count)
+        {
+            CountStat(lines, 1);
+            CountStat(bytes, next - pos);
+        }
+        if (!ProcessLine(*buffer, *lineNo))
+            return 0;
+        (*lineNo)++;
+    }
+    return 1;
+}
+
+// Makes a note of a line that must be parsed in order by ProcessFileParallel
+void DeferLine(ParseChunk *chunk, size_t offset, int instruction, ParserStats *pending)
+{
+    if (chunk->deferredCount == chunk->deferredSize)
+    {
+        chunk->deferredSize = (chunk->deferredSize == 0) ? 64 : chunk->deferredSize * 2;
+        chunk->deferred = realloc(chunk->deferred, sizeof(DeferredLine) * chunk->deferredSize);
+    }
+    chunk->deferred[chunk->deferredCount].offset = offset;
+    chunk->deferred[chunk->deferredCount].lineNo = chunk->lines;
+    chunk->deferred[chunk->deferredCount].instruction = instruction;
+    // If this line stops the parser, whatever the worker counted after it is taken off again
+    chunk->deferred[chunk->deferredCount].counts = chunk->counts;
+    addStats(&chunk->deferred[chunk->deferredCount].counts, pending, 1);
+    chunk->deferredCount++;
+}
+
+// Parses a chunk of a mapped file without touching any shared parser state. Draws are
+// applied through the stamp store; anything that prints, changes state or may stop the
+// parser is deferred. In silent mode, deferred lines are dropped and any draws they
+// contain are applied (used to rebuild the scene up to a given offset).
+void ParseChunkLines(ParseChunk *chunk, char *map, size_t limit, int silent, int queue)
+{
+    LineScan scan;
+    BulkDraw bulk;
+    ParserStats pending;
+    char *buffer = NULL;
+    size_t bufferSize = 0, pos = chunk->start, next, end = (chunk->end < limit) ? chunk->end : limit;
+    int len, localEnd = 0, x, y, w, h;
+    float RVal, GVal, BVal;
+    unsigned int colour;
+    
+    chunk->lines = chunk->draws = chunk->deferredCount = 0;
+    chunk->lastDraw = chunk->lastInstruction = 0;
+    chunk->sceneChange = 0;
+    memset(&chunk->counts, 0, sizeof(ParserStats));
+    memset(&pending, 0, sizeof(ParserStats));
+    
+    for (; pos < end; pos = next)
+    {
+        next = CopyMappedLine(map, pos, end, &buffer, &bufferSize);
+        chunk->lines++;
+        
+        // Deferred lines are classified when they're parsed in order
+        if (!silent)
+        {
+            pending.lines++;
+            pending.bytes += next - pos;
+            if (pending.lines == STATS_FLUSH_LINES)
+                flushChunkStats(chunk, &pending);
+        }
+        
+        ScanLine(buffer, &scan);
+        len = scan.length;
+        
+        // Empty lines, timeouts and short lines have no effect
+        if (len == 0)
+            continue;
+        if (localEnd || (scan.handlers & (1 << RULE_NOFILE)))
+        {
+            // Everything after the workspace line belongs to the end summary
+            if (!silent)
+                DeferLine(chunk, pos, 0, &pending);
+            continue;
+        }
+        if (scan.handlers & (1 << RULE_IGNORE))
+        {
+            if (!strncmp(buffer, "Timeout", 7))
+                pending.timeouts++;
+            else
+                pending.debug++;
+            continue;
+        }
+        if (scan.handlers & (1 << RULE_SUMMARY))
+        {
+            if (!silent)
+                DeferLine(chunk, pos, 0, &pending);
+            localEnd = 1;
+            continue;
+        }
+        if (len < 6)
+        {
+            pending.debug++;
+            continue;
+        }
+        
+        // This line would be stored as the last instruction
+        chunk->lastInstruction = pos + 1;
+        
+        if (scan.handlers & (1 << RULE_DRAW))
+        {
+            // Disfigured or incomplete draw calls
+            if (scan.drawFault || scan.lBrack < 0 || scan.rBrack < 0 || scan.eqsign < 0 || scan.comsign < 0)
+            {
+                if (!silent && (scan.drawFault || scan.eqWarnings))
+                    DeferLine(chunk, pos, 1, &pending);
+                else
+                    pending.warnings[8]++;
+                continue;
+            }
+            if (ReadDrawValues(buffer, &scan, &x, &y, &RVal, &GVal, &BVal) || x > Parser->sceneWidth || x < 0 || y > Parser->sceneHeight || y < 0 || (scan.eqWarnings && !silent))
+            {
+                if (!silent)
+                    DeferLine(chunk, pos, 1, &pending);
+                continue;
+            }
+            
+            colour = packColour(RVal, GVal, BVal);
+            if (wrapPixel(Parser->sceneWidth, Parser->sceneHeight, &x, &y))
+            {
+                stampPixel(x, y, pos + 1, colour);
+                // Keep the visualiser up to date. This is corrected once all chunks are merged.
+                if (DrawQueues != NULL)
+                    postDrawEvent(queue, DRAW_EVENT_PIXEL, x, y, colour, NULL);
+            }
+            chunk->draws++;
+            chunk->lastDraw = pos + 1;
+            pending.draws++;
+            continue;
+        }
+        if (scan.handlers & RULE_BULK)
+        {
+            // Anything that would print is left to be reported in order
+            if (ReadBulkDraw(buffer, &scan, &bulk))
+            {
+                if (!silent)
+                    DeferLine(chunk, pos, 1, &pending);
+                continue;
+            }
+            ApplyBulkDraw(&bulk, pos + 1, queue);
+            chunk->draws++;
+            chunk->lastDraw = pos + 1;
+            pending.draws++;
+            continue;
+        }
+        if (scan.handlers & (1 << RULE_ERROR))
+        {
+            // This will stop the parser
+            if (!silent)
+                DeferLine(chunk, pos, 1, &pending);
+            continue;
+        }
+        if (len > 17 && (scan.handlers & (1 << RULE_SCENE)))
+        {
+            // Scene descriptions are printed and may redefine the scene
+            if (!silent)
+                DeferLine(chunk, pos, 1, &pending);
+            if (scan.lastNonNumeric != 0 && sscanf(&buffer[scan.lastNonNumeric + 1], "%i %i", &w, &h) > 0)
+                chunk->sceneChange = 1;
+            continue;
+        }
+        pending.debug++;
+    }
+    if (!silent)
+        flushChunkStats(chunk, &pending);
+    free(buffer);
+}
+
+// Adds the counts gathered by a worker to the parser counters
+void flushChunkStats(ParseChunk *chunk, ParserStats *pending)
+{
+    uint64_t *counts = (uint64_t *) &Parser->stats, *add = (uint64_t *) pending;
+    size_t i;
+    
+    // Several workers may be adding at once
+    for (i = 0; i < sizeof(ParserStats) / sizeof(uint64_t); i++)
+        if (add[i] != 0)
+            __atomic_fetch_add(&counts[i], add[i], __ATOMIC_RELAXED);
+    addStats(&chunk->counts, pending, 1);
+    memset(pending, 0, sizeof(ParserStats));
+}
+
+// Worker thread for parallel parsing. Chunks are taken in turn until none remain.
+void *ParseChunkThread(void *arg)
+{
+    ParallelJob *job = (ParallelJob *) arg;
+    int idx, queue = __atomic_add_fetch(&job->nextWorker, 1, __ATOMIC_RELAXED);
+    
+    Parser = (ParseContext *) job->context;
+    while ((idx = __atomic_fetch_add(&job->nextChunk, 1, __ATOMIC_RELAXED)) < job->chunkCount)
+        ParseChunkLines(&job->chunks[idx], job->map, job->limit, job->silent, queue);
+    
+    return NULL;
+}
+
+// Parses all chunks using the requested number of threads
+void RunParallelJob(ParallelJob *job, size_t limit, int silent)
+{
+    pthread_t *threads = malloc(sizeof(pthread_t) * ParseThreads);
+    int i;
+    
+    job->limit = limit;
+    job->silent = silent;
+    job->nextChunk = 0;
+    job->nextWorker = 0;
+    
+    // Anything sent to the visualiser so far must be shown before the workers' draws
+    waitForCompositor();
+    
+    for (i = 0; i < ParseThreads; i++)
+        pthread_create(&threads[i], NULL, ParseChunkThread, (void *) job);
+    for (i = 0; i < ParseThreads; i++)
+        pthread_join(threads[i], NULL);
+    
+    free(threads);
+}
+
+// This function processes files by memory mapping them and parsing newline aligned chunks on
+// several threads. The header and everything up to the scene definition are parsed in order.
+// Lines which print or change the parser state are then replayed in order on this thread, so
+// messages, the end summary and the final scene match those of a sequential run. Returns 0 if
+// the file could not be mapped.
+int ProcessFileParallel(char *filename)
+{
+    ParallelJob job;
+    LineScan scan;
+    struct stat st;
+    char *map, *eol, *buffer = NULL;
+    size_t bufferSize = 0, pos = 0, next, size, truncate, tail, lastInstruction = 0;
+    int fd, i, j, lineNo = 1, lineBase, fatal = 0, instruction = 0, counted = 0;
+    long d;
+    ParserStats skipped;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t) st.st_size >= ((uint64_t) 1 << 40))
+    {
+        close(fd);
+        return 0;
+    }
+    size = (size_t) st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    madvise(map, size, MADV_WILLNEED);
+    
+    printf("Parsing \"%s\" on %i threads\n\n", filename, ParseThreads);
+    
+    // Parse the header and the scene definition in order
+    while (pos < size && Parser->pixelStore.tiles == NULL && !Parser->theEnd)
+    {
+        next = CopyMappedLine(map, pos, size, &buffer, &bufferSize);
+        CountStat(lines, 1);
+        CountStat(bytes, next - pos);
+        pos = next;
+        if (!ProcessLine(buffer, lineNo))
+            goto parallel_done;
+        lineNo++;
+    }
+    if (pos >= size || Parser->theEnd)
+        goto parallel_tail;
+    
+    // Split what remains into newline aligned chunks
+    job.map = map;
+    job.context = Parser;
+    job.chunkCount = ParseThreads * 4;
+    job.chunks = calloc(job.chunkCount, sizeof(ParseChunk));
+    for (i = 0; i < job.chunkCount; i++)
+    {
+        job.chunks[i].start = (i == 0) ? pos : job.chunks[i - 1].end;
+        job.chunks[i].end = pos + (size - pos) / job.chunkCount * (i + 1);
+        if (i == job.chunkCount - 1)
+            job.chunks[i].end = size;
+        else if (job.chunks[i].end < job.chunks[i].start)
+            job.chunks[i].end = job.chunks[i].start;
+        else
+        {
+            // Move the end of the chunk to the end of the line
+            eol = memchr(&map[job.chunks[i].end], '\n', size - job.chunks[i].end);
+            job.chunks[i].end = (eol == NULL) ? size : (size_t) (eol - map) + 1;
+        }
+    }
+    
+    StampTiles = calloc((size_t) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY + 1, sizeof(uint64_t *));
+    RunParallelJob(&job, size, 0);
+    
+    for (i = 0; i < job.chunkCount; i++)
+        if (job.chunks[i].sceneChange)
+            break;
+    if (i < job.chunkCount)
+    {
+        // The scene is redefined part way through. The chunks cannot be merged, so start again in order.
+        printf("Scene redefined within file. Parsing sequentially.\n\n");
+        for (i = 0; i < job.chunkCount; i++)
+            addStats(&Parser->stats, &job.chunks[i].counts, -1);
+        clearStamps();
+        free(StampTiles);
+        StampTiles = NULL;
+        ClearTileStore(&Parser->pixelStore);
+        publishPixelStore();
+        tail = pos;
+        goto parallel_cleanup;
+    }
+    
+    // Replay the deferred lines in order. These are stamped with their own offsets.
+    truncate = tail = size;
+    lineBase = lineNo - 1;
+    for (i = 0; i < job.chunkCount && truncate == size; i++)
+    {
+        for (d = 0; d < job.chunks[i].deferredCount; d++)
+        {
+            CopyMappedLine(map, job.chunks[i].deferred[d].offset, size, &buffer, &bufferSize);
+            StampKey = job.chunks[i].deferred[d].offset + 1;
+            lineNo = lineBase + job.chunks[i].deferred[d].lineNo;
+            if (!ProcessLine(buffer, lineNo))
+            {
+                // Nothing after this line should have been drawn
+                fatal = 1;
+                instruction = job.chunks[i].deferred[d].instruction;
+                truncate = job.chunks[i].deferred[d].offset;
+                // The workers read on past this line. Take off everything they counted after it.
+                skipped = job.chunks[i].counts;
+                addStats(&skipped, &job.chunks[i].deferred[d].counts, -1);
+                for (j = i + 1; j < job.chunkCount; j++)
+                    addStats(&skipped, &job.chunks[j].counts, 1);
+                addStats(&Parser->stats, &skipped, -1);
+                break;
+            }
+            if (Parser->theEnd)
+            {
+                // Everything that follows belongs to the end summary and is parsed in order
+                truncate = tail = CopyMappedLine(map, job.chunks[i].deferred[d].offset, size, &buffer, &bufferSize);
+                lineNo++;
+                break;
+            }
+        }
+        lineBase += job.chunks[i].lines;
+    }
+    if (truncate == size)
+        lineNo = lineBase + 1;
+    
+    // If anything beyond the point at which parsing stopped was applied, rebuild the scene up to that point
+    for (i = 0; i < job.chunkCount; i++)
+        if (job.chunks[i].lastDraw > truncate || job.chunks[i].lastInstruction > truncate)
+            break;
+    if (i < job.chunkCount)
+    {
+        clearStamps();
+        RunParallelJob(&job, truncate, 1);
+    }
+    
+    applyStamps();
+    
+    // Restore the last instruction that a sequential run would have seen
+    for (i = 0; i < job.chunkCount; i++)
+        if (job.chunks[i].lastInstruction > lastInstruction)
+            lastInstruction = job.chunks[i].lastInstruction;
+    if (lastInstruction > 0 && !(fatal && instruction))
+    {
+        CopyMappedLine(map, lastInstruction - 1, size, &buffer, &bufferSize);
+        ScanLine(buffer, &scan);
+        StoreLastInstruction(buffer, scan.length);
+    }
+    if (fatal)
+        tail = size;
+    // The end summary has already been counted by the workers
+    counted = 1;
+    
+parallel_cleanup:
+    for (i = 0; i < job.chunkCount; i++)
+        free(job.chunks[i].deferred);
+    free(job.chunks);
+    pos = tail;
+parallel_tail:
+    ParseMappedLines(map, pos, size, &lineNo, &buffer, &bufferSize, !counted);
+parallel_done:
+    // Everything mapped has been read, unless parsing stopped
+    Parser->currentOffset = size;
+    free(buffer);
+    munmap(map, size);
+    return 1;
+}
+
+// Returns the compression format of a file from its first bytes
+int DetectCompression(char *filename)
+{
+    unsigned char magic[6];
+    int fd = open(filename, O_RDONLY);
+    ssize_t n;
+    
+    if (fd < 0)
+        return COMPRESSION_NONE;
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+    
+    if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+        return COMPRESSION_GZIP;
+    if (n >= 6 && !memcmp(magic, "\xFD" "7zXZ\0", 6))
+        return COMPRESSION_XZ;
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+// Writes all of the data to a file descriptor. Returns 0 if the reader has gone away.
+int writeAll(int fd, const unsigned char *data, size_t size)
+{
+    ssize_t n;
+    
+    while (size > 0)
+    {
+        n = write(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+// Inflates a gzip file into the pipe. Concatenated members are read in turn.
+void DecompressGzip(Decompressor *job, unsigned char *in, unsigned char *out)
+{
+    z_stream stream;
+    ssize_t n;
+    int code = Z_OK;
+    
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+        return;
+    
+    while ((n = read(job->in, in, READ_BUFFER_SIZE)) > 0)
+    {
+        stream.next_in = in;
+        stream.avail_in = n;
+        while (stream.avail_in > 0)
+        {
+            stream.next_out = out;
+            stream.avail_out = READ_BUFFER_SIZE;
+            code = inflate(&stream, Z_NO_FLUSH);
+            if (code != Z_OK && code != Z_STREAM_END && code != Z_BUF_ERROR)
+            {
+                Error("Error decompressing \"%s\": %s\n", job->filename, (stream.msg != NULL) ? stream.msg : "corrupt data");
+                inflateEnd(&stream);
+                return;
+            }
+            if (!writeAll(job->out, out, READ_BUFFER_SIZE - stream.avail_out))
+            {
+                inflateEnd(&stream);
+                return;
+            }
+            if (code == Z_STREAM_END)
+                inflateReset(&stream);
+        }
+    }
+    inflateEnd(&stream);
+    
+    if (n < 0 || code != Z_STREAM_END)
+        Error("Error decompressing \"%s\": the file is truncated.\n", job->filename);
+}
+
+// Decodes an xz file into the pipe
+void DecompressXz(Decompressor *job, unsigned char *in, unsigned char *out)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret code = LZMA_OK;
+    ssize_t n;
+    
+    if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        return;
+    
+    while (code == LZMA_OK)
+    {
+        if (stream.avail_in == 0 && action == LZMA_RUN)
+        {
+            n = read(job->in, in, READ_BUFFER_SIZE);
+            if (n < 0)
+                break;
+            if (n == 0)
+                action = LZMA_FINISH;
+            stream.next_in = in;
+            stream.avail_in = n;
+        }
+        stream.next_out = out;
+        stream.avail_out = READ_BUFFER_SIZE;
+        code = lzma_code(&stream, action);
+        if (!writeAll(job->out, out, READ_BUFFER_SIZE - stream.avail_out))
+        {
+            lzma_end(&stream);
+            return;
+        }
+    }
+    lzma_end(&stream);
+    
+    if (code != LZMA_STREAM_END)
+        Error("Error decompressing \"%s\": %s\n", job->filename, (code == LZMA_BUF_ERROR || code == LZMA_OK) ? "the file is truncated." : "corrupt data.");
+}
+
+// Reads a compressed file and writes its contents to the pipe, so reading the disk and
+// decompressing overlap with parsing. The pipe limits how far ahead this runs.
+void *DecompressThreadFunc(void *arg)
+{
+    Decompressor *job = (Decompressor *) arg;
+    unsigned char *in = malloc(READ_BUFFER_SIZE), *out = malloc(READ_BUFFER_SIZE);
+    sigset_t mask;
+    
+    // If the parser stops early, writes fail rather than raising SIGPIPE
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+    if (job->format == COMPRESSION_GZIP)
+        DecompressGzip(job, in, out);
+    else
+        DecompressXz(job, in, out);
+    
+    // The parser sees the end of the input once the pipe is closed
+    close(job->out);
+    free(in);
+    free(out);
+    
+    return NULL;
+}
+
+// Parses a compressed file as it is decompressed. gzip and xz are decompressed on a thread of
+// our own; zstd is handed to the zstd command.
+void ProcessCompressedFile(char *filename, int format)
+{
+    static const char *names[4] = {"", "gzip", "xz", "zstd"};
+    Decompressor job;
+    pthread_t thread;
+    posix_spawn_file_actions_t actions;
+    char *args[] = {"zstd", "-dcq", "--", filename, NULL};
+    pid_t pid;
+    int fds[2], code, status;
+    
+    printf("Decompressing %s input as it is parsed\n\n", names[format]);
+    if (ParseThreads > 1 && !Merging)
+        printf("Compressed input is parsed on a single thread.\n\n");
+    if (pipe(fds) < 0)
+    {
+        Error("Unable to create a pipe for decompression: %s\n", strerror(errno));
+        return;
+    }
+    
+    if (format == COMPRESSION_ZSTD)
+    {
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+        posix_spawn_file_actions_addclose(&actions, fds[1]);
+        code = posix_spawnp(&pid, "zstd", &actions, NULL, args, NULL);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (code != 0)
+        {
+            Error("Unable to run zstd to decompress \"%s\": %s\n", filename, strerror(code));
+            close(fds[0]);
+            return;
+        }
+        
+        ProcessPipe(fds[0]);
+        close(fds[0]);
+        
+        // zstd is stopped by SIGPIPE if the parser stopped early
+        waitpid(pid, &status, 0);
+        if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE))
+            Error("zstd was unable to decompress \"%s\".\n", filename);
+        return;
+    }
+    
+    job.filename = filename;
+    job.format = format;
+    job.out = fds[1];
+    job.in = open(filename, O_RDONLY);
+    if (job.in < 0)
+    {
+        Error("\nError opening file. Ensure filename and path is valid.\n");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    posix_fadvise(job.in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_create(&thread, NULL, DecompressThreadFunc, (void *) &job);
+    
+    ProcessPipe(fds[0]);
+    
+    // Closing the pipe lets the thread finish if parsing stopped early
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    close(job.in);
+}
+
+// This function processes files. Compressed files are decompressed as they're parsed.
+void ProcessFile(char *filename)
+{
+    FILE *fp;
+    int lineNo = 1, format, cached = CACHE_MISSING, stopped = 0;
+    char *line = NULL;
+    uint64_t resume = 0;
+    size_t len;
+    ssize_t lsize;
+    
+    format = DetectCompression(filename);
+    if (format != COMPRESSION_NONE)
+    {
+        if (FollowInput)
+            printf("Compressed logs can't be followed. \"%s\" is read to its end.\n\n", filename);
+        ProcessCompressedFile(filename, format);
+        return;
+    }
+    
+    if (FollowInput)
+    {
+        FollowFile(filename);
+        return;
+    }
+    
+    // A cached parse is restored. An unchanged log needs nothing more, and one that has grown is
+    // parsed on from the end of the cache.
+    if (CacheEnabled && (cached = LoadParseCache(filename, &resume, &lineNo)) == CACHE_CURRENT)
+        return;
+    
+    // Use several threads if requested. Time-lapse frames need the lines in order.
+    if (cached == CACHE_MISSING && ParseThreads > 1 && TimelapseDir == NULL && !Merging && ProcessFileParallel(filename))
+    {
+        if (CacheEnabled)
+            SaveParseCache(filename, Parser->graphicsFlag == -1);
+        return;
+    }
+    
+    fp = fopen(filename, "r");
+    
+    // Ensure file exists and can be read:
+    if (fp == NULL)
+    {
+        Error("\nError opening file. Ensure filename and path is valid.\n");
+        return;
+    }
+    if (resume > 0)
+        fseeko(fp, resume, SEEK_SET);
+    
+    while((lsize = getline(&line, &len, fp)) != -1)
+    {
+        CountStat(lines, 1);
+        CountStat(bytes, lsize);
+        if (!ProcessLine(line, lineNo))
+        {
+            stopped = 1;
+            break;
+        }
+        lineNo++;
+        Parser->currentOffset += lsize;
+    }
+    // Once we're done, we should free up the memory that was used by the line variable
+    free(line);
+    fclose(fp);
+    
+    if (CacheEnabled)
+        SaveParseCache(filename, stopped);
+}
+
+void *ProcessFileThread(void *arg)
+{
+    char *filename = (char *) arg;
+    
+    ProcessFile(filename);
+    
+    printf("File read complete.\n\n");
+    FinishTimelapse();
+    FinishParsing();
+    
+    return NULL;
+}
+
+// Stops following a log at the next check. The next interrupt ends the parser as usual.
+void StopFollowing(int signum)
+{
+    FollowStopped = 1;
+}
+
+// Watches a followed log and the directory holding it, so appends, truncation and a new file
+// taking its name all wake the parser. Returns the watch on the log.
+int WatchFollowedLog(int notify, char *filename, int previous)
+{
+    char *dir, *slash;
+    
+    if (previous >= 0)
+        inotify_rm_watch(notify, previous);
+    if (previous < 0)
+    {
+        dir = strdup(filename);
+        slash = strrchr(dir, '/');
+        if (slash == NULL)
+            strcpy(dir, ".");
+        else
+            slash[(slash == dir) ? 1 : 0] = '\0';
+        inotify_add_watch(notify, dir, IN_CREATE | IN_MOVED_TO);
+        free(dir);
+    }
+    
+    return inotify_add_watch(notify, filename, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// Starts a followed log again from its first line, once it has been truncated or replaced. The
+// scene is kept until the new log describes its own.
+void RestartFollowedLog(void)
+{
+    free(Parser->headerLine1);
+    free(Parser->headerLine2);
+    free(Parser->headerLine3);
+    Parser->headerLine1 = Parser->headerLine2 = Parser->headerLine3 = NULL;
+    Parser->theEnd = 0;
+    Parser->currentOffset = 0;
+    Parser->workspaceMessage[0] = Parser->executionMessage[0] = Parser->computingMessage[0] = '\0';
+    Parser->standbyTkMessage[0] = Parser->avgSearchMessage[0] = '\0';
+    // Keyframes point into the old log
+    if (ReplayEnabled)
+        RestartReplay(1, 0);
+}
+
+// Parses a log as it's written. Only appended data is read, and between appends the parser
+// sleeps until inotify reports a change. A log that shrinks has been truncated, and one whose
+// name now belongs to another file has been rotated; either is parsed again from the start.
+// Without a window, following ends once the end summary has been idle for FOLLOW_END_IDLE_MS.
+void FollowFile(char *filename)
+{
+    LineReader reader;
+    struct stat opened, named;
+    struct pollfd wake;
+    struct sigaction action;
+    char events[4096], *line;
+    int fd, notify, watch, lineNo = 0, idle = 0, parsed = 0, replaced;
+    size_t len;
+    
+    fd = open(filename, O_RDONLY);
+    notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || notify < 0)
+    {
+        Error("\nError opening file. Ensure filename and path is valid.\n");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    watch = WatchFollowedLog(notify, filename, -1);
+    wake.fd = notify;
+    wake.events = POLLIN;
+    
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopFollowing;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, NULL);
+    printf("Following \"%s\" as it is written. Press Ctrl-C to stop.\n\n", filename);
+    
+    InitLineReader(&reader, fd);
+    reader.follow = 1;
+    while (!FollowStopped)
+    {
+        while ((line = ReadLine(&reader, &len)) != NULL)
+        {
+            lineNo++;
+            CountStat(lines, 1);
+            CountStat(bytes, len + !reader.eof);
+            __atomic_store_n(&InputBuffered, reader.end - reader.start, __ATOMIC_RELAXED);
+            if (!ProcessLine(line, lineNo))
+                goto follow_done;
+            Parser->currentOffset += len + 1;
+            parsed = 1;
+        }
+        
+        // Everything written so far has been parsed. Show it while waiting for more.
+        if (parsed)
+        {
+            PublishInfoText();
+            parsed = 0;
+        }
+        ServiceSnapshotRequest();
+        
+        fstat(fd, &opened);
+        replaced = (stat(filename, &named) == 0 && (named.st_ino != opened.st_ino || named.st_dev != opened.st_dev));
+        if (opened.st_size < lseek(fd, 0, SEEK_CUR) || replaced)
+        {
+            if (replaced && reader.follow)
+            {
+                // Read the rest of the old file first. It may end part way through a line.
+                reader.follow = 0;
+                continue;
+            }
+            if (replaced)
+            {
+                close(fd);
+                fd = open(filename, O_RDONLY);
+                if (fd < 0)
                 {
-                    Error("Pixel draw y coordinate is outside scenery dimensions on line %i\n", lineNo);
-                    
-                    return 10;
+                    Error("\nUnable to open the file replacing \"%s\".\n", filename);
+                    break;
                 }
-                
-                setPixel(x, y, RVal, GVal, BVal);
-                return 100;
+                watch = WatchFollowedLog(notify, filename, watch);
+                printf("\"%s\" was replaced. Parsing the new file from the start.\n\n", filename);
+            }
+            else
+            {
+                lseek(fd, 0, SEEK_SET);
+                printf("\"%s\" was truncated. Parsing it again from the start.\n\n", filename);
+            }
+            FreeLineReader(&reader);
+            InitLineReader(&reader, fd);
+            reader.follow = 1;
+            RestartFollowedLog();
+            lineNo = 0;
+            continue;
+        }
+        
+        if (Headless && Parser->theEnd && idle >= FOLLOW_END_IDLE_MS)
+            break;
+        
+        // Sleep until the log or its directory changes. The timeout keeps snapshots serviced.
+        if (poll(&wake, 1, FOLLOW_POLL_MS) > 0)
+        {
+            while (read(notify, events, sizeof(events)) > 0);
+            idle = 0;
+        }
+        else
+            idle += FOLLOW_POLL_MS;
+    }
+    if (FollowStopped)
+        printf("Stopped following \"%s\".\n\n", filename);
+    
+follow_done:
+    FreeLineReader(&reader);
+    __atomic_store_n(&InputBuffered, 0, __ATOMIC_RELAXED);
+    close(fd);
+    close(notify);
+}
+
+// Prepares a reader for the given file descriptor
+void InitLineReader(LineReader *reader, int fd)
+{
+    reader->fd = fd;
+    reader->size = READ_BUFFER_SIZE;
+    // One extra byte is kept so the final line can always be terminated
+    reader->buffer = malloc(reader->size + 1);
+    reader->start = reader->end = reader->scanned = 0;
+    reader->eof = reader->nonblocking = reader->follow = 0;
+}
+
+// Releases the memory held by a reader
+void FreeLineReader(LineReader *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// Returns the next line from the reader, or NULL once the input has ended. The line is
+// null terminated in place and remains valid until the next call. Lines end with a new
+// line or a null character. Data is read in large blocks; when the buffer fills, the
+// partial line at its end is moved back to the start, and the buffer grows only if a
+// single line is larger than the buffer itself. A nonblocking reader also returns NULL
+// when no more data is ready, without the input having ended, as does a following reader
+// at the current end of its file.
+char *ReadLine(LineReader *reader, size_t *len)
+{
+    char *nl, *nul, *line;
+    ssize_t n;
+    
+    while (1)
+    {
+        // Look for the end of the line in the data that hasn't yet been checked
+        if (reader->scanned < reader->end)
+        {
+            nl = memchr(&reader->buffer[reader->scanned], '\n', reader->end - reader->scanned);
+            nul = memchr(&reader->buffer[reader->scanned], '\0', ((nl == NULL) ? &reader->buffer[reader->end] : nl) - &reader->buffer[reader->scanned]);
+            if (nul != NULL)
+                nl = nul;
+            if (nl != NULL)
+            {
+                line = &reader->buffer[reader->start];
+                *nl = '\0';
+                *len = nl - line;
+                reader->start = reader->scanned = nl - reader->buffer + 1;
+                return line;
+            }
+            reader->scanned = reader->end;
+        }
+        
+        if (reader->eof)
+        {
+            // Hand out whatever remains as the final line
+            if (reader->start == reader->end)
+                return NULL;
+            line = &reader->buffer[reader->start];
+            reader->buffer[reader->end] = '\0';
+            *len = reader->end - reader->start;
+            reader->start = reader->scanned = reader->end;
+            return line;
+        }
+        
+        if (reader->end == reader->size)
+        {
+            if (reader->start > 0)
+            {
+                // Move the partial line to the start of the buffer
+                memmove(reader->buffer, &reader->buffer[reader->start], reader->end - reader->start);
+                reader->end -= reader->start;
+                reader->scanned -= reader->start;
+                reader->start = 0;
+            }
+            else
+            {
+                // This line is larger than the buffer
+                reader->size *= 2;
+                reader->buffer = realloc(reader->buffer, reader->size + 1);
+            }
+        }
+        
+        // Wait for more data. Reads may return less than requested.
+        n = read(reader->fd, &reader->buffer[reader->end], reader->size - reader->end);
+        if (n > 0)
+            reader->end += n;
+        else if (n == 0 && reader->follow)
+            return NULL;
+        else if (n == 0)
+            reader->eof = 1;
+        else if (errno == EAGAIN && reader->nonblocking)
+            return NULL;
+        else if (errno != EINTR && errno != EAGAIN)
+        {
+            Error("Error reading input: %s\n", strerror(errno));
+            reader->eof = 1;
+        }
+    }
+}
+
+// This function processes piped input.
+void ProcessPipe(int fd)
+{
+    LineReader reader;
+    int lineNo = 0;
+    char *line;
+    size_t len;
+    
+    InitLineReader(&reader, fd);
+    
+    while ((line = ReadLine(&reader, &len)) != NULL)
+    {
+        lineNo++;
+        CountStat(lines, 1);
+        // Only the final line can be without its new line character
+        CountStat(bytes, len + !reader.eof);
+        __atomic_store_n(&InputBuffered, reader.end - reader.start, __ATOMIC_RELAXED);
+        if (!ProcessLine(line, lineNo))
+            break;
+        Parser->currentOffset += len + 1;
+    }
+    
+    FreeLineReader(&reader);
+    __atomic_store_n(&InputBuffered, 0, __ATOMIC_RELAXED);
+}
+
+void *ProcessPipeThread(void *arg)
+{
+    ProcessPipe(STDIN_FILENO);
+    printf("Pipe read complete.\n");
+    FinishTimelapse();
+    FinishParsing();
+    
+    return NULL;
+}
+
+// Removes the listening socket from the file system when the parser exits
+void StopListening(void)
+{
+    if (ListenFd >= 0)
+    {
+        close(ListenFd);
+        unlink(ListenPath);
+        ListenFd = -1;
+    }
+}
+
+// Creates the listening socket and opens the FIFOs for their first writers. Returns 0 if
+// any of them can't be set up.
+int StartListening(void)
+{
+    struct sockaddr_un address;
+    struct epoll_event event;
+    int i;
+    
+    EpollFd = epoll_create1(0);
+    ListenWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (EpollFd < 0 || ListenWakeFd < 0)
+    {
+        Error("Unable to wait for producers: %s\n\n", strerror(errno));
+        return 0;
+    }
+    
+    // The listener sleeps until there's something to read, so requests from the visualiser
+    // wake it through an eventfd
+    event.events = EPOLLIN;
+    event.data.ptr = &ListenWakeFd;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, ListenWakeFd, &event);
+    
+    if (ListenPath != NULL)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(ListenPath) >= sizeof(address.sun_path))
+        {
+            Error("The socket path \"%s\" is too long.\n\n", ListenPath);
+            return 0;
+        }
+        strcpy(address.sun_path, ListenPath);
+        
+        // A socket left behind by an earlier run is replaced
+        unlink(ListenPath);
+        ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (ListenFd < 0 || bind(ListenFd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(ListenFd, MAX_PRODUCERS) < 0)
+        {
+            Error("Unable to listen on \"%s\": %s\n\n", ListenPath, strerror(errno));
+            return 0;
+        }
+        atexit(StopListening);
+        
+        // The listening socket is the only event without a producer
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(EpollFd, EPOLL_CTL_ADD, ListenFd, &event);
+        printf("Listening for producers on \"%s\"\n\n", ListenPath);
+    }
+    
+    for (i = 0; i < FifoCount; i++)
+    {
+        if (mkfifo(FifoPaths[i], 0644) < 0 && errno != EEXIST)
+        {
+            Error("Unable to create FIFO \"%s\": %s\n\n", FifoPaths[i], strerror(errno));
+            return 0;
+        }
+        if (!OpenFifo(i))
+            return 0;
+        printf("Reading producers from FIFO \"%s\"\n\n", FifoPaths[i]);
+    }
+    
+    return 1;
+}
+
+// Opens a FIFO for its next writer. Writers holding it open together would share one reader, so
+// a FIFO carries one producer at a time; concurrent producers connect with -listen instead.
+// Returns 0 on failure.
+int OpenFifo(int index)
+{
+    char name[64];
+    int fd;
+    
+    fd = open(FifoPaths[index], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        Error("Unable to open FIFO \"%s\": %s\n\n", FifoPaths[index], strerror(errno));
+        return 0;
+    }
+    snprintf(name, sizeof(name), "%.40s #%i", FifoPaths[index], ++ProducerSequence);
+    
+    return AddProducer(fd, index, name) != NULL;
+}
+
+// Starts parsing a new producer. It draws into the scene shared by all producers, so only its
+// own header, line numbers, counters and end summary are kept in its context. Returns NULL if
+// there are too many producers.
+Producer *AddProducer(int fd, int fifo, char *name)
+{
+    struct epoll_event event;
+    Producer *producer;
+    
+    if (ProducerCount == MAX_PRODUCERS)
+    {
+        Error("Too many producers. \"%s\" was refused.\n", name);
+        close(fd);
+        return NULL;
+    }
+    
+    producer = calloc(1, sizeof(Producer));
+    InitParseContext(&producer->context, 0);
+    producer->context.graphicsFlag = 0;
+    producer->context.shared = 1;
+    producer->context.filename = producer->name;
+    snprintf(producer->name, sizeof(producer->name), "%s", name);
+    producer->fifo = fifo;
+    InitLineReader(&producer->reader, fd);
+    producer->reader.nonblocking = 1;
+    
+    event.events = EPOLLIN;
+    event.data.ptr = producer;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &event);
+    
+    pthread_mutex_lock(&ProducerLock);
+    Producers[ProducerCount++] = producer;
+    pthread_mutex_unlock(&ProducerLock);
+    
+    return producer;
+}
+
+// Accepts every producer waiting to connect to the socket
+void AcceptProducers(void)
+{
+    char name[64];
+    int fd;
+    
+    while ((fd = accept(ListenFd, NULL, NULL)) >= 0)
+    {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        snprintf(name, sizeof(name), "connection #%i", ++ProducerSequence);
+        if (AddProducer(fd, -1, name) != NULL)
+        {
+            printf("Producer \"%s\" connected\n\n", name);
+            ProducersSeen++;
+        }
+    }
+}
+
+// Stops parsing a producer once its input has ended or it has failed. Its counters join the
+// main parser's, and a producer that sent anything leaves its header and end summary there
+// to be shown and saved. A FIFO is then opened again for its next writer.
+void RemoveProducer(Producer *producer)
+{
+    ParseContext *context = &producer->context;
+    int i, fifo = producer->fifo;
+    
+    pthread_mutex_lock(&ProducerLock);
+    for (i = 0; Producers[i] != producer; i++);
+    Producers[i] = Producers[--ProducerCount];
+    addStats(&MainParser.stats, &context->stats, 1);
+    pthread_mutex_unlock(&ProducerLock);
+    
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, producer->reader.fd, NULL);
+    close(producer->reader.fd);
+    FreeLineReader(&producer->reader);
+    
+    if (producer->lineNo > 0 || fifo < 0)
+    {
+        printf("Producer \"%s\" finished after %i lines\n\n", producer->name, producer->lineNo);
+        adoptContextSummary(&MainParser, context);
+    }
+    free(context->headerLine1);
+    free(context->headerLine2);
+    free(context->headerLine3);
+    free(producer);
+    
+    if (fifo >= 0)
+        OpenFifo(fifo);
+}
+
+// Copies the header, last instruction, last error and end summary of one parser to another
+void adoptContextSummary(ParseContext *to, ParseContext *from)
+{
+    free(to->headerLine1);
+    free(to->headerLine2);
+    free(to->headerLine3);
+    to->headerLine1 = (from->headerLine1 != NULL) ? strdup(from->headerLine1) : NULL;
+    to->headerLine2 = (from->headerLine2 != NULL) ? strdup(from->headerLine2) : NULL;
+    to->headerLine3 = (from->headerLine3 != NULL) ? strdup(from->headerLine3) : NULL;
+    to->theEnd = from->theEnd;
+    to->errorRot = from->errorRot;
+    memcpy(to->lastInstruction, from->lastInstruction, 256);
+    memcpy(to->errorLine1, from->errorLine1, 256);
+    memcpy(to->errorLine2, from->errorLine2, 256);
+    memcpy(to->workspaceMessage, from->workspaceMessage, 256);
+    memcpy(to->executionMessage, from->executionMessage, 256);
+    memcpy(to->computingMessage, from->computingMessage, 256);
+    memcpy(to->standbyTkMessage, from->standbyTkMessage, 256);
+    memcpy(to->avgSearchMessage, from->avgSearchMessage, 256);
+}
+
+// Parses the lines a producer has sent, up to PRODUCER_BATCH of them so others aren't kept
+// waiting. The shared scene is lent to the producer's context while they're parsed. Returns 0
+// once the producer's input has ended or a line has stopped it.
+int ReadProducer(Producer *producer)
+{
+    char *line = NULL;
+    size_t len;
+    int lines, status = 1;
+    
+    producer->context.pixelStore = MainParser.pixelStore;
+    producer->context.sceneWidth = MainParser.sceneWidth;
+    producer->context.sceneHeight = MainParser.sceneHeight;
+    Parser = &producer->context;
+    
+    for (lines = 0; lines < PRODUCER_BATCH; lines++)
+    {
+        if ((line = ReadLine(&producer->reader, &len)) == NULL)
+            break;
+        if (producer->lineNo++ == 0 && producer->fifo >= 0)
+        {
+            printf("Producer \"%s\" connected\n\n", producer->name);
+            ProducersSeen++;
+        }
+        CountStat(lines, 1);
+        // Only the final line can be without its new line character
+        CountStat(bytes, len + !producer->reader.eof);
+        if (!ProcessLine(line, producer->lineNo))
+        {
+            status = 0;
+            break;
+        }
+        Parser->currentOffset += len + 1;
+    }
+    producer->ready = (lines == PRODUCER_BATCH);
+    __atomic_store_n(&producer->buffered, producer->reader.end - producer->reader.start, __ATOMIC_RELAXED);
+    if (line == NULL && producer->reader.eof)
+        status = 0;
+    
+    // Take the scene back. Whichever producer described it first starts the visualiser.
+    MainParser.pixelStore = producer->context.pixelStore;
+    MainParser.sceneWidth = producer->context.sceneWidth;
+    MainParser.sceneHeight = producer->context.sceneHeight;
+    memset(&producer->context.pixelStore, 0, sizeof(TileStore));
+    Parser = &MainParser;
+    if (producer->context.graphicsFlag == 1 && MainParser.graphicsFlag != 1)
+        setGraphicsFlag(1);
+    
+    return status;
+}
+
+// Returns the number of bytes a producer has sent that haven't yet been parsed
+unsigned long producerBacklog(Producer *producer)
+{
+    int queued = 0;
+    
+    if (ioctl(producer->reader.fd, FIONREAD, &queued) < 0)
+        queued = 0;
+    return __atomic_load_n(&producer->buffered, __ATOMIC_RELAXED) + queued;
+}
+
+// Reads every producer on one thread. Without a window, this ends once each producer that
+// has connected has finished.
+void *ListenThread(void *arg)
+{
+    struct epoll_event events[64];
+    Producer *producer;
+    uint64_t wakes;
+    int count, i, waiting, active;
+    
+    while (1)
+    {
+        // Producers stopped part way through their input carry on without waiting
+        for (i = 0, waiting = 0, active = 0; i < ProducerCount; i++)
+        {
+            waiting |= Producers[i]->ready;
+            active += (Producers[i]->lineNo > 0 || Producers[i]->fifo < 0);
+        }
+        if (Headless && ProducersSeen > 0 && active == 0)
+            break;
+        
+        count = epoll_wait(EpollFd, events, 64, waiting ? 0 : -1);
+        for (i = 0; i < count; i++)
+        {
+            producer = (Producer *) events[i].data.ptr;
+            if (producer == (Producer *) &ListenWakeFd)
+            {
+                if (read(ListenWakeFd, &wakes, sizeof(wakes)) < 0)
+                    wakes = 0;
+            }
+            else if (producer == NULL)
+                AcceptProducers();
+            else if (!ReadProducer(producer))
+                RemoveProducer(producer);
+        }
+        for (i = ProducerCount - 1; i >= 0; i--)
+            if (Producers[i]->ready && !ReadProducer(Producers[i]))
+                RemoveProducer(Producers[i]);
+        
+        // Snapshots are taken between lines. With nothing left to read, they're taken here.
+        if (!waiting)
+            ServiceSnapshotRequest();
+    }
+    
+    printf("All producers have finished.\n\n");
+    FinishTimelapse();
+    FinishParsing();
+    
+    return NULL;
+}
+
+// Wakes the listener so it can take a snapshot while its producers are idle
+void wakeListener(void)
+{
+    uint64_t one = 1;
+    ssize_t written = 0;
+    
+    // The counter only fails to take more once the listener is already due to wake
+    if (ListenWakeFd >= 0)
+        written = write(ListenWakeFd, &one, sizeof(one));
+    (void) written;
+}
+
+// Adds the files matching a pattern to the inputs, in order. Returns 0 if nothing matched.
+int AddInputFiles(char *pattern)
+{
+    glob_t matches;
+    size_t i;
+    
+    // Names without wildcards are taken as they are, even if the file doesn't exist yet
+    if (strpbrk(pattern, "*?[") == NULL || glob(pattern, 0, NULL, &matches) != 0)
+    {
+        if (strpbrk(pattern, "*?[") != NULL)
+        {
+            Error("No files match \"%s\".\n", pattern);
+            return 0;
+        }
+        if (InputFileCount == MAX_INPUT_FILES)
+        {
+            Error("No more than %i files can be merged. \"%s\" is ignored.\n", MAX_INPUT_FILES, pattern);
+            return 0;
+        }
+        InputFiles[InputFileCount++] = pattern;
+        return 1;
+    }
+    
+    for (i = 0; i < matches.gl_pathc; i++)
+    {
+        if (InputFileCount == MAX_INPUT_FILES)
+        {
+            Error("No more than %i files can be merged. The rest of \"%s\" is ignored.\n", MAX_INPUT_FILES, pattern);
+            break;
+        }
+        // The matches are kept for the rest of the run
+        InputFiles[InputFileCount++] = strdup(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    
+    return 1;
+}
+
+// Sets up a parser for each file to be merged. The file's position on the command line forms
+// the top bits of the keys its draws are stamped with, and its line numbers the rest. Even
+// with MAX_INPUT_FILES files, the rest has room for any line number.
+void PrepareMerge(void)
+{
+    int i, bits;
+    
+    for (bits = 0; (1 << bits) < InputFileCount; bits++);
+    MergeLineBits = STAMP_KEY_BITS - bits;
+    MergeContexts = calloc(InputFileCount, sizeof(ParseContext));
+    for (i = 0; i < InputFileCount; i++)
+    {
+        InitParseContext(&MergeContexts[i], 0);
+        MergeContexts[i].graphicsFlag = 0;
+        MergeContexts[i].filename = InputFiles[i];
+        MergeContexts[i].stampBase = (uint64_t) i << MergeLineBits;
+    }
+}
+
+// Gives a merged file the shared scene. The first file to describe a scene creates it, and the
+// others must describe one of the same size. Returns the result for ParseLine.
+int JoinMergedScene(int width, int height, int lineNo)
+{
+    ParseContext *context = Parser;
+    int joined = 1;
+    
+    pthread_mutex_lock(&MergeLock);
+    if (MainParser.pixelStore.tiles == NULL)
+    {
+        // The scene is created for the main parser, on its queue to the visualiser
+        Parser = &MainParser;
+        Parser->sceneWidth = width;
+        Parser->sceneHeight = height;
+        printf("Scene dimensions recognised (%i x %i)\n", width, height);
+        initialisePixelStore();
+        StampTiles = calloc((size_t) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY + 1, sizeof(uint64_t *));
+        setGraphicsFlag(1);
+        // The compositor reads the workers' queues first, so their draws mustn't arrive before
+        // the scene. Every file waits for the lock before it can draw.
+        waitForCompositor();
+        Parser = context;
+    }
+    else if (width == MainParser.sceneWidth && height == MainParser.sceneHeight)
+        printf("Scene dimensions recognised (%i x %i), joining the merged scene\n", width, height);
+    else
+        joined = 0;
+    
+    // The store is only lent for its size. Draws go to the stamp store.
+    if (joined)
+    {
+        context->pixelStore = MainParser.pixelStore;
+        context->sceneWidth = width;
+        context->sceneHeight = height;
+        context->graphicsFlag = 1;
+    }
+    pthread_mutex_unlock(&MergeLock);
+    
+    if (!joined)
+    {
+        Error("Scene dimensions on line %i of \"%s\" differ from the merged scene (%i x %i).\n", lineNo, context->filename,
+            MainParser.sceneWidth, MainParser.sceneHeight);
+        return 0;
+    }
+    return 3;
+}
+
+// Worker thread for merging. Files are taken in turn and each is parsed from start to end.
+void *MergeFilesWorker(void *arg)
+{
+    int queue = (int) (intptr_t) arg, idx;
+    
+    while ((idx = __atomic_fetch_add(&NextMergeFile, 1, __ATOMIC_RELAXED)) < InputFileCount)
+    {
+        Parser = &MergeContexts[idx];
+        Parser->queue = queue;
+        ProcessFile(InputFiles[idx]);
+        printf("File \"%s\" read (%i lines)\n\n", InputFiles[idx], Parser->currentLine);
+    }
+    
+    return NULL;
+}
+
+// Parses every input file on its own thread, up to the thread limit, then makes the final scene
+// from the draws that won each pixel
+void *MergeFilesThread(void *arg)
+{
+    pthread_t *threads = malloc(sizeof(pthread_t) * ParseThreads);
+    int i, failed = 0;
+    
+    printf("Merging %i files on %i threads\n\n", InputFileCount, ParseThreads);
+    for (i = 0; i < ParseThreads; i++)
+        pthread_create(&threads[i], NULL, MergeFilesWorker, (void *) (intptr_t) (i + 1));
+    for (i = 0; i < ParseThreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    
+    if (StampTiles != NULL)
+        applyStamps();
+    for (i = 0; i < InputFileCount; i++)
+    {
+        failed += (MergeContexts[i].graphicsFlag != 1);
+        // The lent store belongs to the main parser
+        memset(&MergeContexts[i].pixelStore, 0, sizeof(TileStore));
+    }
+    if (failed > 0)
+        printf("%i of %i files stopped with an error or described no scene.\n\n", failed, InputFileCount);
+    
+    // The first file's header and summary are shown. Every file's are saved with the summary.
+    adoptContextSummary(&MainParser, &MergeContexts[0]);
+    if (failed > 0 && Headless)
+        MainParser.graphicsFlag = -1;
+    printf("File merge complete.\n\n");
+    FinishParsing();
+    
+    return NULL;
+}
+
+// Opens a binary trace for writing. The header is written once the log has been parsed.
+// Returns 0 if the file could not be created.
+int OpenTraceOutput(char *filename)
+{
+    TraceHeader header;
+    
+    TraceOutput = fopen(filename, "w+b");
+    if (TraceOutput == NULL)
+    {
+        Error("Unable to create trace file \"%s\".\n\n", filename);
+        return 0;
+    }
+    setvbuf(TraceOutput, NULL, _IOFBF, READ_BUFFER_SIZE);
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, TraceOutput);
+    
+    return 1;
+}
+
+// Adds a draw to the trace being written
+void RecordTraceEvent(int x, int y, unsigned int colour)
+{
+    TraceEvent event;
+    
+    event.x = x;
+    event.y = y;
+    event.colour = colour;
+    event.line = Parser->currentLine;
+    fwrite(&event, sizeof(event), 1, TraceOutput);
+    TraceEventCount++;
+}
+
+// Discards the draws recorded so far, as the scene has been redefined
+void RestartTraceEvents(void)
+{
+    fflush(TraceOutput);
+    if (ftruncate(fileno(TraceOutput), sizeof(TraceHeader)) < 0)
+        Error("Unable to discard draws from the trace file.\n");
+    fseeko(TraceOutput, sizeof(TraceHeader), SEEK_SET);
+    TraceEventCount = 0;
+}
+
+// Writes the summary text and header of the trace. Returns the exit status for conversions.
+int FinishTraceOutput(void)
+{
+    TraceHeader header;
+    uint64_t length;
+    int failed;
+    
+    length = writeSummaryText(TraceOutput);
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 8);
+    header.version = TRACE_VERSION;
+    header.width = (Parser->pixelStore.tiles != NULL) ? Parser->sceneWidth : 0;
+    header.height = (Parser->pixelStore.tiles != NULL) ? Parser->sceneHeight : 0;
+    header.status = Parser->graphicsFlag;
+    header.theEnd = Parser->theEnd;
+    header.headerLines = summaryHeaderLines();
+    header.eventCount = TraceEventCount;
+    header.eventOffset = sizeof(TraceHeader);
+    header.textOffset = header.eventOffset + sizeof(TraceEvent) * TraceEventCount;
+    header.textLength = length;
+    fseeko(TraceOutput, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, TraceOutput);
+    failed = ferror(TraceOutput);
+    failed |= fclose(TraceOutput);
+    TraceOutput = NULL;
+    
+    if (failed)
+    {
+        Error("Error writing trace file \"%s\".\n\n", TraceOutputFilename);
+        return 1;
+    }
+    printf("Trace file created (%llu draws).\n\n", (unsigned long long) TraceEventCount);
+    
+    return (Parser->graphicsFlag == 1) ? 0 : 1;
+}
+
+// Writes the text shown in the summary as null terminated strings: the three header lines, the
+// last instruction, the last error (two lines) and the five end messages. Returns its length.
+uint64_t writeSummaryText(FILE *fp)
+{
+    const char *text[12];
+    uint64_t length = 0;
+    int i;
+    
+    text[0] = (Parser->headerLine1 != NULL) ? Parser->headerLine1 : "";
+    text[1] = (Parser->headerLine2 != NULL) ? Parser->headerLine2 : "";
+    text[2] = (Parser->headerLine3 != NULL) ? Parser->headerLine3 : "";
+    text[3] = Parser->lastInstruction;
+    text[4] = Parser->errorLine1;
+    text[5] = Parser->errorLine2;
+    text[6] = Parser->workspaceMessage;
+    text[7] = Parser->executionMessage;
+    text[8] = Parser->computingMessage;
+    text[9] = Parser->standbyTkMessage;
+    text[10] = Parser->avgSearchMessage;
+    text[11] = NULL;
+    for (i = 0; text[i] != NULL; i++)
+    {
+        fwrite(text[i], strlen(text[i]) + 1, 1, fp);
+        length += strlen(text[i]) + 1;
+    }
+    
+    return length;
+}
+
+// Bit n is set if header line n + 1 has been read
+uint32_t summaryHeaderLines(void)
+{
+    return (Parser->headerLine1 != NULL) | ((Parser->headerLine2 != NULL) << 1) | ((Parser->headerLine3 != NULL) << 2);
+}
+
+// Restores the text written by writeSummaryText. Header lines are only kept if their bit is set.
+void readSummaryText(const char *text, const char *end, uint32_t headerLines)
+{
+    char **lines[3] = {&Parser->headerLine1, &Parser->headerLine2, &Parser->headerLine3};
+    char *messages[8] = {Parser->lastInstruction, Parser->errorLine1, Parser->errorLine2, Parser->workspaceMessage, Parser->executionMessage, Parser->computingMessage, Parser->standbyTkMessage, Parser->avgSearchMessage};
+    const char *string;
+    int i;
+    
+    for (i = 0; i < 3; i++)
+        if ((string = ReadTraceString(&text, end)) != NULL && (headerLines & (1 << i)))
+        {
+            free(*lines[i]);
+            *lines[i] = strdup(string);
+        }
+    for (i = 0; i < 8; i++)
+        if ((string = ReadTraceString(&text, end)) != NULL)
+            snprintf(messages[i], 256, "%s", string);
+}
+
+// Returns the next string of a trace's text, or NULL if the text has been cut short
+const char *ReadTraceString(const char **text, const char *end)
+{
+    const char *string = *text;
+    const char *terminator = (string < end) ? memchr(string, '\0', end - string) : NULL;
+    
+    if (terminator == NULL)
+        return NULL;
+    *text = terminator + 1;
+    
+    return string;
+}
+
+// Loads a binary trace by memory mapping it. The draws are applied straight to the pixel store
+// and the visualiser is sent the finished scene. Returns 0 if the trace could not be read.
+int LoadTrace(char *filename)
+{
+    TraceHeader *header;
+    TraceEvent *events;
+    struct stat st;
+    char *map;
+    size_t size;
+    uint64_t i;
+    int fd, x, y, keyframes;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        Error("Unable to open trace file \"%s\".\n\n", filename);
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(TraceHeader))
+    {
+        Error("\"%s\" is not a trace file.\n\n", filename);
+        close(fd);
+        return 0;
+    }
+    size = (size_t) st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        Error("Unable to map trace file \"%s\".\n\n", filename);
+        return 0;
+    }
+    
+    // Check that every section lies within the file
+    header = (TraceHeader *) map;
+    if (memcmp(header->magic, TRACE_MAGIC, 8) || header->version != TRACE_VERSION
+        || header->eventOffset > size || header->eventCount > (size - header->eventOffset) / sizeof(TraceEvent)
+        || header->textOffset > size || header->textLength > size - header->textOffset
+        || header->width > MAX_SCENE_SIZE || header->height > MAX_SCENE_SIZE)
+    {
+        Error("\"%s\" is not a trace file, or is damaged.\n\n", filename);
+        munmap(map, size);
+        return 0;
+    }
+    
+    // Restore the text shown in the summary
+    readSummaryText(map + header->textOffset, map + header->textOffset + header->textLength, header->headerLines);
+    Parser->theEnd = header->theEnd;
+    
+    if (header->width > 0 && header->height > 0)
+    {
+        Parser->sceneWidth = header->width;
+        Parser->sceneHeight = header->height;
+        printf("Scene dimensions recognised (%i x %i)\n", Parser->sceneWidth, Parser->sceneHeight);
+        initialisePixelStore();
+        
+        // Draws are applied in order, so the latest to each pixel is kept. Keyframes are taken
+        // at the end of a line along the way, but only if the trace may be replayed.
+        keyframes = ReplayEnabled || !Headless;
+        if (keyframes)
+            RestartReplay(0, 0);
+        events = (TraceEvent *) (map + header->eventOffset);
+        madvise(events, sizeof(TraceEvent) * header->eventCount, MADV_SEQUENTIAL);
+        for (i = 0; i < header->eventCount; i++)
+        {
+            x = (int) events[i].x;
+            y = (int) events[i].y;
+            if (wrapPixel(Parser->sceneWidth, Parser->sceneHeight, &x, &y))
+                *storePixel(&Parser->pixelStore, x, y) = events[i].colour;
+            if (keyframes && i + 1 >= NextKeyframe && (i + 1 == header->eventCount || events[i + 1].line != events[i].line))
+                AddKeyframe(i + 1, events[i].line + 1, events[i].line, i + 1, &Parser->pixelStore);
+        }
+        publishPixelStore();
+        
+        // The mapping is kept for replay
+        ReplayEvents = events;
+        ReplayEventCount = header->eventCount;
+        ReplayLastLine = (header->eventCount > 0) ? events[header->eventCount - 1].line : 0;
+    }
+    printf("Trace loaded (%llu draws).\n\n", (unsigned long long) header->eventCount);
+    setGraphicsFlag(header->status);
+    if (ReplayEvents == NULL)
+        munmap(map, size);
+    
+    return 1;
+}
+
+// Thread for loading a binary trace
+void *LoadTraceThread(void *arg)
+{
+    LoadTrace((char *) arg);
+    FinishParsing();
+    
+    return NULL;
+}
+
+// Returns the name of the parse cache kept beside a log
+char *cachePath(char *filename)
+{
+    char *path = malloc(strlen(filename) + 9);
+    
+    sprintf(path, "%s.dpcache", filename);
+    return path;
+}
+
+// Adds bytes to an FNV-1a fingerprint
+uint64_t fingerprintBytes(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t i;
+    
+    for (i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+// Returns a fingerprint of part of a file, or 0 if it can't all be read
+uint64_t fingerprintFile(int fd, uint64_t offset, uint64_t length)
+{
+    unsigned char block[65536];
+    uint64_t hash = CACHE_FNV_BASIS;
+    ssize_t n;
+    
+    while (length > 0)
+    {
+        n = pread(fd, block, (length < sizeof(block)) ? length : sizeof(block), offset);
+        if (n <= 0)
+            return 0;
+        hash = fingerprintBytes(hash, block, n);
+        offset += n;
+        length -= n;
+    }
+    return hash;
+}
+
+// Returns a fingerprint of the rules and options that change how a log is parsed
+uint64_t parseSettings(void)
+{
+    uint64_t hash = fingerprintBytes(CACHE_FNV_BASIS, &NoHeader, sizeof(NoHeader));
+    LineRule *rule;
+    int r;
+    
+    for (r = 0; r < Recognizer.ruleCount; r++)
+    {
+        rule = &Recognizer.rules[r];
+        hash = fingerprintBytes(hash, &rule->handler, sizeof(int));
+        hash = fingerprintBytes(hash, &rule->position, sizeof(int));
+        hash = fingerprintBytes(hash, &rule->matchCase, sizeof(int));
+        hash = fingerprintBytes(hash, rule->pattern, rule->length + 1);
+    }
+    return hash;
+}
+
+// Restores the parser from the cache beside a log. The offset and number of the next line to
+// parse are returned through offset and lineNo. Returns CACHE_CURRENT if the log hasn't changed
+// since it was cached, CACHE_RESUME if lines have been added to it since, or CACHE_MISSING if
+// there's no cache that can be used.
+int LoadParseCache(char *filename, uint64_t *offset, int *lineNo)
+{
+    CacheHeader *header;
+    struct stat logStat, st;
+    char *path = cachePath(filename), *logPath, *map;
+    const char *storedPath;
+    uint64_t i, tiles;
+    uint32_t tile;
+    int fd, log, result = CACHE_MISSING;
+    
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return CACHE_MISSING;
+    log = open(filename, O_RDONLY);
+    if (log < 0 || fstat(log, &logStat) < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(CacheHeader))
+    {
+        if (log >= 0)
+            close(log);
+        close(fd);
+        return CACHE_MISSING;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        close(log);
+        return CACHE_MISSING;
+    }
+    
+    // Check that every section lies within the cache, and that it was made by these settings
+    header = (CacheHeader *) map;
+    if (memcmp(header->magic, CACHE_MAGIC, 8) || header->version != CACHE_VERSION || header->settings != parseSettings()
+        || header->width > MAX_SCENE_SIZE || header->height > MAX_SCENE_SIZE
+        || header->tileOffset > (uint64_t) st.st_size || header->tileCount > ((uint64_t) st.st_size - header->tileOffset) / (sizeof(uint32_t) + TILE_BYTES)
+        || header->textOffset > (uint64_t) st.st_size || header->textLength > (uint64_t) st.st_size - header->textOffset
+        || header->pathOffset >= (uint64_t) st.st_size || memchr(map + header->pathOffset, '\0', st.st_size - header->pathOffset) == NULL)
+        goto cache_done;
+    
+    // The cache belongs to this log if it has the same path and starts with the same bytes. If
+    // it's also the same size and age, nothing has changed. If it has grown, and the bytes
+    // before the cached offset are still the same, only the new lines need to be parsed.
+    storedPath = map + header->pathOffset;
+    logPath = realpath(filename, NULL);
+    if (logPath == NULL || strcmp(logPath, storedPath) || (uint64_t) logStat.st_size < header->offset
+        || fingerprintFile(log, 0, header->prefixLength) != header->prefix)
+    {
+        free(logPath);
+        goto cache_done;
+    }
+    free(logPath);
+    if ((uint64_t) logStat.st_size == header->offset && logStat.st_mtim.tv_sec * 1000000000LL + logStat.st_mtim.tv_nsec == header->logModified)
+        result = CACHE_CURRENT;
+    else if ((uint64_t) logStat.st_size > header->offset && header->resumable
+        && fingerprintFile(log, header->offset - header->tailLength, header->tailLength) == header->tail)
+        result = CACHE_RESUME;
+    else
+    {
+        printf("The parse cache of \"%s\" is out of date. Parsing from the start.\n\n", filename);
+        goto cache_done;
+    }
+    
+    // Restore the text shown in the summary, the counters and the scene
+    readSummaryText(map + header->textOffset, map + header->textOffset + header->textLength, header->headerLines);
+    Parser->theEnd = header->theEnd;
+    addStats(&Parser->stats, &header->stats, 1);
+    if (header->width > 0 && header->height > 0)
+    {
+        Parser->sceneWidth = header->width;
+        Parser->sceneHeight = header->height;
+        printf("Scene dimensions recognised (%i x %i)\n", Parser->sceneWidth, Parser->sceneHeight);
+        initialisePixelStore();
+        tiles = (uint64_t) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY;
+        for (i = 0; i < header->tileCount; i++)
+        {
+            memcpy(&tile, map + header->tileOffset + i * (sizeof(uint32_t) + TILE_BYTES), sizeof(uint32_t));
+            if (tile < tiles)
+                memcpy(allocateTile(&Parser->pixelStore, tile), map + header->tileOffset + i * (sizeof(uint32_t) + TILE_BYTES) + sizeof(uint32_t), TILE_BYTES);
+        }
+        publishPixelStore();
+    }
+    if (header->status != 0)
+        setGraphicsFlag(header->status);
+    
+    *offset = header->offset;
+    *lineNo = (int) header->stats.lines + 1;
+    Parser->currentOffset = header->offset;
+    if (result == CACHE_CURRENT)
+        printf("Restored \"%s\" from its parse cache (%llu lines).\n\n", filename, (unsigned long long) header->stats.lines);
+    else
+        printf("Restored \"%s\" from its parse cache (%llu lines). Parsing the %llu bytes added since.\n\n", filename,
+            (unsigned long long) header->stats.lines, (unsigned long long) (logStat.st_size - header->offset));
+    
+cache_done:
+    munmap(map, st.st_size);
+    close(log);
+    return result;
+}
+
+// Writes the parser's state to the cache beside a log, once the log has been parsed. A log
+// whose parsing stopped early can only be restored while it's unchanged. The cache is written
+// under another name first, so an interrupted write leaves any earlier cache in place.
+void SaveParseCache(char *filename, int stopped)
+{
+    CacheHeader header;
+    struct stat logStat;
+    FILE *fp;
+    char *path = cachePath(filename), *temporary = malloc(strlen(path) + 5), *logPath, last = '\n';
+    uint32_t tile;
+    long tiles, i;
+    int log, failed;
+    
+    sprintf(temporary, "%s.tmp", path);
+    log = open(filename, O_RDONLY);
+    logPath = realpath(filename, NULL);
+    fp = fopen(temporary, "wb");
+    if (log < 0 || logPath == NULL || fp == NULL || fstat(log, &logStat) < 0)
+    {
+        Error("Unable to write the parse cache \"%s\".\n\n", path);
+        goto save_done;
+    }
+    setvbuf(fp, NULL, _IOFBF, READ_BUFFER_SIZE);
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, fp);
+    
+    // The drawn tiles, each after its index
+    header.tileOffset = sizeof(CacheHeader);
+    if (Parser->pixelStore.tiles != NULL)
+    {
+        tiles = (long) Parser->pixelStore.tilesX * Parser->pixelStore.tilesY;
+        for (i = 0; i < tiles; i++)
+            if (Parser->pixelStore.tiles[i] != NULL)
+            {
+                tile = (uint32_t) i;
+                fwrite(&tile, sizeof(tile), 1, fp);
+                fwrite(Parser->pixelStore.tiles[i], TILE_BYTES, 1, fp);
+                header.tileCount++;
+            }
+    }
+    header.textOffset = header.tileOffset + header.tileCount * (sizeof(uint32_t) + TILE_BYTES);
+    header.textLength = writeSummaryText(fp);
+    header.pathOffset = header.textOffset + header.textLength;
+    fwrite(logPath, strlen(logPath) + 1, 1, fp);
+    
+    // Parsing can carry on from the offset reached if it ended at the end of a line
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.width = (Parser->pixelStore.tiles != NULL) ? Parser->sceneWidth : 0;
+    header.height = (Parser->pixelStore.tiles != NULL) ? Parser->sceneHeight : 0;
+    header.status = Parser->graphicsFlag;
+    header.theEnd = Parser->theEnd;
+    header.headerLines = summaryHeaderLines();
+    header.settings = parseSettings();
+    header.offset = stopped ? (uint64_t) logStat.st_size : Parser->currentOffset;
+    if (header.offset > 0 && pread(log, &last, 1, header.offset - 1) != 1)
+        last = '\0';
+    header.resumable = !stopped && last == '\n';
+    header.logModified = logStat.st_mtim.tv_sec * 1000000000LL + logStat.st_mtim.tv_nsec;
+    header.prefixLength = (header.offset < CACHE_FINGERPRINT) ? header.offset : CACHE_FINGERPRINT;
+    header.prefix = fingerprintFile(log, 0, header.prefixLength);
+    header.tailLength = header.prefixLength;
+    header.tail = fingerprintFile(log, header.offset - header.tailLength, header.tailLength);
+    readContextStats(Parser, &header.stats);
+    fseeko(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    failed = ferror(fp);
+    failed |= fclose(fp);
+    fp = NULL;
+    if (failed || rename(temporary, path) < 0)
+    {
+        Error("Unable to write the parse cache \"%s\".\n\n", path);
+        unlink(temporary);
+    }
+    else
+        printf("Parse cache \"%s\" written (%llu tiles).\n\n", path, (unsigned long long) header.tileCount);
+    
+save_done:
+    if (fp != NULL)
+    {
+        fclose(fp);
+        unlink(temporary);
+    }
+    if (log >= 0)
+        close(log);
+    free(logPath);
+    free(temporary);
+    free(path);
+}
+
+// Counts the draws made while parsing a log, so keyframes can be taken as it's replayed
+void RecordReplayDraws(uint64_t count)
+{
+    ReplayDraws += count;
+    ReplayLastLine = Parser->currentLine;
+}
+
+// Takes a copy of the pixels as a keyframe. If there are too many, every other keyframe is
+// dropped and the spacing doubles, so the keyframes always cover the whole run evenly.
+void AddKeyframe(uint64_t draws, uint32_t line, uint32_t drawLine, uint64_t offset, TileStore *pixels)
+{
+    int i;
+    
+    if (KeyframeCount == MaxKeyframes)
+    {
+        // Keyframe i was taken once (i + 1) * KeyframeSpacing draws had been made. Keep the even multiples.
+        for (i = 0; i < KeyframeCount; i++)
+        {
+            if (i % 2 == 0)
+                DeleteTileStore(Keyframes[i].pixels);
+            else
+                Keyframes[i / 2] = Keyframes[i];
+        }
+        KeyframeCount /= 2;
+        KeyframeSpacing *= 2;
+        NextKeyframe = (Keyframes[KeyframeCount - 1].draws / KeyframeSpacing + 1) * KeyframeSpacing;
+        if (draws < NextKeyframe)
+            return;
+    }
+    if (Keyframes == NULL)
+        Keyframes = malloc(sizeof(Keyframe) * MaxKeyframes);
+    
+    Keyframes[KeyframeCount].draws = draws;
+    Keyframes[KeyframeCount].line = line;
+    Keyframes[KeyframeCount].drawLine = drawLine;
+    Keyframes[KeyframeCount].offset = offset;
+    Keyframes[KeyframeCount].pixels = DuplicateTileStore(pixels);
+    KeyframeCount++;
+    NextKeyframe = (draws / KeyframeSpacing + 1) * KeyframeSpacing;
+}
+
+// Forgets the keyframes taken so far, as the scene has been redefined. A replay starts from an
+// empty scene at the given line and offset.
+void RestartReplay(uint32_t line, uint64_t offset)
+{
+    int i;
+    
+    for (i = 0; i < KeyframeCount; i++)
+        DeleteTileStore(Keyframes[i].pixels);
+    KeyframeCount = 0;
+    ReplayDraws = ReplayLastLine = 0;
+    NextKeyframe = KeyframeSpacing;
+    ReplayStartLine = line;
+    ReplayStartOffset = offset;
+}
+
+// Returns the line the replay reads next, or 0 once every draw has been replayed
+uint32_t replayNextLine(void)
+{
+    if (ReplayLogName != NULL)
+        return (ReplayNextLine <= ReplayLastLine) ? ReplayNextLine : 0;
+    return (ReplayOffset < ReplayEventCount) ? ReplayEvents[ReplayOffset].line : 0;
+}
+
+// Applies a line of a log to the replay store if the parser drew anything from it. The checks
+// are those of ParseLine, without the messages. Returns 1 if the line drew.
+int ReplayLogLine(char *line, int post)
+{
+    LineScan scan;
+    BulkDraw bulk;
+    const char *p;
+    int x, y, run;
+    float RVal, GVal, BVal;
+    unsigned int colour;
+    
+    ScanLine(line, &scan);
+    if (scan.length < 6 || (scan.handlers & ((1 << RULE_NOFILE) | (1 << RULE_IGNORE) | (1 << RULE_SUMMARY))))
+        return 0;
+    if (scan.handlers & (1 << RULE_DRAW))
+    {
+        if (scan.drawFault || scan.lBrack < 0 || scan.rBrack < 0 || scan.eqsign < 0 || scan.comsign < 0
+            || ReadDrawValues(line, &scan, &x, &y, &RVal, &GVal, &BVal)
+            || x > Parser->sceneWidth || x < 0 || y > Parser->sceneHeight || y < 0)
+            return 0;
+        colour = packColour(RVal, GVal, BVal);
+        if (wrapPixel(Parser->sceneWidth, Parser->sceneHeight, &x, &y))
+        {
+            *storePixel(&ReplayStore, x, y) = colour;
+            if (post)
+                postDrawEvent(0, DRAW_EVENT_PIXEL, x, y, colour, NULL);
+        }
+        return 1;
+    }
+    if (scan.handlers & RULE_BULK)
+    {
+        if (ReadBulkDraw(line, &scan, &bulk))
+            return 0;
+        if (bulk.handler == RULE_RLE)
+        {
+            for (x = bulk.x, p = bulk.runs; readBulkRun(&p, &run, &colour) > 0; x += run)
+            {
+                fillStoreSpan(&ReplayStore, x, bulk.y, run, colour);
+                if (post)
+                    postDrawSpan(0, x, bulk.y, run, colour);
             }
-            // Let's check for the keyword "error".
-            if (strlen(line) > 5)
+        }
+        else
+            for (y = bulk.y; y < bulk.y + bulk.height; y++)
             {
-                tempString = malloc(sizeof(char) * 6);
-                for (n = 0; n < strlen(line) - 6; n++)
-                {
-                    // Copy the contents of the string to memory
-                    memset(tempString, 0, sizeof(char) * 6);
-                    memcpy(&tempString[0], &line[n], sizeof(char) * 5);
-                    if (!strcasecmp(tempString, "error"))
-                    {
-                        // Yes, it's an error message. Best way to handle this is to print this error
-                        // and recommend further debugging outside the DAMSON parser. Finally, safely
-                        // free any memory and return with an error condition.
-                        Error("An error was encountered in DAMSON:\n");
-                        Error("     %s\n", line);
-                        Error("Please debug outside the DAMSON parser environment.\n");
-                        free(tempString);
-                        return -1;
-                    }
-                    
-                }
-                // Not an error. Free up memory.
-                free(tempString);
+                fillStoreSpan(&ReplayStore, bulk.x, y, bulk.width, bulk.colour);
+                if (post)
+                    postDrawSpan(0, bulk.x, y, bulk.width, bulk.colour);
             }
-            
-            // No draw keyword was found. This could be a scene definition
-            if (strlen(line) > 17)
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Applies the draws of the next line to the replay store. When post is set, each draw is also
+// sent to the visualiser so it shows as activity. Returns 1 if the line drew.
+int ReplayReadLine(int post)
+{
+    uint32_t line = replayNextLine();
+    ssize_t lsize;
+    int x, y, drew = 0;
+    
+    if (ReplayLogName != NULL)
+    {
+        lsize = getline(&ReplayBuffer, &ReplayBufferSize, ReplayLog);
+        if (lsize < 0)
+        {
+            // The log has been cut short since it was parsed
+            ReplayNextLine = ReplayLastLine + 1;
+            return 0;
+        }
+        ReplayOffset += lsize;
+        ReplayNextLine++;
+        drew = ReplayLogLine(ReplayBuffer, post);
+    }
+    else
+    {
+        for (; ReplayOffset < ReplayEventCount && ReplayEvents[ReplayOffset].line == line; ReplayOffset++)
+        {
+            drew = 1;
+            x = (int) ReplayEvents[ReplayOffset].x;
+            y = (int) ReplayEvents[ReplayOffset].y;
+            if (!wrapPixel(Parser->sceneWidth, Parser->sceneHeight, &x, &y))
+                continue;
+            *storePixel(&ReplayStore, x, y) = ReplayEvents[ReplayOffset].colour;
+            if (post)
+                postDrawEvent(0, DRAW_EVENT_PIXEL, x, y, ReplayEvents[ReplayOffset].colour, NULL);
+        }
+    }
+    if (drew)
+        ReplayDrawLine = line;
+    
+    return drew;
+}
+
+// Applies the draws of every line up to and including the given line
+void ReplayForward(uint32_t line, int post)
+{
+    uint32_t next;
+    
+    while ((next = replayNextLine()) != 0 && next <= line)
+        ReplayReadLine(post);
+}
+
+// Shows the scene as it was once the given line had been parsed. The nearest keyframe before
+// the line is restored, and the log is read again from its offset, or the trace's draws after
+// it are applied. Returns 0 if replay isn't available.
+int SeekReplay(uint32_t line)
+{
+    int k;
+    
+    // The parser must be finished with the log and the draw queue
+    if (!__atomic_load_n(&ParsingComplete, __ATOMIC_ACQUIRE) || (ReplayLogName == NULL && ReplayEvents == NULL) || Parser->pixelStore.tiles == NULL)
+        return 0;
+    if (ReplayLogName != NULL && ReplayLog == NULL && (ReplayLog = fopen(ReplayLogName, "r")) == NULL)
+    {
+        Error("Unable to open \"%s\" to replay it.\n\n", ReplayLogName);
+        ReplayLogName = NULL;
+        return 0;
+    }
+    if (ReplayStore.tiles == NULL)
+        InitTileStore(&ReplayStore, Parser->sceneWidth, Parser->sceneHeight);
+    
+    line = (line > ReplayLastLine) ? ReplayLastLine : line;
+    
+    // Carry on from the current position unless it has passed the line or a keyframe is closer
+    for (k = KeyframeCount - 1; k >= 0 && Keyframes[k].line > line + 1; k--);
+    if (!ReplayActive || ReplayDrawLine > line || (k >= 0 && Keyframes[k].drawLine > ReplayDrawLine))
+    {
+        if (k >= 0)
+        {
+            CopyTileStore(&ReplayStore, Keyframes[k].pixels);
+            ReplayNextLine = Keyframes[k].line;
+            ReplayOffset = Keyframes[k].offset;
+            ReplayDrawLine = Keyframes[k].drawLine;
+        }
+        else
+        {
+            ClearTileStore(&ReplayStore);
+            ReplayNextLine = ReplayStartLine;
+            ReplayOffset = ReplayStartOffset;
+            ReplayDrawLine = 0;
+        }
+        if (ReplayLog != NULL)
+            fseeko(ReplayLog, (off_t) ReplayOffset, SEEK_SET);
+    }
+    ReplayForward(line, 0);
+    ReplayActive = 1;
+    ReplayLine = line;
+    
+    postDrawEvent(0, DRAW_EVENT_FRAME, Parser->sceneWidth, Parser->sceneHeight, 0, DuplicateTileStore(&ReplayStore));
+    
+    return 1;
+}
+
+// Moves the replay to the previous or next line with a draw
+void StepReplay(int direction)
+{
+    uint32_t next;
+    
+    if (!ReplayActive && !SeekReplay(ReplayLastLine))
+        return;
+    ReplayPlaying = 0;
+    if (direction > 0)
+    {
+        while ((next = replayNextLine()) != 0)
+            if (ReplayReadLine(1))
             {
-                for (n = 0; n < strlen(line) - 10; n++)
+                ReplayLine = next;
+                break;
+            }
+    }
+    else if (ReplayDrawLine > 0)
+        SeekReplay(ReplayDrawLine - 1);
+}
+
+// Plays the replay forward by the lines due since the last call, at ReplayLineRate lines per
+// second multiplied by the replay speed
+void AdvanceReplay(void)
+{
+    unsigned int now = activityMillis();
+    double lines;
+    
+    if (!ReplayPlaying)
+        return;
+    lines = ReplayCarry + (now - ReplayTickTime) * ReplayLineRate * ReplaySpeed / 1000.0;
+    ReplayTickTime = now;
+    ReplayCarry = lines - (uint32_t) lines;
+    ReplayLine = (ReplayLine + lines > ReplayLastLine) ? ReplayLastLine : ReplayLine + (uint32_t) lines;
+    ReplayForward(ReplayLine, 1);
+    if (ReplayLine >= ReplayLastLine)
+        ReplayPlaying = 0;
+}
+
+// Leaves the replay and shows the final scene again
+void StopReplay(void)
+{
+    if (!ReplayActive)
+        return;
+    ReplayActive = ReplayPlaying = 0;
+    publishPixelStore();
+}
+
+// Describes the state of the replay. Returns 0 if there is nothing to show.
+int getReplayStatus(char *text, size_t size)
+{
+    if (SeekDigits > 0)
+        snprintf(text, size, "Seek to line %u (press Enter)", SeekLine);
+    else if (ReplayActive)
+        snprintf(text, size, "Replay: line %u of %u, %gx, %s", ReplayLine, ReplayLastLine, ReplaySpeed, ReplayPlaying ? "playing" : "paused");
+    else
+        return 0;
+    
+    return 1;
+}
+
+// Colour of a pixel in one of the compared scenes. Pixels outside a scene are black.
+unsigned int comparePixel(int side, int x, int y)
+{
+    if (x >= CompareScenes[side].width || y >= CompareScenes[side].height)
+        return 0;
+    return readPixel(&CompareScenes[side], x, y);
+}
+
+// Colour shown in the difference view. Matching pixels are dimmed. In those that differ, each
+// channel that differs is at least half brightness so the smallest change stands out.
+unsigned int differenceColour(unsigned int a, unsigned int b)
+{
+    unsigned int colour = 0, diff;
+    int shift;
+    
+    if (a == b)
+        return (a >> 2) & 0x3F3F3F;
+    for (shift = 0; shift < 24; shift += 8)
+    {
+        diff = abs((int) ((a >> shift) & 0xFF) - (int) ((b >> shift) & 0xFF));
+        if (diff > 0)
+            colour |= (128 + diff / 2) << shift;
+    }
+    
+    return colour;
+}
+
+// Size of the frame for a view: the two scenes side by side, or laid over each other
+void compareViewSize(int view, int *width, int *height)
+{
+    *width = (view == COMPARE_SPLIT) ? CompareScenes[0].width + CompareScenes[1].width : DiffWidth;
+    *height = DiffHeight;
+}
+
+// Draws the whole of a view into a new store. Only the tiles drawn on in either scene are
+// visited; everything else is black in both views.
+TileStore *renderCompareView(int view, int width, int height)
+{
+    TileStore *image = calloc(1, sizeof(TileStore)), *scene;
+    unsigned int colour;
+    long tile;
+    int side, x, y, x0, y0, split = CompareScenes[0].width;
+    
+    InitTileStore(image, width, height);
+    for (side = 0; side < 2; side++)
+    {
+        scene = &CompareScenes[side];
+        for (tile = 0; tile < (long) scene->tilesX * scene->tilesY; tile++)
+        {
+            if (scene->tiles[tile] == NULL)
+                continue;
+            x0 = (tile % scene->tilesX) * TILE_SIZE;
+            y0 = (tile / scene->tilesX) * TILE_SIZE;
+            for (y = y0; y < y0 + TILE_SIZE && y < scene->height; y++)
+                for (x = x0; x < x0 + TILE_SIZE && x < scene->width; x++)
                 {
-                    tempString = malloc(sizeof(char) * 10);
-                    memset(tempString, 0, 10);
-                    memcpy(&tempString[0], &line[n], 9);
-                    if (!strcasecmp(tempString, "dimension"))
+                    if (view == COMPARE_SPLIT)
                     {
-                        // Found the word draw. We can try parsing this information
-                        m = n;
-                        free(tempString);
-                        break;
+                        if ((colour = scene->tiles[tile][(y - y0) * TILE_SIZE + x - x0]) != 0)
+                            *storePixel(image, side ? split + x : x, y) = colour;
                     }
-                    free(tempString);
+                    else if ((colour = differenceColour(comparePixel(0, x, y), comparePixel(1, x, y))) != 0)
+                        *storePixel(image, x, y) = colour;
                 }
-                if (m != n)
-                {
-                    // Assume this is debug information.
-                    return 3;
-                }
-                
-                // If here, we know the word dimensions. Try to find the word scene too.
-                for (n = 0; n < strlen(line) - 6; n++)
+        }
+    }
+    
+    return image;
+}
+
+// Counts the differing pixels in each row and column from scratch, once a scene has been replaced.
+// Pixels can only differ where one of the scenes has been drawn on.
+void resetDifferences(void)
+{
+    TileStore *scene;
+    long tile;
+    int side, x, y, x0, y0;
+    
+    DiffWidth = (CompareScenes[0].width > CompareScenes[1].width) ? CompareScenes[0].width : CompareScenes[1].width;
+    DiffHeight = (CompareScenes[0].height > CompareScenes[1].height) ? CompareScenes[0].height : CompareScenes[1].height;
+    free(DiffRows);
+    free(DiffColumns);
+    DiffRows = calloc(DiffHeight + 1, sizeof(int));
+    DiffColumns = calloc(DiffWidth + 1, sizeof(int));
+    DiffCount = 0;
+    for (side = 0; side < 2; side++)
+    {
+        scene = &CompareScenes[side];
+        for (tile = 0; tile < (long) scene->tilesX * scene->tilesY; tile++)
+        {
+            if (scene->tiles[tile] == NULL)
+                continue;
+            x0 = (tile % scene->tilesX) * TILE_SIZE;
+            y0 = (tile / scene->tilesX) * TILE_SIZE;
+            for (y = y0; y < y0 + TILE_SIZE && y < scene->height; y++)
+                for (x = x0; x < x0 + TILE_SIZE && x < scene->width; x++)
                 {
-                    tempString = malloc(sizeof(char) * 6);
-                    memset(tempString, 0, 6);
-                    memcpy(&tempString[0], &line[n], 5);
-                    if (!strcasecmp(tempString, "scene"))
+                    // Pixels in tiles of the first scene have already been counted
+                    if (side == 1 && tileDrawn(&CompareScenes[0], x, y))
+                        continue;
+                    if (comparePixel(0, x, y) != comparePixel(1, x, y))
                     {
-                        // Found the word draw. We can try parsing this information
-                        m = n;
-                        free(tempString);
-                        break;
+                        DiffRows[y]++;
+                        DiffColumns[x]++;
+                        DiffCount++;
                     }
-                    free(tempString);
-                }
-                if (m != n)
-                {
-                    // Assume this is debug information.
-                    return 3;
-                }
-                
-                // If here, we have the keywords scene and dimensions. We can therefore parse this:
-                for (n = strlen(line) - 1; n >= 0; n--)
-                    if ((line[n] < '0' || line[n] > '9') && (line[n] != ' ' && line[n] != '\t'))
-                        break;
-                if (n == 0)
-                {
-                    Error("Warning: Could not recognise scene description on line %i.\n", lineNo);
-                    return 3;
-                }
-                tempString = malloc(sizeof(char) * (strlen(line) - n + 2));
-                memset(tempString, 0, strlen(line) - n + 2);
-                memcpy(&tempString[0], &line[n + 1], strlen(line) - n + 1);
-                
-                scanout = sscanf(tempString, "%i %i", &SceneWidth, &SceneHeight);
-                free(tempString);
-                if (scanout == EOF || scanout < 2)
-                {
-                    Error("Warning: Unable to understand scene description on line %i.\n", lineNo);
-                    return 3;
                 }
-                
-                printf("Scene dimensions recognised (%i x %i)\n", SceneWidth, SceneHeight);
-                initialisePixelStore();
-                graphicsFlag = 1;
-            }
-            
-            // Assume this is debug information.
-            return 3;
+        }
+    }
+}
+
+// Works out the box around the differing pixels from the row and column counts and hands it
+// to the visualiser
+void publishDifferences(void)
+{
+    CompareReport report;
+    
+    memset(&report, 0, sizeof(report));
+    report.count = DiffCount;
+    if (DiffCount > 0)
+    {
+        while (DiffColumns[report.left] == 0)
+            report.left++;
+        while (DiffRows[report.top] == 0)
+            report.top++;
+        for (report.right = DiffWidth - 1; DiffColumns[report.right] == 0; report.right--);
+        for (report.bottom = DiffHeight - 1; DiffRows[report.bottom] == 0; report.bottom--);
+    }
+    
+    pthread_mutex_lock(&CompareLock);
+    DiffReport = report;
+    pthread_mutex_unlock(&CompareLock);
+}
+
+// Adds the whole of the view being shown to a batch. If resize is given, the frame buffers are
+// resized to suit it first.
+int composeCompareView(DrawEvent *batch, int count, int *resize)
+{
+    int width, height;
+    
+    compareViewSize(CompareShown, &width, &height);
+    if (width == 0 || height == 0)
+        return count;
+    if (resize != NULL)
+    {
+        batch[count].type = DRAW_EVENT_SCENE;
+        batch[count].x = width;
+        batch[count].y = height;
+        batch[count++].frame = NULL;
+        *resize = 1;
+    }
+    batch[count].type = DRAW_EVENT_FRAME;
+    batch[count].x = width;
+    batch[count].y = height;
+    batch[count++].frame = renderCompareView(CompareShown, width, height);
+    
+    return count;
+}
+
+// Applies a draw event from one of the runs to the compositor's copy of its scene, and adds
+// the change to the view being shown to the batch. Adds at most two events.
+int compareDrawEvent(int side, DrawEvent *event, DrawEvent *batch, int count, int *resize)
+{
+    TileStore *scene = &CompareScenes[side];
+    unsigned int a, b;
+    int x = event->x, y = event->y, differed, step;
+    
+    if (event->type == DRAW_EVENT_PIXEL)
+    {
+        if (x >= scene->width || y >= scene->height)
+            return count;
+        differed = (comparePixel(0, x, y) != comparePixel(1, x, y));
+        *storePixel(scene, x, y) = event->colour;
+        a = comparePixel(0, x, y);
+        b = comparePixel(1, x, y);
+        if ((a != b) != differed)
+        {
+            step = (a != b) ? 1 : -1;
+            DiffRows[y] += step;
+            DiffColumns[x] += step;
+            DiffCount += step;
+        }
+        
+        batch[count].type = DRAW_EVENT_PIXEL;
+        batch[count].frame = NULL;
+        batch[count].y = y;
+        if (CompareShown == COMPARE_SPLIT)
+        {
+            batch[count].x = (side ? CompareScenes[0].width : 0) + x;
+            batch[count].colour = event->colour;
         }
         else
         {
-            // This is the end...
-            // There are only so many possibilities that can be displayed in "the end":
-            switch (line[0])
-            {
-                case 'E':
-                    // Execution time
-                    memcpy(&ExecutionMessage[0], &line[0], strlen(line));
-                    break;
-                case 'C':
-                    // Computing time
-                    memcpy(&ComputingMessage[0], &line[0], strlen(line));
-                    break;
-                case 'S':
-                    // Standby ticks
-                    memcpy(&StandbyTkMessage[0], &line[0], strlen(line));
-                    break;
-                case 'A':
-                    // Average Search Length
-                    memcpy(&AvgSearchMessage[0], &line[0], strlen(line));
-                    break;
-                default:
-                    Warning("Warning: Unrecognised line in DAMSON end summary.\n");
-            }
+            batch[count].x = x;
+            batch[count].colour = differenceColour(a, b);
+        }
+        return count + 1;
+    }
+    
+    // A new scene, or a copy of the whole of the current one. Either way the view is redrawn.
+    if (event->type == DRAW_EVENT_SCENE)
+    {
+        FreeTileStore(scene);
+        InitTileStore(scene, x, y);
+    }
+    else
+    {
+        if (x == scene->width && y == scene->height)
+            CopyTileStore(scene, event->frame);
+        DeleteTileStore(event->frame);
+    }
+    resetDifferences();
+    
+    return composeCompareView(batch, count, (event->type == DRAW_EVENT_SCENE) ? resize : NULL);
+}
+
+// Takes waiting events from both runs into the batch as changes to the view being shown.
+// Switching views redraws the whole frame.
+int takeCompareEvents(unsigned int *tails, DrawEvent *batch, int *resize)
+{
+    int side, count = 0, view = __atomic_load_n(&CompareView, __ATOMIC_RELAXED);
+    unsigned int head;
+    DrawEvent *event;
+    
+    if (view != CompareShown)
+    {
+        __atomic_store_n(&CompareShown, view, __ATOMIC_RELAXED);
+        count = composeCompareView(batch, count, resize);
+    }
+    for (side = 0; side < 2; side++)
+    {
+        head = __atomic_load_n(&DrawQueues[side].head, __ATOMIC_ACQUIRE);
+        while (tails[side] != head && count < COMPOSITOR_BATCH - 2)
+        {
+            event = &DrawQueues[side].events[tails[side]++ & (DRAW_QUEUE_SIZE - 1)];
+            count = compareDrawEvent(side, event, batch, count, resize);
+        }
+    }
+    if (count > 0)
+        publishDifferences();
+    
+    return count;
+}
+
+// Describes the difference between the runs being compared. Returns 0 if there is nothing to show.
+int getCompareStatus(char *text, size_t size)
+{
+    CompareReport report;
+    const char *view = (CompareView == COMPARE_SPLIT) ? "split" : "difference";
+    
+    if (!Comparing)
+        return 0;
+    pthread_mutex_lock(&CompareLock);
+    report = DiffReport;
+    pthread_mutex_unlock(&CompareLock);
+    if (report.count == 0)
+        snprintf(text, size, "No pixels differ (%s view, D to switch)", view);
+    else
+        snprintf(text, size, "%llu pixels differ in (%i, %i) to (%i, %i) (%s view, D to switch)", (unsigned long long) report.count,
+            report.left, report.top, report.right, report.bottom, view);
+    
+    return 1;
+}
+
+// Parses one of the runs being compared into its own context. The last to finish ends parsing.
+void *CompareThreadFunc(void *arg)
+{
+    ParseContext *context = (ParseContext *) arg;
+    
+    Parser = context;
+    if (context->filename[0] == '\0')
+    {
+        ProcessPipe(STDIN_FILENO);
+        printf("Pipe read complete.\n\n");
+    }
+    else
+    {
+        ProcessFile(context->filename);
+        printf("File read complete (\"%s\").\n\n", context->filename);
+    }
+    
+    if (__atomic_sub_fetch(&CompareRunning, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        Parser = &MainParser;
+        FinishParsing();
+    }
+    
+    return NULL;
+}
+
+// Starts parsing the two runs, each on its own thread. Without a window, waits for both to
+// finish. Returns 0 if the first run has no input.
+int StartComparison(char *filename, int windowed)
+{
+    if (filename[0] == '\0' && isatty(fileno(stdin)))
+    {
+        Error("No input file specified\n\n");
+        return 0;
+    }
+    printf("Comparing \"%s\" with \"%s\"\n\n", (filename[0] == '\0') ? "standard input" : filename, CompareFilename);
+    
+    // The second run sends its draws to the compositor on the queue after the first's
+    InitParseContext(&CompareParser, 1);
+    MainParser.filename = filename;
+    CompareParser.filename = CompareFilename;
+    MainParser.graphicsFlag = CompareParser.graphicsFlag = 0;
+    CompareRunning = 2;
+    pthread_create(&CompareThreads[0], NULL, CompareThreadFunc, (void *) &MainParser);
+    pthread_create(&CompareThreads[1], NULL, CompareThreadFunc, (void *) &CompareParser);
+    if (!windowed)
+    {
+        pthread_join(CompareThreads[0], NULL);
+        pthread_join(CompareThreads[1], NULL);
+    }
+    
+    return 1;
+}
+
+// Writes the difference image of two finished runs and reports where they differ. Returns 0 if
+// the scenes match, 1 if they differ and 2 if either run didn't describe a scene.
+int SaveComparison(void)
+{
+    ParseContext *contexts[2] = {&MainParser, &CompareParser};
+    TileStore *image;
+    int side, width, height;
+    
+    for (side = 0; side < 2; side++)
+    {
+        if (contexts[side]->pixelStore.tiles == NULL)
+        {
+            Error("No scene was defined by \"%s\". No comparison was made.\n\n", contexts[side]->filename[0] ? contexts[side]->filename : "standard input");
             return 2;
         }
+        // The parsers are finished, so their stores are shared rather than copied
+        CompareScenes[side] = contexts[side]->pixelStore;
     }
+    resetDifferences();
+    publishDifferences();
+    if (DiffCount == 0)
+        printf("The scenes are identical.\n\n");
     else
-    {
-        // There's nothing on this line. Move on.
-        return 1;
-    }
+        printf("%llu pixels differ in (%i, %i) to (%i, %i).\n\n", (unsigned long long) DiffCount, DiffReport.left, DiffReport.top, DiffReport.right, DiffReport.bottom);
+    
+    compareViewSize(COMPARE_DIFFERENCE, &width, &height);
+    image = renderCompareView(COMPARE_DIFFERENCE, width, height);
+    if (writePNGStore(OutputFilename, outputLevel(image)))
+        printf("PNG file created.\n\n");
+    DeleteTileStore(image);
+    
+    return (DiffCount > 0);
 }
 
-// This function processes files.
-void ProcessFile(char *filename)
+// Small, fast generator so synthetic logs are the same on every platform
+uint64_t nextRandom(void)
 {
-    FILE *fp;
-    int lineNo = 1, dcheck = 0;
-    char *line = NULL;
-    size_t len;
-    ssize_t lsize;
+    GenSeed ^= GenSeed << 13;
+    GenSeed ^= GenSeed >> 7;
+    GenSeed ^= GenSeed << 17;
     
-    fp = fopen(filename, "r");
+    return GenSeed;
+}
+
+// Writes a synthetic DAMSON log: a header, the scene description, a mix of draw, debug and
+// malformed lines and the end summary. Returns 0 if the file could not be written.
+int GenerateLog(char *filename)
+{
+    static const char *filler = " lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut labore et dolore magna aliqua";
+    static const char *bad[5] = {"node %i: draw(%i, %i = %f %f %f\n", "node %i: draw(%i, %i) = %f x%f %f\n",
+        "node %i: draw(%i=, %i) = %f %f %f\n", "node %i: draw((%i, %i)) = %f %f %f\n", "node %i: draw(-%i, %i) = %f %f %f\n"};
+    FILE *fp;
+    long i;
+    int total = GenDraw + GenDebug + GenBad, pick, length, failed;
     
-    // Ensure file exists and can be read:
+    fp = fopen(filename, "w");
     if (fp == NULL)
     {
-        Error("\nError opening file. Ensure filename and path is valid.\n");
-        return;
+        Error("Unable to create \"%s\".\n\n", filename);
+        return 0;
     }
+    setvbuf(fp, NULL, _IOFBF, READ_BUFFER_SIZE);
+    total = (total < 1) ? 1 : total;
     
-    while((lsize = getline(&line, &len, fp)) != -1)
+    fprintf(fp, "DAMSON Version 1.0\n(C) Copyright UM Hills 2014\nThu Aug 07 12:00:00 2014\n");
+    fprintf(fp, "Setting scene dimensions: %i %i\n", GenWidth, GenHeight);
+    for (i = 0; i < GenLines; i++)
     {
-        if (lineNo <= 3 && !NoHeader)
+        pick = nextRandom() % total;
+        if (pick < GenDraw)
+            fprintf(fp, "node %i: draw(%i, %i) = %f %f %f\n", (int) (nextRandom() % 1000), (int) (nextRandom() % GenWidth), (int) (nextRandom() % GenHeight),
+                (nextRandom() % 1000001) / 1e6, (nextRandom() % 1000001) / 1e6, (nextRandom() % 1000001) / 1e6);
+        else if (pick < GenDraw + GenDebug)
         {
-            dcheck = DAMSONHeaderCheck(line, lineNo - 1);
-            if (dcheck < 1)
-            {
-                Error("Error processing header on line %i.\n\n", lineNo);
-                fclose(fp);
-                graphicsFlag = -1;
-                return;
-            }
+            // Debug chatter, padded to the requested length. Some are timeouts.
+            if (nextRandom() % 20 == 0)
+                length = fprintf(fp, "Timeout at tick %li", i);
+            else
+                length = fprintf(fp, "node %i: tick %li value = %i", (int) (nextRandom() % 1000), i, (int) (nextRandom() % 100000));
+            for (; length < GenLineLength; length += 120)
+                fprintf(fp, "%.*s", (GenLineLength - length < 120) ? GenLineLength - length : 120, filler);
+            fputc('\n', fp);
         }
         else
-        {
-            dcheck = ParseLine(line, lineNo);
-            if (dcheck < 1)
-            {
-                Error("Error processing script on line %i.\n\n", lineNo);
-                fclose(fp);
-                graphicsFlag = -1;
-                return;
-            }
-        }
-        lineNo++;
+            fprintf(fp, bad[nextRandom() % 5], (int) (nextRandom() % 1000), (int) (nextRandom() % GenWidth), (int) (nextRandom() % GenHeight), 0.5, 0.5, 0.5);
     }
-    // Once we're done, we should free up the memory that was used by the line variable
-    free(line);
-    fclose(fp);
+    if (GenFatal)
+        fprintf(fp, "node 0: error: synthetic failure\n");
+    fprintf(fp, "Workspace: 1234 KB\nExecution time 1.0s\nComputing time 0.9s\nStandby ticks 5\nAverage search length 2.0\n");
+    
+    failed = ferror(fp);
+    failed |= fclose(fp);
+    if (failed)
+    {
+        Error("Error writing \"%s\".\n\n", filename);
+        return 0;
+    }
+    printf("Generated %li lines in \"%s\".\n\n", GenLines + 9 + GenFatal, filename);
+    
+    return 1;
 }
 
-void *ProcessFileThread(void *arg)
+// Returns the parser to the state it starts in, so the same input can be parsed again
+void ResetParser(void)
 {
-    char *filename = (char *) arg;
+    FreeTileStore(&Parser->pixelStore);
+    free(Parser->headerLine1);
+    free(Parser->headerLine2);
+    free(Parser->headerLine3);
+    InitParseContext(Parser, Parser->queue);
+    Parser->graphicsFlag = 0;
+}
+
+// Takes a copy of the parser counters. When comparing runs, they're added together.
+void readStats(ParserStats *counts)
+{
+    uint64_t *from = (uint64_t *) &MainParser.stats, *second = (uint64_t *) &CompareParser.stats, *to = (uint64_t *) counts;
+    ParserStats producer;
+    size_t i;
+    int p;
     
-    ProcessFile(filename);
+    for (i = 0; i < sizeof(ParserStats) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED) + (Comparing ? __atomic_load_n(&second[i], __ATOMIC_RELAXED) : 0);
     
-    printf("File read complete.\n\n");
+    // Merged files are counted by their own parsers
+    for (p = 0; Merging && p < InputFileCount; p++)
+    {
+        readContextStats(&MergeContexts[p], &producer);
+        addStats(counts, &producer, 1);
+    }
+    
+    // Producers still connected keep counts of their own until they finish
+    pthread_mutex_lock(&ProducerLock);
+    for (p = 0; p < ProducerCount; p++)
+    {
+        readContextStats(&Producers[p]->context, &producer);
+        addStats(counts, &producer, 1);
+    }
+    pthread_mutex_unlock(&ProducerLock);
+}
+
+// Reads the counters of one parser while it may still be adding to them
+void readContextStats(ParseContext *context, ParserStats *counts)
+{
+    uint64_t *from = (uint64_t *) &context->stats, *to = (uint64_t *) counts;
+    size_t i;
+    
+    for (i = 0; i < sizeof(ParserStats) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+// Adds one set of counts to another, or takes them away if sign is negative. Only used on
+// counters that no other thread is writing.
+void addStats(ParserStats *counts, ParserStats *add, int sign)
+{
+    uint64_t *to = (uint64_t *) counts, *from = (uint64_t *) add;
+    size_t i;
+    
+    for (i = 0; i < sizeof(ParserStats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&to[i], (sign < 0) ? to[i] - from[i] : to[i] + from[i], __ATOMIC_RELAXED);
+}
+
+// Reads the parser counters and works out the rates since the sample was last taken
+void sampleStats(StatsSample *sample)
+{
+    ParserStats counts;
+    
+    readStats(&counts);
+    updateSample(sample, &counts);
+}
+
+// Takes a new sample of counts, working out the rates since the last one
+void updateSample(StatsSample *sample, ParserStats *counts)
+{
+    struct timespec now;
+    double seconds;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = (now.tv_sec - sample->time.tv_sec) + (now.tv_nsec - sample->time.tv_nsec) / 1e9;
+    if (sample->time.tv_sec != 0 && seconds > 0.0)
+    {
+        // The counts drop back if parallel workers read past the end of parsing
+        sample->linesPerSecond = (counts->lines > sample->counts.lines) ? (counts->lines - sample->counts.lines) / seconds : 0.0;
+        sample->bytesPerSecond = (counts->bytes > sample->counts.bytes) ? (counts->bytes - sample->counts.bytes) / seconds : 0.0;
+    }
+    sample->counts = *counts;
+    sample->time = now;
+}
+
+// Number of draw events waiting for the compositor
+unsigned int drawQueueDepth(void)
+{
+    unsigned int depth = 0;
+    int i;
+    
+    for (i = 0; i < DrawQueueCount && DrawQueues != NULL; i++)
+        depth += __atomic_load_n(&DrawQueues[i].head, __ATOMIC_RELAXED) - __atomic_load_n(&DrawQueues[i].tail, __ATOMIC_RELAXED);
+    return depth;
 }
 
-// This function processes files.
-void ProcessPipe()
+// Appends a sample of the parser counters to the statistics file
+void writeStatsRow(FILE *fp, StatsSample *sample)
 {
-    int ptr = 0, lineNo = 0, dcheck = 0, c, tries = 0;
-    char line[MAX_CHARS], ch;
+    ParserStats *counts = &sample->counts;
+    double fps;
+    int i;
     
-    // Initialise the line
-    memset(line, 0, MAX_CHARS);
+    __atomic_load(&AchievedFPS, &fps, __ATOMIC_RELAXED);
+    fprintf(fp, "%.3f,%llu,%llu,%llu,%llu,%llu", (sample->time.tv_sec - ActivityEpoch.tv_sec) + (sample->time.tv_nsec - ActivityEpoch.tv_nsec) / 1e9,
+        (unsigned long long) counts->lines, (unsigned long long) counts->bytes, (unsigned long long) counts->draws,
+        (unsigned long long) counts->debug, (unsigned long long) counts->timeouts);
+    for (i = 4; i <= 10; i++)
+        fprintf(fp, ",%llu", (unsigned long long) counts->warnings[i]);
+    fprintf(fp, ",%.0f,%.3f,%u,%llu,%.1f\n", sample->linesPerSecond, sample->bytesPerSecond / 1e6, drawQueueDepth(),
+        (unsigned long long) __atomic_load_n(&InputBuffered, __ATOMIC_RELAXED), fps);
+    fflush(fp);
+}
+
+// Writes the parser counters to the statistics file every StatsInterval seconds, and once more
+// when parsing ends
+void *StatsThreadFunc(void *arg)
+{
+    FILE *fp = (FILE *) arg;
+    StatsSample sample;
+    struct timespec wake;
+    int running = 1;
     
-    while((c = getchar()) && tries < 5)
+    memset(&sample, 0, sizeof(StatsSample));
+    sampleStats(&sample);
+    fprintf(fp, "seconds,lines,bytes,draws,debug,timeouts,warn4,warn5,warn6,warn7,warn8,warn9,warn10,lines_per_s,mb_per_s,draw_queue,input_buffered,fps\n");
+    while (running)
     {
-        if (c == EOF)
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += (time_t) StatsInterval;
+        wake.tv_nsec += (long) ((StatsInterval - (time_t) StatsInterval) * 1e9);
+        if (wake.tv_nsec >= 1000000000)
         {
-            tries++;
-            continue;
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
         }
-            
-        // Convert int to char
-        ch = (char) c;
-        // Add this character to the buffer
-        line[ptr++] = (char) ch;
+        pthread_mutex_lock(&StatsLock);
+        while (StatsRunning && pthread_cond_timedwait(&StatsWake, &StatsLock, &wake) != ETIMEDOUT);
+        running = StatsRunning;
+        pthread_mutex_unlock(&StatsLock);
         
-        // Check to see if the buffer should be emptied and the command processed.
-        if (ch == '\0' || ch == '\n')
-        {
-            lineNo++;
-            if (lineNo > 0 && lineNo <= 3 && !NoHeader)
-            {
-                dcheck = DAMSONHeaderCheck(&line, lineNo - 1);
-                if (dcheck < 1)
-                {
-                    Error("Error processing header on line %i.\n\n", lineNo);
-                    graphicsFlag = -1;
-                    return;
-                }
-            }
-            else if (lineNo > 3 || NoHeader)
-            {
-                dcheck = ParseLine(&line, lineNo);
-                if (dcheck < 1)
-                {
-                    Error("Error processing script on line %i.\n\n", lineNo);
-                    graphicsFlag = -1;
-                    return;
-                }
-            }
-            
-            // Reset the line buffer
-            ptr = 0;
-            memset(line, 0, MAX_CHARS);
-        }
+        sampleStats(&sample);
+        writeStatsRow(fp, &sample);
     }
-    // Check to see if the buffer is empty
-    if (ptr > 0)
+    fclose(fp);
+    
+    return NULL;
+}
+
+// Starts writing the parser counters to the statistics file
+void StartStatsThread(void)
+{
+    FILE *fp = fopen(StatsFilename, "w");
+    
+    if (fp == NULL)
     {
-        // Contents of buffer should be processed
-        lineNo++;
-        if (lineNo <= 3 && !NoHeader)
-        {
-            dcheck = DAMSONHeaderCheck(line, lineNo - 1);
-            if (dcheck < 1)
-            {
-                Error("Error processing header on line %i.\n\n", lineNo);
-                graphicsFlag = -1;
-                return;
-            }
-        }
-        else
-        {
-            dcheck = ParseLine(line, lineNo);
-            if (dcheck < 1)
-            {
-                Error("Error processing script on line %i.\n\n", lineNo);
-                graphicsFlag = -1;
-                return;
-            }
-        }
+        Error("Unable to create statistics file \"%s\".\n\n", StatsFilename);
+        return;
     }
-    // Once we're done, we should free up the memory that was used by the line variable
+    StatsRunning = 1;
+    pthread_create(&StatsThread, NULL, StatsThreadFunc, (void *) fp);
 }
 
-void *ProcessPipeThread(void)
+// Writes the final counts and closes the statistics file
+void StopStatsThread(void)
 {
-    ProcessPipe();
-    printf("Pipe read complete.\n");
+    pthread_mutex_lock(&StatsLock);
+    if (!StatsRunning)
+    {
+        pthread_mutex_unlock(&StatsLock);
+        return;
+    }
+    StatsRunning = 0;
+    pthread_cond_signal(&StatsWake);
+    pthread_mutex_unlock(&StatsLock);
+    pthread_join(StatsThread, NULL);
+}
+
+// Seconds since the given time
+double elapsedSeconds(struct timespec *start)
+{
+    struct timespec end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Prints the result of one benchmark stage and appends it to the CSV file
+void reportBenchmark(FILE *csv, char *input, const char *stage, double items, double bytes, double seconds, double draws)
+{
+    double nsPerDraw = (draws > 0) ? seconds * 1e9 / draws : 0.0;
+    
+    printf("     %-14s %12.0f items/s %10.1f MB/s %10.1f ns/draw\n", stage, items / seconds, bytes / seconds / 1e6, nsPerDraw);
+    if (csv != NULL)
+        fprintf(csv, "%i.%i.%i,%li,%s,%s,%.0f,%.0f,%.6f,%.1f,%.3f,%.3f\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, (long) time(NULL), input, stage, items, bytes, seconds, items / seconds, bytes / seconds / 1e6, nsPerDraw);
+}
+
+// Times each stage of the parser on the given log. ParseLine is timed on lines already in
+// memory; ProcessFile and ProcessPipe include reading the file. setPixel, fadeActivity and
+// writePNGFile are timed on the scene the log describes. Returns 0 if the log can't be read.
+int RunBenchmark(char *filename)
+{
+    struct timespec start;
+    struct stat st;
+    FILE *csv;
+    DrawEvent scene;
+    TileStore *times;
+    LineScan scan;
+    char *text, *line, *eol, pngName[64];
+    unsigned int *alpha;
+    long lines = 0, draws = 0, i, passes = 100, pixels, tile, size, scanned, differ;
+    uint16_t *handlers;
+    double seconds;
+    int fd, code, lineNo = 0;
+    
+    // Read the whole log first
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        Error("Unable to open \"%s\" for benchmarking.\n\n", filename);
+        return 0;
+    }
+    text = malloc(st.st_size + 1);
+    for (i = 0; i < st.st_size; i += code)
+        if ((code = read(fd, &text[i], st.st_size - i)) <= 0)
+            break;
+    close(fd);
+    text[i] = '\0';
+    size = i;
+    
+    csv = fopen(BenchmarkFilename, "a");
+    if (csv == NULL)
+        Error("Unable to open \"%s\". Results will not be saved.\n\n", BenchmarkFilename);
+    else if (ftell(csv) == 0)
+        fprintf(csv, "version,time,input,stage,items,bytes,seconds,items_per_s,mb_per_s,ns_per_draw\n");
+    
+    // ParseLine on lines held in memory
+    ResetParser();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (line = text; *line != '\0'; line = eol + 1)
+    {
+        eol = strchr(line, '\n');
+        if (eol == NULL)
+            eol = line + strlen(line) - 1;
+        else
+            *eol = '\0';
+        lineNo++;
+        if (lineNo <= 3 && !NoHeader)
+            code = DAMSONHeaderCheck(line, lineNo - 1);
+        else
+            code = ParseLine(line, lineNo);
+        if (code < 1)
+            break;
+        draws += (code == 100);
+    }
+    seconds = elapsedSeconds(&start);
+    lines = lineNo;
+    
+    printf("\nBenchmark of \"%s\" (%li lines, %li draws):\n", filename, lines, draws);
+    reportBenchmark(csv, filename, "ParseLine", lines, st.st_size, seconds, draws);
+    
+    // ScanLine with the recognizer, and with the keyword search it replaced. The lines have
+    // been split in place, so each scan stops at the end of its line.
+    handlers = malloc(sizeof(uint16_t) * (size + 1));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (line = text, scanned = 0; line < text + size; line += scan.length + 1)
+    {
+        ScanLine(line, &scan);
+        handlers[scanned++] = scan.handlers;
+    }
+    seconds = elapsedSeconds(&start);
+    reportBenchmark(csv, filename, "ScanLine", scanned, size, seconds, 0);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (line = text, scanned = 0, differ = 0; line < text + size; line += scan.length + 1)
+    {
+        ScanLineKeywords(line, &scan);
+        differ += (handlers[scanned++] != scan.handlers);
+    }
+    seconds = elapsedSeconds(&start);
+    reportBenchmark(csv, filename, "ScanKeywords", scanned, size, seconds, 0);
+    if (differ > 0)
+        printf("     The rules classify %li lines differently to the keyword search.\n", differ);
+    free(handlers);
+    free(text);
+    
+    // ProcessFile, on as many threads as requested
+    ResetParser();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ProcessFile(filename);
+    seconds = elapsedSeconds(&start);
+    reportBenchmark(csv, filename, "ProcessFile", lines, st.st_size, seconds, draws);
+    
+    // ProcessPipe, reading the log as a stream
+    ResetParser();
+    fd = open(filename, O_RDONLY);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ProcessPipe(fd);
+    seconds = elapsedSeconds(&start);
+    close(fd);
+    reportBenchmark(csv, filename, "ProcessPipe", lines, st.st_size, seconds, draws);
+    
+    if (Parser->pixelStore.tiles == NULL)
+    {
+        printf("     No scene was described. Drawing stages skipped.\n\n");
+        if (csv != NULL)
+            fclose(csv);
+        return 1;
+    }
+    pixels = (long) Parser->sceneWidth * Parser->sceneHeight;
+    
+    // setPixel on random pixels
+    GenSeed = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 10000000; i++)
+        setPixel(nextRandom() % Parser->sceneWidth, (GenSeed >> 32) % Parser->sceneHeight, 0.25, 0.5, 0.75);
+    seconds = elapsedSeconds(&start);
+    reportBenchmark(csv, filename, "setPixel", 10000000, 10000000.0 * sizeof(unsigned int), seconds, 10000000);
+    
+    // UpdateTileLevels building the whole pyramid of the scene
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    AddTileLevels(&Parser->pixelStore, MIP_AVERAGE);
+    UpdateTileLevels(&Parser->pixelStore, 32);
+    seconds = elapsedSeconds(&start);
+    reportBenchmark(csv, filename, "UpdateTileLevels", 1, pixels * sizeof(unsigned int), seconds, 0);
     
+    // fadeActivityTile over a scene that is entirely active
+    scene.type = DRAW_EVENT_SCENE;
+    scene.x = Parser->sceneWidth;
+    scene.y = Parser->sceneHeight;
+    applyDrawEvents(&Frames[0], &scene, 1, 1, 1);
+    times = &Frames[0].times;
+    alpha = malloc(TILE_BYTES);
+    ActivityClock = activityMillis();
+    for (tile = 0; tile < (long) times->tilesX * times->tilesY; tile++)
+        for (i = 0; i < TILE_SIZE * TILE_SIZE; i++)
+            allocateTile(times, tile)[i] = ActivityClock;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < passes; i++)
+        for (tile = 0; tile < (long) times->tilesX * times->tilesY; tile++)
+            fadeActivityTile(times->tiles[tile], alpha);
+    seconds = elapsedSeconds(&start);
+    free(alpha);
+    reportBenchmark(csv, filename, "fadeActivity", passes, passes * times->tileCount * 2.0 * TILE_BYTES, seconds, 0);
+    
+    // writePNGFile of the final scene
+    snprintf(pngName, sizeof(pngName), "benchmark_%i.png", (int) getpid());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    writePNGFile(pngName);
+    seconds = elapsedSeconds(&start);
+    unlink(pngName);
+    reportBenchmark(csv, filename, "writePNGFile", 1, pixels * sizeof(unsigned int), seconds, 0);
+    printf("\n");
+    
+    if (csv != NULL)
+    {
+        fclose(csv);
+        printf("Results appended to \"%s\".\n\n", BenchmarkFilename);
+    }
+    
+    return 1;
 }
 
 int main(int argc, char *argv[])
 {
     char *currObj, *parVal = "", *filename = "\0";
-    int i, n, a, isParam;
+    int i, n, a, isParam, windowed, status = 0;
     
     printf("\nDAMSON Parser ");
     printf("Version: %i.%i.%i (%s)\n", VERSION_MAJOR, VERSION_MINOR, VERSION_BUILD, VERSION_DATE);
     printf("Author: Andrew Hills (a.hills@sheffield.ac.uk)\n\n");
     
     // Initialise variables
-    memset(LastReadInstruction, 0, 256);
-    memset(LastReadErrorLine1, 0, 256);
-    memset(LastReadErrorLine2, 0, 256);
-    memset(WorkspaceMessage, 0, 256);
-    memset(ExecutionMessage, 0, 256);
-    memset(ComputingMessage, 0, 256);
-    memset(StandbyTkMessage, 0, 256);
-    memset(AvgSearchMessage, 0, 256);
+    InitParseContext(&MainParser, 0);
+    clock_gettime(CLOCK_MONOTONIC, &ActivityEpoch);
+    CompileRules(DefaultRules, sizeof(DefaultRules) / sizeof(LineRule));
     
     // Go through arguments (if any)
     for (i = 0; i < argc; i++)
@@ -998,6 +7256,22 @@ int main(int argc, char *argv[])
             parVal = currObj;
             if (!strcmp(parVal, "noheader"))
                 NoHeader = 1;
+            else if (!strcmp(parVal, "headless"))
+                Headless = 1;
+            else if (!strcmp(parVal, "follow"))
+                FollowInput = 1;
+            else if (!strcmp(parVal, "cache"))
+                CacheEnabled = 1;
+            else if (!strcmp(parVal, "replay"))
+                ReplayEnabled = 1;
+            else if (!strcmp(parVal, "fatal"))
+                GenFatal = 1;
+            else if (!strcmp(parVal, "parallel"))
+            {
+                // Use a thread for each processor
+                ParseThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                ParseThreads = (ParseThreads < 1) ? 1 : ParseThreads;
+            }
         }
         else
         {
@@ -1006,7 +7280,132 @@ int main(int argc, char *argv[])
             {
                 // There was previously a parameter, let's determine what's being set.
                 if (!strcmp(parVal, "filename"))
-                    filename = currObj;
+                    AddInputFiles(currObj);
+                else if (!strcmp(parVal, "output"))
+                    OutputFilename = currObj;
+                else if (!strcmp(parVal, "summary"))
+                    SummaryFilename = currObj;
+                else if (!strcmp(parVal, "keyframes"))
+                    KeyframeSpacing = (atoi(currObj) < 1) ? 1 : atoi(currObj);
+                else if (!strcmp(parVal, "maxkeyframes"))
+                    MaxKeyframes = (atoi(currObj) < 2) ? 2 : (atoi(currObj) & ~1);
+                else if (!strcmp(parVal, "replayrate"))
+                    ReplayLineRate = (atoi(currObj) < 1) ? 1 : atoi(currObj);
+                else if (!strcmp(parVal, "generate"))
+                    GenerateFilename = currObj;
+                else if (!strcmp(parVal, "benchmark"))
+                    BenchmarkInput = currObj;
+                else if (!strcmp(parVal, "benchout"))
+                    BenchmarkFilename = currObj;
+                else if (!strcmp(parVal, "lines"))
+                    GenLines = (atol(currObj) < 0) ? 0 : atol(currObj);
+                else if (!strcmp(parVal, "scene"))
+                {
+                    if (sscanf(currObj, "%ix%i", &GenWidth, &GenHeight) < 2 || GenWidth < 1 || GenHeight < 1)
+                    {
+                        Error("Scene sizes are given as WIDTHxHEIGHT.\n");
+                        GenWidth = 640;
+                        GenHeight = 480;
+                    }
+                }
+                else if (!strcmp(parVal, "mix"))
+                {
+                    if (sscanf(currObj, "%i:%i:%i", &GenDraw, &GenDebug, &GenBad) < 3 || GenDraw < 0 || GenDebug < 0 || GenBad < 0)
+                    {
+                        Error("The line mix is given as DRAW:DEBUG:MALFORMED, for example 60:35:5.\n");
+                        GenDraw = 60;
+                        GenDebug = 35;
+                        GenBad = 5;
+                    }
+                }
+                else if (!strcmp(parVal, "linelength"))
+                    GenLineLength = atoi(currObj);
+                else if (!strcmp(parVal, "seed"))
+                    GenSeed = (strtoull(currObj, NULL, 10) == 0) ? 1 : strtoull(currObj, NULL, 10);
+                else if (!strcmp(parVal, "benchparse"))
+                {
+                    BenchmarkDrawParsing((atol(currObj) < 1) ? 1 : atol(currObj));
+                    exit(0);
+                }
+                else if (!strcmp(parVal, "convert"))
+                    TraceOutputFilename = currObj;
+                else if (!strcmp(parVal, "trace"))
+                    TraceFilename = currObj;
+                else if (!strcmp(parVal, "compare"))
+                    CompareFilename = currObj;
+                else if (!strcmp(parVal, "timelapse"))
+                    TimelapseDir = currObj;
+                else if (!strcmp(parVal, "framestride"))
+                    FrameStride = (atoi(currObj) < 1) ? 1 : atoi(currObj);
+                else if (!strcmp(parVal, "frameunit"))
+                {
+                    if (!strcmp(currObj, "draws"))
+                        FrameUnit = FRAME_UNIT_DRAWS;
+                    else if (!strcmp(currObj, "lines"))
+                        FrameUnit = FRAME_UNIT_LINES;
+                    else if (!strcmp(currObj, "timeouts"))
+                        FrameUnit = FRAME_UNIT_TIMEOUTS;
+                    else
+                        Error("Unrecognised frame unit \"%s\". Use draws, lines or timeouts.\n", currObj);
+                }
+                else if (!strcmp(parVal, "maxframes"))
+                    MaxFramesInFlight = (atoi(currObj) < 1) ? 1 : atoi(currObj);
+                else if (!strcmp(parVal, "pnglevel"))
+                    PNGCompressionLevel = (atoi(currObj) < 0) ? 0 : ((atoi(currObj) > 9) ? 9 : atoi(currObj));
+                else if (!strcmp(parVal, "pngmip"))
+                    PNGMipLevel = (atoi(currObj) < 0) ? 0 : ((atoi(currObj) > 15) ? 15 : atoi(currObj));
+                else if (!strcmp(parVal, "pngfilter"))
+                {
+                    if (!strcmp(currObj, "none"))
+                        PNGFilter = PNG_FILTER_NONE;
+                    else if (!strcmp(currObj, "sub"))
+                        PNGFilter = PNG_FILTER_SUB;
+                    else if (!strcmp(currObj, "up"))
+                        PNGFilter = PNG_FILTER_UP;
+                    else if (!strcmp(currObj, "avg"))
+                        PNGFilter = PNG_FILTER_AVG;
+                    else if (!strcmp(currObj, "paeth"))
+                        PNGFilter = PNG_FILTER_PAETH;
+                    else if (!strcmp(currObj, "all"))
+                        PNGFilter = PNG_ALL_FILTERS;
+                    else
+                        Error("Unrecognised PNG filter \"%s\". Use none, sub, up, avg, paeth or all.\n", currObj);
+                }
+                else if (!strcmp(parVal, "fps"))
+                    MaxFPS = (atoi(currObj) < 1) ? 1 : ((atoi(currObj) > 1000) ? 1000 : atoi(currObj));
+                else if (!strcmp(parVal, "halflife"))
+                {
+                    ActivityHalfLife = atof(currObj);
+                    if (ActivityHalfLife <= 0.0)
+                    {
+                        Error("The activity half-life must be a positive number of seconds.\n");
+                        ActivityHalfLife = 0.5;
+                    }
+                }
+                else if (!strcmp(parVal, "statsfile"))
+                    StatsFilename = currObj;
+                else if (!strcmp(parVal, "statsinterval"))
+                {
+                    StatsInterval = atof(currObj);
+                    if (StatsInterval <= 0.0)
+                    {
+                        Error("The statistics interval must be a positive number of seconds.\n");
+                        StatsInterval = 1.0;
+                    }
+                }
+                else if (!strcmp(parVal, "rules"))
+                    RulesFilename = currObj;
+                else if (!strcmp(parVal, "listen"))
+                    ListenPath = currObj;
+                else if (!strcmp(parVal, "fifo"))
+                {
+                    if (FifoCount < MAX_FIFOS)
+                        FifoPaths[FifoCount++] = currObj;
+                    else
+                        Error("No more than %i FIFOs can be read. \"%s\" is ignored.\n", MAX_FIFOS, currObj);
+                }
+                else if (!strcmp(parVal, "threads"))
+                    ParseThreads = (atoi(currObj) < 1) ? 1 : atoi(currObj);
                 else
                     Error("Unrecognised input \"%s\"\n", parVal);
             }
@@ -1015,8 +7414,175 @@ int main(int argc, char *argv[])
         }
     }
     
+    // The rules are needed by everything that reads a log
+    if (RulesFilename != NULL && !LoadRules(RulesFilename))
+        exit(1);
+    
+    // Generating and benchmarking are run on their own
+    if (GenerateFilename != NULL)
+        exit(GenerateLog(GenerateFilename) ? 0 : 1);
+    if (BenchmarkInput != NULL)
+        exit(RunBenchmark(BenchmarkInput) ? 0 : 1);
+    
+    // Several files are merged onto one scene. A single match of a pattern is read as usual.
+    if (InputFileCount == 1)
+        filename = InputFiles[0];
+    
+    // Producers connecting over a socket or FIFOs replace any other input. Their lines arrive
+    // interleaved, so nothing recorded in the order of a single log is available.
+    if (ListenPath != NULL || FifoCount > 0)
+    {
+        if (filename[0] != '\0' || CompareFilename != NULL || TraceFilename != NULL)
+            printf("Producers are read in place of any input file, comparison or trace.\n\n");
+        if (TraceOutputFilename != NULL || ReplayEnabled || TimelapseDir != NULL)
+            printf("Traces, replays and time-lapses aren't available when reading producers.\n\n");
+        filename = "\0";
+        InputFileCount = 0;
+        CompareFilename = TraceFilename = TraceOutputFilename = TimelapseDir = NULL;
+        ReplayEnabled = 0;
+        ParseThreads = 1;
+    }
+    
+    // Merged files are parsed at once, so nothing recorded in the order of a single log is
+    // available. Each file has a thread, up to the number of processors or the thread limit.
+    if (InputFileCount > 1 && TraceFilename == NULL)
+    {
+        if (CompareFilename != NULL)
+            printf("Merged files can't be compared. The comparison is skipped.\n\n");
+        if (TraceOutputFilename != NULL || ReplayEnabled || TimelapseDir != NULL)
+            printf("Traces, replays and time-lapses aren't available when merging files.\n\n");
+        CompareFilename = TraceOutputFilename = TimelapseDir = NULL;
+        ReplayEnabled = 0;
+        if (ParseThreads == 1)
+            ParseThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        ParseThreads = (ParseThreads < 1) ? 1 : ((ParseThreads > InputFileCount) ? InputFileCount : ParseThreads);
+        Merging = 1;
+        PrepareMerge();
+    }
+    
+    // Only a single log named on the command line can be followed
+    if (FollowInput && (filename[0] == '\0' || Merging || CompareFilename != NULL || TraceFilename != NULL))
+    {
+        printf("Only a single log file can be followed.\n\n");
+        FollowInput = 0;
+    }
+    if (FollowInput && ParseThreads > 1)
+    {
+        printf("A followed log is parsed on a single thread.\n\n");
+        ParseThreads = 1;
+    }
+    
+    // A cache holds the final state of a single log, not the draws that led to it
+    if (CacheEnabled && (filename[0] == '\0' || Merging || FollowInput || CompareFilename != NULL || TraceFilename != NULL
+        || TraceOutputFilename != NULL || ReplayEnabled || TimelapseDir != NULL))
+    {
+        printf("The parse cache is only used for a single log without traces, replays, time-lapses or following.\n\n");
+        CacheEnabled = 0;
+    }
+    
+    // Two runs are compared as they're parsed. Each needs its own copy of anything recorded in
+    // order, so those features are left out.
+    if (CompareFilename != NULL)
+    {
+        if (TraceFilename != NULL || TraceOutputFilename != NULL || ReplayEnabled || TimelapseDir != NULL)
+            printf("Traces, replays and time-lapses aren't available when comparing runs.\n\n");
+        if (ParseThreads > 1)
+            printf("Each run is parsed on a single thread when comparing.\n\n");
+        TraceFilename = TraceOutputFilename = TimelapseDir = NULL;
+        ReplayEnabled = 0;
+        ParseThreads = 1;
+        Comparing = 1;
+    }
+    
+    // Prepare the time-lapse output directory
+    if (TimelapseDir != NULL)
+    {
+        if (mkdir(TimelapseDir, 0755) < 0 && errno != EEXIST)
+        {
+            Error("Unable to create time-lapse directory \"%s\".\n\n", TimelapseDir);
+            TimelapseDir = NULL;
+        }
+        else if (ParseThreads > 1)
+            printf("Time-lapse frames are captured in order. Parsing on a single thread.\n\n");
+    }
+    
+    // Prepare the trace file. Draws are recorded in order, so the log is parsed on a single thread.
+    if (TraceOutputFilename != NULL)
+    {
+        if (!OpenTraceOutput(TraceOutputFilename))
+            exit(1);
+        if (ParseThreads > 1)
+            printf("Traces are recorded in order. Parsing on a single thread.\n\n");
+        ParseThreads = 1;
+    }
+    // A log is replayed by reading it again from its keyframes, so it must be a file that can be
+    // read from any offset
+    if (ReplayEnabled && TraceFilename == NULL)
+    {
+        if (filename[0] == '\0' || DetectCompression(filename) != COMPRESSION_NONE)
+        {
+            printf("Only an uncompressed log file can be replayed. Convert the log to a trace with -convert to replay it.\n\n");
+            ReplayEnabled = 0;
+        }
+        else
+            ReplayLogName = filename;
+    }
+    if (ReplayEnabled && ParseThreads > 1)
+    {
+        printf("Draws are recorded for replay in order. Parsing on a single thread.\n\n");
+        ParseThreads = 1;
+    }
+    if (TraceFilename != NULL && TimelapseDir != NULL)
+    {
+        printf("Time-lapse frames are not captured when loading a trace.\n\n");
+        TimelapseDir = NULL;
+    }
+    
+    // Converting a log doesn't need a window
+    windowed = !Headless && TraceOutputFilename == NULL;
+    
+    if (StatsFilename != NULL)
+        StartStatsThread();
+    
+    // The visualiser is fed by the compositor thread
+    if (windowed)
+        StartCompositor();
+    
+    if (ListenPath != NULL || FifoCount > 0)
+    {
+        if (!StartListening())
+            exit(2);
+        Parser->graphicsFlag = 0;
+        if (windowed)
+            pthread_create(&procThread, NULL, ListenThread, 0);
+        else
+            ListenThread(NULL);
+    }
+    else if (Merging)
+    {
+        Parser->graphicsFlag = 0;
+        if (windowed)
+            pthread_create(&procThread, NULL, MergeFilesThread, 0);
+        else
+            MergeFilesThread(NULL);
+    }
+    else if (Comparing)
+    {
+        if (!StartComparison(filename, windowed))
+            exit(2);
+    }
+    else if (TraceFilename != NULL)
+    {
+        // A binary trace replaces the log
+        printf("Trace file \"%s\" specified\n\n", TraceFilename);
+        Parser->graphicsFlag = 0;
+        if (windowed)
+            pthread_create(&procThread, NULL, LoadTraceThread, (void *) TraceFilename);
+        else
+            LoadTraceThread((void *) TraceFilename);
+    }
     // Quick check to see if the filename variable was specified.
-    if (filename[0] == '\0')
+    else if (filename[0] == '\0')
     {
         // No. At this point, we could check for piped input.
         if (isatty(fileno(stdin)))
@@ -1028,8 +7594,12 @@ int main(int argc, char *argv[])
         {
             // Connection is not connected to a terminal. Could be a pipe or file.
             
-            graphicsFlag = 0;
-            pthread_create(&procThread, NULL, ProcessPipeThread, 0);
+            Parser->graphicsFlag = 0;
+            // Without a window, there's nothing else to do while parsing
+            if (!windowed)
+                ProcessPipeThread(NULL);
+            else
+                pthread_create(&procThread, NULL, ProcessPipeThread, 0);
         }
     }
     else
@@ -1038,14 +7608,31 @@ int main(int argc, char *argv[])
         printf("Input file \"%s\" specified\n\n", filename);
         
         // Set the graphics flag and then create a thread
-        graphicsFlag = 0;
-        pthread_create(&procThread, NULL, ProcessFileThread, (void *) filename);
+        Parser->graphicsFlag = 0;
+        if (!windowed)
+            ProcessFileThread((void *) filename);
+        else
+            pthread_create(&procThread, NULL, ProcessFileThread, (void *) filename);
     }
-    while(graphicsFlag == 0)
+    
+    // A converted trace is finished once the log has been parsed
+    if (TraceOutputFilename != NULL)
     {
-        // Do nothing
+        status = FinishTraceOutput();
+        if (!Headless)
+            exit(status);
     }
-    if (graphicsFlag == 1)
+    
+    // In headless mode, the results are written out and GLUT is never started
+    if (Headless)
+        exit(Comparing ? SaveComparison() : (SaveHeadlessOutput() | status));
+    
+    // Wait for the scene to be described, or for parsing to end without one
+    pthread_mutex_lock(&GraphicsLock);
+    while ((MainParser.graphicsFlag == 0 || (Comparing && CompareParser.graphicsFlag == 0)) && !ParsingComplete)
+        pthread_cond_wait(&GraphicsReady, &GraphicsLock);
+    pthread_mutex_unlock(&GraphicsLock);
+    if (MainParser.graphicsFlag == 1 || (Comparing && CompareParser.graphicsFlag == 1))
     {
         initialiseGLUT(argc, argv);
         glutMainLoop();